@@ -0,0 +1,576 @@
+/*
+ * sconf_bench - measure parse, load, dump, lookup and destroy throughput
+ *
+ * usage: sconf_bench [-s size] [-r runs] [-c corpus] [-g dir]
+ *
+ * Synthetic corpora of about size MiB (default 8) are generated in memory
+ * from a fixed seed, so runs on different releases see the same input.
+ * Each operation is run runs times (default 5) and the fastest run is
+ * reported, one tab-separated line per corpus and operation:
+ *
+ *   corpus op bytes items ms mb_s items_s allocs peak_bytes maxrss_kb
+ *
+ * bytes and items are what the operation went through (input or output
+ * bytes, nodes or lookups), allocs and peak_bytes are counted by a
+ * default allocator installed for the run, maxrss_kb is the peak RSS of
+ * the process so far. With -g the corpora are written to dir and nothing
+ * is measured.
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "sconf.h"
+
+struct buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+struct stats {
+	unsigned long allocs;
+	size_t live;
+	size_t peak;
+};
+
+struct result {
+	size_t bytes;
+	size_t items;
+	double ms;
+	unsigned long allocs;
+	size_t peak;
+};
+
+#define ALLOC_HDR 16
+
+static struct stats stats;
+static uint64_t rng;
+
+/*
+ * ---------------------------------------------------------------------------
+ * counting allocator
+ * ---------------------------------------------------------------------------
+ */
+
+static void *
+count_alloc(void *ud, size_t size)
+{
+	char *p;
+
+	(void)ud;
+	p = (char *)malloc(size + ALLOC_HDR);
+	if (p == NULL) return (NULL);
+
+	memcpy(p, &size, sizeof(size));
+	stats.allocs++;
+	stats.live += size;
+	if (stats.live > stats.peak) stats.peak = stats.live;
+
+	return (p + ALLOC_HDR);
+}
+
+static void *
+count_realloc(void *ud, void *ptr, size_t size)
+{
+	size_t old;
+	char *p;
+
+	(void)ud;
+	p = (char *)ptr - ALLOC_HDR;
+	memcpy(&old, p, sizeof(old));
+	p = (char *)realloc(p, size + ALLOC_HDR);
+	if (p == NULL) return (NULL);
+
+	memcpy(p, &size, sizeof(size));
+	stats.allocs++;
+	stats.live = stats.live - old + size;
+	if (stats.live > stats.peak) stats.peak = stats.live;
+
+	return (p + ALLOC_HDR);
+}
+
+static void
+count_free(void *ud, void *ptr)
+{
+	size_t old;
+	char *p;
+
+	(void)ud;
+	p = (char *)ptr - ALLOC_HDR;
+	memcpy(&old, p, sizeof(old));
+	stats.live -= old;
+	free(p);
+}
+
+static const struct sconf_allocator count_mem = {
+	count_alloc,
+	count_realloc,
+	count_free,
+	NULL
+};
+
+/*
+ * ---------------------------------------------------------------------------
+ * corpora
+ * ---------------------------------------------------------------------------
+ */
+
+static uint32_t
+rand32(void)
+{
+	rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+	return ((uint32_t)(rng >> 33));
+}
+
+static void
+buf_printf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;)
+	{
+		va_start(ap, fmt);
+		n = vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) abort();
+		if ((size_t)n < b->cap - b->len) break;
+
+		b->cap = (b->cap + (size_t)n + 1) * 2;
+		b->s = (char *)realloc(b->s, b->cap);
+		if (b->s == NULL) abort();
+	}
+	b->len += (size_t)n;
+}
+
+static void
+gen_word(struct buf *b, size_t len)
+{
+	size_t i;
+
+	if (b->len + len >= b->cap)
+	{
+		b->cap = (b->cap + len + 1) * 2;
+		b->s = (char *)realloc(b->s, b->cap);
+		if (b->s == NULL) abort();
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		b->s[b->len++] = (char)('a' + rand32() % 26);
+	}
+	b->s[b->len] = '\0';
+}
+
+/* one huge list of atoms */
+static void
+gen_flat(struct buf *b, size_t size)
+{
+	while (b->len < size)
+	{
+		if (rand32() & 1)
+		{
+			buf_printf(b, "%u ", rand32() % 100000);
+		}
+		else
+		{
+			buf_printf(b, "sym%u ", rand32() % 1000);
+		}
+	}
+}
+
+/* chains of lists nested a few hundred levels deep */
+static void
+gen_deep(struct buf *b, size_t size)
+{
+	unsigned int depth;
+	unsigned int i;
+
+	while (b->len < size)
+	{
+		depth = 100 + rand32() % 400;
+		for (i = 0; i < depth; i++) buf_printf(b, "(n%u ", i);
+		buf_printf(b, "leaf");
+		for (i = 0; i < depth; i++) buf_printf(b, ")");
+		buf_printf(b, "\n");
+	}
+}
+
+static void
+gen_strings(struct buf *b, size_t size)
+{
+	while (b->len < size)
+	{
+		buf_printf(b, "(entry \"");
+		gen_word(b, 16 + rand32() % 100);
+		if (rand32() % 8 == 0) buf_printf(b, "\\n\\\"quoted\\\"\\t");
+		buf_printf(b, "\" \"");
+		gen_word(b, 8 + rand32() % 40);
+		buf_printf(b, "\")\n");
+	}
+}
+
+static void
+gen_numbers(struct buf *b, size_t size)
+{
+	int i;
+
+	while (b->len < size)
+	{
+		buf_printf(b, "(");
+		for (i = 0; i < 8; i++)
+		{
+			if (rand32() & 1)
+			{
+				buf_printf(b, " %d", (int32_t)rand32());
+			}
+			else
+			{
+				buf_printf(b, " %.17g", (double)rand32() / (rand32() | 1));
+			}
+		}
+		buf_printf(b, ")\n");
+	}
+}
+
+static void
+gen_comments(struct buf *b, size_t size)
+{
+	int i;
+
+	while (b->len < size)
+	{
+		buf_printf(b, ";;");
+		for (i = 2 + (int)(rand32() % 12); i > 0; i--)
+		{
+			buf_printf(b, " ");
+			gen_word(b, 2 + rand32() % 8);
+		}
+		buf_printf(b, "\n  (k%u %u)\n", rand32() % 50, rand32() % 10000);
+	}
+}
+
+/* configuration-like association lists */
+static void
+gen_alist(struct buf *b, size_t size)
+{
+	unsigned int n;
+	unsigned int i;
+
+	for (n = 0; b->len < size; n++)
+	{
+		buf_printf(b, "(service%u\n  (name \"svc-%u\")\n  (port %u)\n"
+				   "  (enabled %s)\n  (ratio %.3f)\n  (tags",
+				   n, n, 1024 + rand32() % 60000,
+				   (rand32() & 1) ? "yes" : "no",
+				   (double)(rand32() % 1000) / 1000.0);
+		for (i = rand32() % 6; i > 0; i--)
+		{
+			buf_printf(b, " t%u", rand32() % 32);
+		}
+		buf_printf(b, ")\n  (limits (cpu %u) (memory %u)))\n",
+				   rand32() % 64, rand32() % 65536);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*gen)(struct buf *b, size_t size);
+} corpora[] = {
+	{ "flat",     gen_flat },
+	{ "deep",     gen_deep },
+	{ "strings",  gen_strings },
+	{ "numbers",  gen_numbers },
+	{ "comments", gen_comments },
+	{ "alist",    gen_alist },
+};
+
+#define NCORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+/* every corpus is a single list, as sconf_parse_with_len() reads one */
+static void
+generate(struct buf *b, size_t i, size_t size)
+{
+	rng = 0x5c0f + i;
+	b->len = 0;
+	buf_printf(b, "(");
+	corpora[i].gen(b, size);
+	buf_printf(b, ")\n");
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * measures
+ * ---------------------------------------------------------------------------
+ */
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6);
+}
+
+static void
+measure_begin(double *t)
+{
+	stats.allocs = 0;
+	stats.peak = stats.live;
+	*t = now_ms();
+}
+
+static void
+measure_end(struct result *best, double t, size_t base)
+{
+	double ms;
+
+	ms = now_ms() - t;
+	if (best->ms < 0 || ms < best->ms)
+	{
+		best->ms = ms;
+		best->allocs = stats.allocs;
+		best->peak = stats.peak - base;
+	}
+}
+
+static size_t
+count_nodes(const struct sconf *sexp)
+{
+	const struct sconf *child;
+	size_t n;
+
+	n = 1;
+	if (sconf_is_list(sexp))
+	{
+		for (child = sexp->value.as_child; child != NULL; child = child->next)
+		{
+			n += count_nodes(child);
+		}
+	}
+
+	return (n);
+}
+
+/* look every element of every list up by index */
+static size_t
+walk_index(struct sconf *sexp)
+{
+	struct sconf *child;
+	size_t n;
+	int size;
+	int i;
+
+	n = 0;
+	size = sconf_list_size(sexp);
+	for (i = 0; i < size; i++)
+	{
+		child = sconf_list_at(sexp, i);
+		n++;
+		if (sconf_is_list(child)) n += walk_index(child);
+	}
+
+	return (n);
+}
+
+static void
+report(const char *corpus, const char *op, const struct result *r)
+{
+	struct rusage ru;
+	double sec;
+
+	getrusage(RUSAGE_SELF, &ru);
+	sec = (r->ms > 0) ? r->ms / 1e3 : 1e-9;
+	printf("%s\t%s\t%zu\t%zu\t%.3f\t%.1f\t%.0f\t%lu\t%zu\t%ld\n",
+		   corpus, op, r->bytes, r->items, r->ms,
+		   (double)r->bytes / sec / (1024.0 * 1024.0),
+		   (double)r->items / sec, r->allocs, r->peak, ru.ru_maxrss);
+	fflush(stdout);
+}
+
+static int
+bench(const char *name, const struct buf *b, int runs)
+{
+	struct result parse = { b->len, 0, -1, 0, 0 };
+	struct result load = { b->len, 0, -1, 0, 0 };
+	struct result dump = { 0, 0, -1, 0, 0 };
+	struct result lookup = { b->len, 0, -1, 0, 0 };
+	struct result destroy = { b->len, 0, -1, 0, 0 };
+	struct sconf *sexp;
+	size_t base;
+	size_t n;
+	FILE *in;
+	FILE *out;
+	double t;
+	int i;
+
+	in = tmpfile();
+	out = tmpfile();
+	if (in == NULL || out == NULL
+		|| fwrite(b->s, 1, b->len, in) != b->len)
+	{
+		perror("sconf_bench");
+		return (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < runs; i++)
+	{
+		base = stats.live;
+		measure_begin(&t);
+		sexp = sconf_parse_with_len(b->s, b->len);
+		measure_end(&parse, t, base);
+		if (sexp == NULL) goto fail;
+		parse.items = count_nodes(sexp);
+
+		measure_begin(&t);
+		n = walk_index(sexp);
+		measure_end(&lookup, t, base);
+		lookup.items = n;
+
+		rewind(out);
+		measure_begin(&t);
+		sconf_dump(out, sexp);
+		fflush(out);
+		measure_end(&dump, t, base);
+		dump.bytes = (size_t)ftell(out);
+		dump.items = parse.items;
+
+		measure_begin(&t);
+		sconf_destroy(sexp);
+		measure_end(&destroy, t, base);
+		destroy.items = parse.items;
+
+		measure_begin(&t);
+		sexp = sconf_load(in);
+		measure_end(&load, t, base);
+		if (sexp == NULL) goto fail;
+		load.items = parse.items;
+		sconf_destroy(sexp);
+	}
+
+	report(name, "parse", &parse);
+	report(name, "load", &load);
+	report(name, "dump", &dump);
+	report(name, "list_at", &lookup);
+	report(name, "destroy", &destroy);
+
+	fclose(in);
+	fclose(out);
+	return (EXIT_SUCCESS);
+
+fail:
+	fprintf(stderr, "sconf_bench: %s: %s\n", name,
+			sconf_error_str(sconf_get_last_error()));
+	fclose(in);
+	fclose(out);
+	return (EXIT_FAILURE);
+}
+
+static int
+write_corpus(const char *dir, const char *name, const struct buf *b)
+{
+	char path[4096];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s.scm", dir, name);
+	fp = fopen(path, "w");
+	if (fp == NULL || fwrite(b->s, 1, b->len, fp) != b->len)
+	{
+		perror(path);
+		if (fp != NULL) fclose(fp);
+		return (EXIT_FAILURE);
+	}
+	fclose(fp);
+
+	return (EXIT_SUCCESS);
+}
+
+static void
+usage(const char *prg)
+{
+	fprintf(stderr, "usage: %s [-s size] [-r runs] [-c corpus] [-g dir]\n",
+			prg);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct buf b = { NULL, 0, 0 };
+	const char *only;
+	const char *dir;
+	size_t size;
+	size_t i;
+	int runs;
+	int ret;
+	int c;
+
+	size = 8;
+	runs = 5;
+	only = NULL;
+	dir = NULL;
+	while ((c = getopt(argc, argv, "s:r:c:g:")) != -1)
+	{
+		switch (c)
+		{
+		case 's':
+			size = (size_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'c':
+			only = optarg;
+			break;
+		case 'g':
+			dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (size == 0 || runs <= 0) usage(argv[0]);
+	size *= 1024 * 1024;
+
+	b.cap = size + 4096;
+	b.s = (char *)malloc(b.cap);
+	if (b.s == NULL)
+	{
+		perror("sconf_bench");
+		return (EXIT_FAILURE);
+	}
+
+	sconf_set_allocator(&count_mem);
+
+	if (dir == NULL)
+	{
+		printf("# sconf %s\n", sconf_version());
+		printf("#corpus\top\tbytes\titems\tms\tmb_s\titems_s\tallocs"
+			   "\tpeak_bytes\tmaxrss_kb\n");
+	}
+
+	ret = EXIT_SUCCESS;
+	for (i = 0; i < NCORPORA && ret == EXIT_SUCCESS; i++)
+	{
+		if (only != NULL && strcmp(only, corpora[i].name) != 0) continue;
+
+		generate(&b, i, size);
+		if (dir != NULL)
+		{
+			ret = write_corpus(dir, corpora[i].name, &b);
+		}
+		else
+		{
+			ret = bench(corpora[i].name, &b, runs);
+		}
+	}
+
+	free(b.s);
+	return (ret);
+}
@@ -1,17 +1,58 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+#include <float.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+# include <pthread.h>
+# include <sched.h>
+# define USE_PTHREAD 1
+#endif /* HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE */
+#if defined(USE_PTHREAD) && defined(HAVE_SYS_INOTIFY_H) \
+	&& defined(HAVE_INOTIFY_INIT1)
+# include <poll.h>
+# include <sys/inotify.h>
+# define USE_INOTIFY 1
+#endif /* USE_PTHREAD && HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1 */
+#if !defined(SCONF_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+# include <immintrin.h>
+# define USE_SSE2 1
+# define USE_AVX2 1
+#endif /* !SCONF_NO_SIMD && __GNUC__ && __x86_64__ */
 #include "sconf.h"
-#ifdef HAVE_CONFIG_H
-# include "config.h"
-#endif /* HAVE_CONFIG_H */
+#include "sconf_pow5.h"
 
 #ifndef PACKAGE_VERSION
 # define PACKAGE_VERSION "?.?.?"
 #endif
 
-static enum sconf_error sconf_last_error = SCONF_OK;
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+	&& !defined(__STDC_NO_THREADS__)
+# define THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+# define THREAD_LOCAL __thread
+#else
+# define THREAD_LOCAL
+#endif
+
+/* each thread sees its own errors */
+static THREAD_LOCAL enum sconf_error sconf_last_error = SCONF_OK;
+static THREAD_LOCAL struct sconf_location error_loc;
+static THREAD_LOCAL enum sconf_error error_loc_err = SCONF_OK;
 
 const char *
 sconf_version(void)
@@ -25,6 +66,19 @@ sconf_get_last_error(void)
 	return (sconf_last_error);
 }
 
+int
+sconf_get_error_location(struct sconf_location *loc)
+{
+	/* the location only holds for the error it was recorded with */
+	if (error_loc_err == SCONF_OK || error_loc_err != sconf_last_error)
+	{
+		return (SCONF_FALSE);
+	}
+
+	if (loc != NULL) *loc = error_loc;
+	return (SCONF_TRUE);
+}
+
 const char *
 sconf_error_str(enum sconf_error err)
 {
@@ -40,44 +94,200 @@ sconf_error_str(enum sconf_error err)
 		return ("object is not a list");
 	case SCONF_ERR_EOF:
 		return ("unexpected eof");
+	case SCONF_ERR_IO:
+		return ("failed to read input");
+	case SCONF_ERR_ABORTED:
+		return ("aborted by handler");
+	case SCONF_ERR_DEPTH:
+		return ("maximum nesting depth exceeded");
+	case SCONF_ERR_NUMBER:
+		return ("invalid or out of range number");
+	case SCONF_ERR_FORMAT:
+		return ("invalid binary data");
+	case SCONF_ERR_QUERY:
+		return ("invalid query");
+	case SCONF_ERR_SYMBOL:
+		return ("symbol cannot be written");
 	default:
 		return ("???");
 	}
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * memory
+ * ---------------------------------------------------------------------------
+ */
+
+static void *
+libc_alloc(void *ud, size_t size)
+{
+	(void)ud;
+	return (malloc(size));
+}
+
+static void *
+libc_realloc(void *ud, void *ptr, size_t size)
+{
+	(void)ud;
+	return (realloc(ptr, size));
+}
+
+static void
+libc_free(void *ud, void *ptr)
+{
+	(void)ud;
+	free(ptr);
+}
+
+static const struct sconf_allocator libc_mem = {
+	libc_alloc,
+	libc_realloc,
+	libc_free,
+	NULL
+};
+
+/* objects outside documents, pools and tapes come from here */
+static const struct sconf_allocator *heap_mem = &libc_mem;
+
+void
+sconf_set_allocator(const struct sconf_allocator *mem)
+{
+	heap_mem = (mem != NULL) ? mem : &libc_mem;
+}
+
+void
+sconf_free(void *ptr)
+{
+	if (ptr != NULL) heap_mem->free(heap_mem->ud, ptr);
+}
+
+static inline void *
+mem_alloc(const struct sconf_allocator *mem, size_t size)
+{
+	return (mem->alloc(mem->ud, size));
+}
+
+static inline void *
+mem_realloc(const struct sconf_allocator *mem, void *ptr, size_t size)
+{
+	if (ptr == NULL) return (mem->alloc(mem->ud, size));
+
+	return (mem->realloc(mem->ud, ptr, size));
+}
+
+static inline void
+mem_free(const struct sconf_allocator *mem, void *ptr)
+{
+	if (ptr != NULL) mem->free(mem->ud, ptr);
+}
+
+static void *
+mem_calloc(const struct sconf_allocator *mem, size_t n, size_t size)
+{
+	void *ptr;
+
+	if (size != 0 && n > (size_t)-1 / size) return (NULL);
+
+	ptr = mem->alloc(mem->ud, n * size);
+	if (ptr != NULL) memset(ptr, 0, n * size);
+
+	return (ptr);
+}
+
+static char *
+mem_strdup(const struct sconf_allocator *mem, const char *str)
+{
+	size_t len;
+	char *ptr;
+
+	len = strlen(str) + 1;
+	ptr = (char *)mem->alloc(mem->ud, len);
+	if (ptr != NULL) memcpy(ptr, str, len);
+
+	return (ptr);
+}
+
+static inline const struct sconf_allocator *
+opts_mem(const struct sconf_opts *opts)
+{
+	if (opts == NULL || opts->allocator == NULL) return (heap_mem);
+
+	return (opts->allocator);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * objects
+ * ---------------------------------------------------------------------------
+ */
+
 static inline struct sconf *
 sconf_new(void)
 {
 	struct sconf *sexp;
 
-	sexp = (struct sconf *)malloc(sizeof(struct sconf));
+	sexp = (struct sconf *)mem_alloc(heap_mem, sizeof(struct sconf));
 	if (sexp == NULL)
 	{
 		sconf_last_error = SCONF_ERR_MALLOC;
 		return (NULL);
 	}
 
+	sexp->flags = 0;
+	sexp->view_len = 0;
 	sexp->next = NULL;
 	sexp->prev = NULL;
 
 	return (sexp);
 }
 
+/*
+ * Lists are allocated behind a pointer to their index, see
+ * sconf_list_index(), so that other objects do not pay for it. The flag
+ * SCONF_F_INDEXABLE follows the allocation, not the type of the object.
+ */
+struct sconf_index;
+
+struct list_obj {
+	struct sconf_index *index;
+	struct sconf sexp;
+};
+
+#define LIST_OBJ(lst) \
+	((struct list_obj *)((char *)(lst) - offsetof(struct list_obj, sexp)))
+
+static inline struct sconf *
+list_init(struct list_obj *obj, unsigned int flags)
+{
+	obj->index = NULL;
+	obj->sexp.type = SCONF_T_LIST;
+	obj->sexp.flags = (uint16_t)(flags | SCONF_F_INDEXABLE);
+	obj->sexp.view_len = 0;
+	obj->sexp.next = NULL;
+	obj->sexp.prev = NULL;
+	obj->sexp.value.as_child = NULL;
+
+	return (&obj->sexp);
+}
+
 struct sconf *
 sconf_new_list(void)
 {
-	struct sconf *sexp;
+	struct list_obj *obj;
 
-	sexp = sconf_new();
-	if (sexp == NULL) return (NULL);
-	sexp->type = SCONF_T_LIST;
-	sexp->value.as_child = NULL;
+	obj = (struct list_obj *)mem_alloc(heap_mem, sizeof(struct list_obj));
+	if (obj == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
 
-	return (sexp);
+	return (list_init(obj, 0));
 }
 
 struct sconf *
-sconf_new_int(int i)
+sconf_new_int(int64_t i)
 {
 	struct sconf *sexp;
 
@@ -148,10 +358,10 @@ sconf_new_symbol(const char *sym)
 
 	sexp = sconf_new();
 	if (sexp == NULL) return (NULL);
-	ptr = strdup(sym);
+	ptr = mem_strdup(heap_mem, sym);
 	if (ptr == NULL)
 	{
-		free(sexp);
+		mem_free(heap_mem, sexp);
 		sconf_last_error = SCONF_ERR_MALLOC;
 		return (NULL);
 	}
@@ -186,6 +396,49 @@ sconf_new_nil(void)
 	return (sexp);
 }
 
+/*
+ * Lists with at least this many elements can be indexed by
+ * sconf_list_index(): their length, an array of their elements and a
+ * hash table of their keys are kept in a single block.
+ */
+#define LIST_INDEX_MIN 16
+
+struct assoc_slot {
+	size_t hash;
+	struct sconf *entry;  /* NULL for an empty slot */
+};
+
+struct sconf_index {
+	size_t count;
+	struct sconf **items;
+	struct assoc_slot *slots;
+	size_t mask;
+};
+
+static inline struct sconf_index *
+list_index_get(const struct sconf *lst)
+{
+	if (lst->type != SCONF_T_LIST || !(lst->flags & SCONF_F_INDEXABLE))
+	{
+		return (NULL);
+	}
+
+	return (LIST_OBJ(lst)->index);
+}
+
+/* document indexes live in the arena and go away with it */
+static void
+list_index_drop(struct sconf *lst)
+{
+	if (!(lst->flags & SCONF_F_INDEXABLE)) return;
+
+	if (!(lst->flags & SCONF_F_ARENA))
+	{
+		mem_free(heap_mem, LIST_OBJ(lst)->index);
+	}
+	LIST_OBJ(lst)->index = NULL;
+}
+
 int
 sconf_list_append(struct sconf *lst, struct sconf *itm)
 {
@@ -196,6 +449,7 @@ sconf_list_append(struct sconf *lst, struct sconf *itm)
 		return (SCONF_FALSE);
 	}
 
+	list_index_drop(lst);
 	child = lst->value.as_child;
 
 	if (child == NULL)
@@ -252,6 +506,7 @@ sconf_list_remove(struct sconf *lst, struct sconf *itm)
 		return (SCONF_FALSE);
 	}
 
+	list_index_drop(lst);
 	if (itm != child)
 	{
 		itm->prev->next = itm->next;
@@ -281,9 +536,13 @@ sconf_list_size(const struct sconf *lst)
 {
 	int sz;
 	struct sconf *tmp;
+	struct sconf_index *idx;
 
 	if (lst == NULL) return (-1);
 
+	idx = list_index_get(lst);
+	if (idx != NULL) return ((int)idx->count);
+
 	sz = 0;
 	for (tmp = lst->value.as_child; tmp != NULL; tmp = tmp->next)
 	{
@@ -298,6 +557,7 @@ sconf_list_at(const struct sconf *lst, int idx)
 {
 	int curr_idx;
 	struct sconf *tmp;
+	struct sconf_index *index;
 
 	if (lst == NULL)
 	{
@@ -307,6 +567,13 @@ sconf_list_at(const struct sconf *lst, int idx)
 
 	if (idx < 0) goto err_outofbound;
 
+	index = list_index_get(lst);
+	if (index != NULL)
+	{
+		if ((size_t)idx >= index->count) goto err_outofbound;
+		return (index->items[idx]);
+	}
+
 	curr_idx = 0;
 	for (tmp = lst->value.as_child; tmp != NULL; tmp = tmp->next)
 	{
@@ -319,6 +586,175 @@ err_outofbound:
 	return (NULL);
 }
 
+/* the bytes of a symbol, views included */
+static inline void
+symbol_bytes(const struct sconf *sym, const char **ptr, size_t *len)
+{
+	if (sym->flags & SCONF_F_VIEW)
+	{
+		*ptr = sym->value.as_view;
+		*len = sym->view_len;
+	}
+	else
+	{
+		*ptr = sym->value.as_string;
+		*len = strlen(*ptr);
+	}
+}
+
+/* key of an alist entry: the symbol heading a list */
+static inline int
+assoc_key(const struct sconf *entry, const char **ptr, size_t *len)
+{
+	const struct sconf *head;
+
+	if (entry->type != SCONF_T_LIST) return (SCONF_FALSE);
+
+	head = entry->value.as_child;
+	if (head == NULL || head->type != SCONF_T_SYMBOL) return (SCONF_FALSE);
+
+	symbol_bytes(head, ptr, len);
+	return (SCONF_TRUE);
+}
+
+/* FNV-1a, also used to intern symbols */
+static inline size_t
+str_hash(const char *key, size_t len)
+{
+	uint64_t h;
+	size_t i;
+
+	h = UINT64_C(0xcbf29ce484222325);
+	for (i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)key[i]) * UINT64_C(0x100000001b3);
+	}
+
+	return ((size_t)h);
+}
+
+/* find key in the hash table, or the empty slot where it would go */
+static struct assoc_slot *
+assoc_probe(const struct sconf_index *idx, const char *key, size_t len,
+			size_t hash)
+{
+	struct assoc_slot *slot;
+	const char *ptr;
+	size_t n;
+	size_t i;
+
+	for (i = hash & idx->mask;; i = (i + 1) & idx->mask)
+	{
+		slot = idx->slots + i;
+		if (slot->entry == NULL) return (slot);
+		if (slot->hash != hash) continue;
+
+		if (assoc_key(slot->entry, &ptr, &n) == SCONF_TRUE && n == len
+			&& memcmp(ptr, key, len) == 0)
+		{
+			return (slot);
+		}
+	}
+}
+
+/*
+ * Size of the index block of a list of n elements, or 0 if the list is
+ * too short to be worth indexing or was not allocated with room for one.
+ */
+static size_t
+list_index_size(const struct sconf *lst, size_t *count, size_t *cap)
+{
+	struct sconf *tmp;
+	size_t n;
+
+	if (!(lst->flags & SCONF_F_INDEXABLE)) return (0);
+
+	n = 0;
+	for (tmp = lst->value.as_child; tmp != NULL; tmp = tmp->next) n++;
+	if (n < LIST_INDEX_MIN) return (0);
+
+	/* keep the load factor under 1/2 */
+	for (*cap = 2 * LIST_INDEX_MIN; *cap < n * 2; *cap <<= 1)
+		;
+
+	*count = n;
+	return (sizeof(struct sconf_index) + n * sizeof(struct sconf *)
+			+ *cap * sizeof(struct assoc_slot));
+}
+
+/* lay the index out in block and attach it to lst */
+static void
+list_index_build(struct sconf *lst, void *block, size_t count, size_t cap)
+{
+	struct sconf_index *idx;
+	struct assoc_slot *slot;
+	struct sconf *tmp;
+	const char *ptr;
+	size_t hash;
+	size_t len;
+	size_t n;
+
+	idx = (struct sconf_index *)block;
+	idx->count = count;
+	idx->items = (struct sconf **)(idx + 1);
+	idx->slots = (struct assoc_slot *)(idx->items + count);
+	idx->mask = cap - 1;
+	memset(idx->slots, 0, cap * sizeof(struct assoc_slot));
+
+	n = 0;
+	for (tmp = lst->value.as_child; tmp != NULL; tmp = tmp->next)
+	{
+		idx->items[n++] = tmp;
+		if (assoc_key(tmp, &ptr, &len) != SCONF_TRUE) continue;
+
+		hash = str_hash(ptr, len);
+		slot = assoc_probe(idx, ptr, len, hash);
+		/* the first entry with a key wins, like a linear search */
+		if (slot->entry == NULL)
+		{
+			slot->hash = hash;
+			slot->entry = tmp;
+		}
+	}
+
+	LIST_OBJ(lst)->index = idx;
+}
+
+struct sconf *
+sconf_assoc_get(const struct sconf *lst, const char *key)
+{
+	struct sconf_index *idx;
+	struct sconf *tmp;
+	const char *ptr;
+	size_t keylen;
+	size_t len;
+
+	if (!sconf_is_list(lst) || key == NULL)
+	{
+		sconf_last_error = SCONF_ERR_NOTALIST;
+		return (NULL);
+	}
+
+	keylen = strlen(key);
+	idx = list_index_get(lst);
+	if (idx != NULL)
+	{
+		return (assoc_probe(idx, key, keylen,
+							str_hash(key, keylen))->entry);
+	}
+
+	for (tmp = lst->value.as_child; tmp != NULL; tmp = tmp->next)
+	{
+		if (assoc_key(tmp, &ptr, &len) == SCONF_TRUE && len == keylen
+			&& memcmp(ptr, key, len) == 0)
+		{
+			return (tmp);
+		}
+	}
+
+	return (NULL);
+}
+
 struct sconf *
 sconf_list_first(const struct sconf *lst)
 {
@@ -361,555 +797,7387 @@ sconf_list_empty(const struct sconf *lst)
 void
 sconf_destroy(struct sconf *sexp)
 {
+	struct sconf *work;
 	struct sconf *cur;
-	struct sconf *next;
+	struct sconf *child;
 
 	if (sexp == NULL) return;
 
-	if (sexp->type == SCONF_T_SYMBOL
-		|| sexp->type == SCONF_T_STRING)
-	{
-		free(sexp->value.as_string);
-	}
-	else if (sexp->type == SCONF_T_LIST)
+	/* objects left to free are chained through their next field, the
+	 * children of a list are spliced in front so nothing recurses. */
+	sexp->next = NULL;
+	work = sexp;
+	while (work != NULL)
 	{
-		cur = sexp->value.as_child;
-		while (cur != NULL)
-		{
-			next = cur->next;
-			sconf_destroy(cur);
-			cur = next;
-		}
-	}
-
-	free(sexp);
-}
+		cur = work;
+		work = cur->next;
 
-static void
-dump_level(FILE *fp, const struct sconf *sexp, int level)
-{
-	struct sconf *child;
-
-	if (fp == NULL || sexp == NULL) return;
-
-	switch (sexp->type)
-	{
-	case SCONF_T_SYMBOL:
-		fprintf(fp, "%s", sexp->value.as_string);
-		break;
-	case SCONF_T_STRING:
-		fprintf(fp, "\"%s\"", sexp->value.as_string);
-		break;
-	case SCONF_T_INT:
-		fprintf(fp, "%d", sexp->value.as_int);
-		break;
-	case SCONF_T_DOUBLE:
-		fprintf(fp, "%f", sexp->value.as_double);
-		break;
-	case SCONF_T_NIL:
-		fprintf(fp, "nil");
-		break;
-	case SCONF_T_BOOL:
-		if (sexp->value.as_int == SCONF_TRUE)
-		{
-			fprintf(fp, "true");
-		}
-		else
-		{
-			fprintf(fp, "false");
-		}
-		break;
-	case SCONF_T_CHAR:
-		fprintf(fp, "%c", (char)sexp->value.as_int);
-		break;
-	case SCONF_T_LIST: /* XXX: rework indentation */
-		if (level > 1)
+		if ((cur->type == SCONF_T_SYMBOL || cur->type == SCONF_T_STRING)
+			&& !(cur->flags & (SCONF_F_VIEW | SCONF_F_INTERNED)))
 		{
-			fprintf(fp, "\n");
+			mem_free(heap_mem, cur->value.as_string);
 		}
-		fprintf(fp, "%*s", level, "(");
-		for (child = sexp->value.as_child;
-			 child != NULL;
-			 child = child->next)
+		else if (cur->type == SCONF_T_LIST)
 		{
-			dump_level(fp, child, level+1);
-			if (child->next != NULL)
+			list_index_drop(cur);
+			child = cur->value.as_child;
+			if (child != NULL)
 			{
-				fprintf(fp, " ");
+				child->prev->next = work;
+				work = child;
 			}
 		}
-		fprintf(fp, ")");
-		break;
-	}
-}
 
-void
-sconf_dump(FILE *fp, const struct sconf *sexp)
-{
-	dump_level(fp, sexp, 1);
+		mem_free(heap_mem, (cur->flags & SCONF_F_INDEXABLE)
+				 ? (void *)LIST_OBJ(cur) : (void *)cur);
+	}
 }
 
 /*
  * ---------------------------------------------------------------------------
- * parser
+ * arena
  * ---------------------------------------------------------------------------
  */
 
-struct cstr {
+struct arena_chunk {
+	struct arena_chunk *next;
 	size_t cap;
-	size_t cnt;
-	char *s;
+	size_t used;
 };
 
-struct parser {
+struct arena {
+	struct arena_chunk *head;
+	size_t next_cap;
+	const struct sconf_allocator *mem;
+};
+
+struct source {
 	const char *data;
 	size_t len;
-	size_t off;
-	struct cstr buff;
+	void *map;   /* mmap'ed file, if any */
+	char *buf;   /* heap copy, if any */
+	const struct sconf_allocator *mem; /* of buf */
 };
 
-#define CSTR_BASE_CAP 8
+/* distinct symbols of a document, stored once in its arena */
+struct intern {
+	struct arena *arena;
+	struct intern_str **slots;
+	size_t mask;
+	size_t count;
+};
 
-static inline void
-cstr_init(struct cstr *cs)
-{
-	cs->cap = 0;
-	cs->cnt = 0;
-	cs->s = NULL;
-}
+struct intern_str {
+	const struct intern *owner;
+	size_t hash;
+	size_t len;
+	char s[];
+};
+
+struct sconf_doc {
+	struct arena arena;
+	struct intern symbols;
+	struct sconf *root;
+	struct source src; /* input kept alive for views */
+};
+
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1024 * 1024)
+#define ARENA_NODE_ALIGN (sizeof(double) > sizeof(void *) \
+						  ? sizeof(double) : sizeof(void *))
+#define CHUNK_DATA(c) ((char *)((c) + 1))
 
 static inline void
-cstr_destroy(struct cstr *cs)
+arena_init(struct arena *a, size_t hint, const struct sconf_allocator *mem)
 {
-	cs->cap = 0;
-	cs->cnt = 0;
-	free(cs->s);
-	cs->s = NULL;
+	a->head = NULL;
+	a->mem = mem;
+	if (hint < ARENA_MIN_CHUNK)
+	{
+		hint = ARENA_MIN_CHUNK;
+	}
+	else if (hint > ARENA_MAX_CHUNK)
+	{
+		hint = ARENA_MAX_CHUNK;
+	}
+	a->next_cap = hint;
+}
+
+static void
+arena_destroy(struct arena *a)
+{
+	struct arena_chunk *chunk;
+	struct arena_chunk *next;
+
+	for (chunk = a->head; chunk != NULL; chunk = next)
+	{
+		next = chunk->next;
+		mem_free(a->mem, chunk);
+	}
+	a->head = NULL;
+}
+
+static inline char *
+arena_fit(struct arena_chunk *chunk, size_t sz, size_t align)
+{
+	uintptr_t base;
+	uintptr_t ptr;
+
+	base = (uintptr_t)CHUNK_DATA(chunk);
+	ptr = (base + chunk->used + align - 1) & ~(uintptr_t)(align - 1);
+	if (ptr + sz > base + chunk->cap) return (NULL);
+
+	chunk->used = (ptr + sz) - base;
+	return ((char *)ptr);
+}
+
+static void *
+arena_alloc(struct arena *a, size_t sz, size_t align)
+{
+	struct arena_chunk *chunk;
+	size_t cap;
+	char *ptr;
+
+	if (a->head != NULL)
+	{
+		ptr = arena_fit(a->head, sz, align);
+		if (ptr != NULL) return (ptr);
+	}
+
+	cap = a->next_cap;
+	if (sz + align > cap)
+	{
+		/* oversized request, give it its own chunk and keep the
+		 * current one open for the following small allocations. */
+		cap = sz + align;
+	}
+
+	chunk = (struct arena_chunk *)mem_alloc(a->mem,
+											 sizeof(struct arena_chunk) + cap);
+	if (chunk == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	chunk->cap = cap;
+	chunk->used = 0;
+
+	if (cap != a->next_cap && a->head != NULL)
+	{
+		chunk->next = a->head->next;
+		a->head->next = chunk;
+	}
+	else
+	{
+		chunk->next = a->head;
+		a->head = chunk;
+		if (a->next_cap < ARENA_MAX_CHUNK)
+		{
+			a->next_cap *= 2;
+		}
+	}
+
+	return (arena_fit(chunk, sz, align));
+}
+
+/*
+ * Index lst if it is long enough, in the arena of its document or on the
+ * heap for a list of its own.
+ */
+static int
+list_index_new(struct sconf *lst, struct arena *arena)
+{
+	void *block;
+	size_t count;
+	size_t cap;
+	size_t sz;
+
+	if (list_index_get(lst) != NULL) return (SCONF_TRUE);
+
+	sz = list_index_size(lst, &count, &cap);
+	if (sz == 0) return (SCONF_TRUE);
+
+	if (arena != NULL)
+	{
+		block = arena_alloc(arena, sz, ARENA_NODE_ALIGN);
+	}
+	else
+	{
+		block = mem_alloc(heap_mem, sz);
+		if (block == NULL) sconf_last_error = SCONF_ERR_MALLOC;
+	}
+	if (block == NULL) return (SCONF_FALSE);
+
+	list_index_build(lst, block, count, cap);
+	return (SCONF_TRUE);
+}
+
+int
+sconf_list_index(struct sconf *lst)
+{
+	if (!sconf_is_list(lst) || (lst->flags & SCONF_F_ARENA))
+	{
+		sconf_last_error = SCONF_ERR_NOTALIST;
+		return (SCONF_FALSE);
+	}
+
+	return (list_index_new(lst, NULL));
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * symbols
+ * ---------------------------------------------------------------------------
+ */
+
+#define INTERN_BASE_CAP 64
+
+#define INTERN_STR(str) \
+	((const struct intern_str *)((str) - offsetof(struct intern_str, s)))
+
 static inline void
-cstr_reset(struct cstr *cs)
+intern_init(struct intern *t, struct arena *arena)
 {
-	cs->cnt = 0;
+	t->arena = arena;
+	t->slots = NULL;
+	t->mask = 0;
+	t->count = 0;
 }
 
 static inline void
-cstr_grow(struct cstr *cs)
+intern_fini(struct intern *t)
 {
-	if (cs->cap < (cs->cnt + 1))
+	mem_free(t->arena->mem, t->slots);
+	t->slots = NULL;
+}
+
+static struct intern_str **
+intern_probe(const struct intern *t, const char *str, size_t len, size_t hash)
+{
+	struct intern_str **slot;
+	size_t i;
+
+	for (i = hash & t->mask;; i = (i + 1) & t->mask)
 	{
-		cs->cap = cs->cap >= CSTR_BASE_CAP ? cs->cap * 2 : CSTR_BASE_CAP;
-		cs->s = realloc(cs->s, cs->cap * sizeof(char));
+		slot = t->slots + i;
+		if (*slot == NULL
+			|| ((*slot)->hash == hash && (*slot)->len == len
+				&& memcmp((*slot)->s, str, len) == 0))
+		{
+			return (slot);
+		}
 	}
 }
 
-static void
-cstr_append(struct cstr *cs, char c)
+static int
+intern_grow(struct intern *t)
 {
-	cstr_grow(cs);
-	cs->s[cs->cnt++] = c;
-}
+	struct intern_str **old;
+	struct intern_str **slot;
+	size_t cap;
+	size_t i;
+
+	old = t->slots;
+	cap = (old == NULL) ? INTERN_BASE_CAP : (t->mask + 1) * 2;
+	t->slots = (struct intern_str **)mem_calloc(t->arena->mem, cap,
+												 sizeof(struct intern_str *));
+	if (t->slots == NULL)
+	{
+		t->slots = old;
+		return (SCONF_FALSE);
+	}
 
-static int parse_value(struct sconf *itm, struct parser *p);
+	if (old != NULL)
+	{
+		for (i = 0; i <= t->mask; i++)
+		{
+			if (old[i] == NULL) continue;
 
-static inline int
-parse_get(const struct parser *p)
+			slot = intern_probe(t, old[i]->s, old[i]->len, old[i]->hash);
+			*slot = old[i];
+		}
+		mem_free(t->arena->mem, old);
+	}
+	t->mask = cap - 1;
+
+	return (SCONF_TRUE);
+}
+
+/* the unique copy of str, or NULL if out of memory */
+static const char *
+intern_get(struct intern *t, const char *str, size_t len)
 {
-	int c;
+	struct intern_str **slot;
+	struct intern_str *is;
+	size_t hash;
 
-	if (p->off >= p->len) return (EOF);
+	/* keep the load factor under 1/2 */
+	if (t->slots == NULL || (t->count + 1) * 2 > t->mask + 1)
+	{
+		if (intern_grow(t) != SCONF_TRUE) return (NULL);
+	}
 
-	c = *(p->data + p->off);
-	if (c == '\0') return (EOF);
+	hash = str_hash(str, len);
+	slot = intern_probe(t, str, len, hash);
+	if (*slot != NULL) return ((*slot)->s);
 
-	return (c);
+	is = (struct intern_str *)arena_alloc(t->arena,
+										  sizeof(struct intern_str) + len + 1,
+										  sizeof(void *));
+	if (is == NULL) return (NULL);
+
+	is->owner = t;
+	is->hash = hash;
+	is->len = len;
+	memcpy(is->s, str, len);
+	is->s[len] = '\0';
+
+	*slot = is;
+	t->count++;
+	return (is->s);
 }
 
-static inline int
-parse_next(struct parser *p)
+/* the unique copy of str if t holds it, NULL otherwise */
+static const char *
+intern_find(const struct intern *t, const char *str, size_t len)
 {
-	int c;
+	struct intern_str **slot;
 
-	c = parse_get(p);
-	if (c == EOF) return (EOF);
+	if (t->slots == NULL) return (NULL);
 
-	p->off++;
+	slot = intern_probe(t, str, len, str_hash(str, len));
+	return ((*slot != NULL) ? (*slot)->s : NULL);
+}
 
-	return (c);
+int
+sconf_symbol_eq(const struct sconf *a, const struct sconf *b)
+{
+	const char *pa;
+	const char *pb;
+	size_t la;
+	size_t lb;
+
+	if (!sconf_is_symbol(a) || !sconf_is_symbol(b)) return (SCONF_FALSE);
+
+	if (a->flags & b->flags & SCONF_F_INTERNED)
+	{
+		if (a->value.as_string == b->value.as_string) return (SCONF_TRUE);
+
+		/* one table never holds the same symbol twice */
+		if (INTERN_STR(a->value.as_string)->owner
+			== INTERN_STR(b->value.as_string)->owner)
+		{
+			return (SCONF_FALSE);
+		}
+	}
+
+	symbol_bytes(a, &pa, &la);
+	symbol_bytes(b, &pb, &lb);
+	return ((la == lb && memcmp(pa, pb, la) == 0) ? SCONF_TRUE : SCONF_FALSE);
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * input
+ * ---------------------------------------------------------------------------
+ */
+
+#define SOURCE_BASE_CAP 8192
+
 static void
-parse_comment(struct parser *p)
+source_release(struct source *src)
 {
-	int c;
+#ifdef USE_MMAP
+	if (src->map != NULL)
+	{
+		munmap(src->map, src->len);
+	}
+#endif /* USE_MMAP */
+	if (src->buf != NULL) mem_free(src->mem, src->buf);
+	memset(src, 0, sizeof(struct source));
+}
 
-	c = parse_next(p);
-	while (c != EOF)
+static int
+source_reserve(struct source *src, size_t *cap)
+{
+	char *tmp;
+
+	if (*cap - src->len > 0) return (SCONF_TRUE);
+
+	*cap = *cap >= SOURCE_BASE_CAP ? *cap * 2 : SOURCE_BASE_CAP;
+	tmp = (char *)mem_realloc(src->mem, src->buf, *cap);
+	if (tmp == NULL)
 	{
-		c = parse_next(p);
-		if (c == '\n') return;
+		source_release(src);
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
 	}
+	src->buf = tmp;
+
+	return (SCONF_TRUE);
 }
 
-static void
-parse_skip(struct parser *p)
+static int
+source_finish(struct source *src)
 {
-redo:
-	while (isspace(parse_get(p)))
+	if (src->len == 0)
 	{
-		p->off++;
+		source_release(src);
+		sconf_last_error = SCONF_ERR_EOF;
+		return (SCONF_FALSE);
 	}
 
-	if (parse_get(p) == ';')
+	src->data = src->buf;
+	return (SCONF_TRUE);
+}
+
+/* read a whole stream, seekable or not */
+static int
+source_load_stream(struct source *src, FILE *fp,
+				   const struct sconf_allocator *mem)
+{
+	size_t cap;
+	size_t n;
+	long fsz;
+
+	memset(src, 0, sizeof(struct source));
+	src->mem = mem;
+
+	cap = 0;
+	if (fseek(fp, 0, SEEK_END) == 0)
 	{
-		parse_comment(p);
-		goto redo;
+		fsz = ftell(fp);
+		rewind(fp);
+		if (fsz > 0)
+		{
+			/* one spare byte, so the EOF is hit without regrowing */
+			cap = (size_t)fsz + 1;
+			src->buf = (char *)mem_alloc(mem, cap);
+			if (src->buf == NULL)
+			{
+				sconf_last_error = SCONF_ERR_MALLOC;
+				return (SCONF_FALSE);
+			}
+		}
+	}
+
+	for (;;)
+	{
+		if (source_reserve(src, &cap) != SCONF_TRUE) return (SCONF_FALSE);
+
+		n = fread(src->buf + src->len, 1, cap - src->len, fp);
+		src->len += n;
+		if (n == 0) break;
 	}
+
+	if (ferror(fp))
+	{
+		source_release(src);
+		sconf_last_error = SCONF_ERR_IO;
+		return (SCONF_FALSE);
+	}
+
+	return (source_finish(src));
 }
 
+/*
+ * Map regular files if map is set, read everything else (pipes, sockets,
+ * ttys). A mapping sees later writes to the file, so it is only used for
+ * input released right after parsing, never for input a document keeps.
+ */
 static int
-parse_list(struct sconf *itm, struct parser *p)
+source_load_fd(struct source *src, int fd, const struct sconf_allocator *mem,
+			   int map)
 {
-	int c;
-	struct sconf *tmp;
+	struct stat st;
+	size_t cap;
+	ssize_t n;
 
-	itm->type = SCONF_T_LIST;
-	itm->value.as_child = NULL;
+	memset(src, 0, sizeof(struct source));
+	src->mem = mem;
 
-	do
+	if (fstat(fd, &st) != 0)
 	{
-		parse_skip(p);
-		c = parse_get(p);
-		if (c == ')')
+		sconf_last_error = SCONF_ERR_IO;
+		return (SCONF_FALSE);
+	}
+
+#ifdef USE_MMAP
+	if (map && S_ISREG(st.st_mode) && st.st_size > 0
+		&& (unsigned long long)st.st_size <= (size_t)-1)
+	{
+		src->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+						fd, 0);
+		if (src->map != MAP_FAILED)
 		{
-			p->off++;
+# ifdef HAVE_MADVISE
+			madvise(src->map, (size_t)st.st_size, MADV_SEQUENTIAL);
+# endif /* HAVE_MADVISE */
+			src->data = (const char *)src->map;
+			src->len = (size_t)st.st_size;
 			return (SCONF_TRUE);
 		}
-		else if (c == EOF)
+		src->map = NULL;
+	}
+#else
+	(void)map;
+#endif /* USE_MMAP */
+
+	cap = 0;
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		cap = (size_t)st.st_size + 1;
+		src->buf = (char *)mem_alloc(mem, cap);
+		if (src->buf == NULL)
+		{
+			sconf_last_error = SCONF_ERR_MALLOC;
+			return (SCONF_FALSE);
+		}
+	}
+
+	for (;;)
+	{
+		if (source_reserve(src, &cap) != SCONF_TRUE) return (SCONF_FALSE);
+
+		n = read(fd, src->buf + src->len, cap - src->len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+
+			source_release(src);
+			sconf_last_error = SCONF_ERR_IO;
+			return (SCONF_FALSE);
+		}
+		if (n == 0) break;
+		src->len += (size_t)n;
+	}
+
+	return (source_finish(src));
+}
+
+static int
+source_load_path(struct source *src, const char *path,
+				 const struct sconf_allocator *mem, int map)
+{
+	int fd;
+	int ret;
+
+	if (path == NULL) return (SCONF_FALSE);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		sconf_last_error = SCONF_ERR_IO;
+		return (SCONF_FALSE);
+	}
+
+	ret = source_load_fd(src, fd, mem, map);
+	close(fd);
+
+	return (ret);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * lexer kernels
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Each kernel returns the index of the first byte of s[0, len) matching
+ * its class, or len. NUL always matches except for lex_space_end(), the
+ * parser treats it as the end of input.
+ *
+ *  - space_end: first byte that is not " \t\n\v\f\r"
+ *  - delim:     first of " \t\n\v\f\r()" or NUL (end of a symbol)
+ *  - quote:     first of '"', '\\' or NUL (inside a string)
+ *  - newline:   first of '\n' or NUL (inside a comment)
+ */
+struct lex_ops {
+	size_t (*space_end)(const char *s, size_t len);
+	size_t (*delim)(const char *s, size_t len);
+	size_t (*quote)(const char *s, size_t len);
+	size_t (*newline)(const char *s, size_t len);
+};
+
+/*
+ * Character classes, indexed by byte. This does not go through <ctype.h>
+ * so the syntax does not change with the host application's locale.
+ */
+#define CC_SPACE    0x01 /* " \t\n\v\f\r" */
+#define CC_DELIM    0x02 /* ends a symbol: blanks, parens and NUL */
+#define CC_DIGIT    0x04
+#define CC_ALPHA    0x08
+#define CC_NUMSTART 0x10 /* may start a number: digits and '-' */
+
+#define CC_SPACE_DELIM (CC_SPACE | CC_DELIM)
+#define CC_DIGITS      (CC_DIGIT | CC_NUMSTART)
+
+static const unsigned char char_class[256] = {
+	['\0'] = CC_DELIM,
+	['\t'] = CC_SPACE_DELIM, ['\n'] = CC_SPACE_DELIM,
+	['\v'] = CC_SPACE_DELIM, ['\f'] = CC_SPACE_DELIM,
+	['\r'] = CC_SPACE_DELIM, [' '] = CC_SPACE_DELIM,
+	['('] = CC_DELIM, [')'] = CC_DELIM,
+	['-'] = CC_NUMSTART,
+	['0'] = CC_DIGITS, ['1'] = CC_DIGITS, ['2'] = CC_DIGITS, ['3'] = CC_DIGITS,
+	['4'] = CC_DIGITS, ['5'] = CC_DIGITS, ['6'] = CC_DIGITS, ['7'] = CC_DIGITS,
+	['8'] = CC_DIGITS, ['9'] = CC_DIGITS,
+	['A'] = CC_ALPHA, ['B'] = CC_ALPHA, ['C'] = CC_ALPHA, ['D'] = CC_ALPHA,
+	['E'] = CC_ALPHA, ['F'] = CC_ALPHA, ['G'] = CC_ALPHA, ['H'] = CC_ALPHA,
+	['I'] = CC_ALPHA, ['J'] = CC_ALPHA, ['K'] = CC_ALPHA, ['L'] = CC_ALPHA,
+	['M'] = CC_ALPHA, ['N'] = CC_ALPHA, ['O'] = CC_ALPHA, ['P'] = CC_ALPHA,
+	['Q'] = CC_ALPHA, ['R'] = CC_ALPHA, ['S'] = CC_ALPHA, ['T'] = CC_ALPHA,
+	['U'] = CC_ALPHA, ['V'] = CC_ALPHA, ['W'] = CC_ALPHA, ['X'] = CC_ALPHA,
+	['Y'] = CC_ALPHA, ['Z'] = CC_ALPHA,
+	['a'] = CC_ALPHA, ['b'] = CC_ALPHA, ['c'] = CC_ALPHA, ['d'] = CC_ALPHA,
+	['e'] = CC_ALPHA, ['f'] = CC_ALPHA, ['g'] = CC_ALPHA, ['h'] = CC_ALPHA,
+	['i'] = CC_ALPHA, ['j'] = CC_ALPHA, ['k'] = CC_ALPHA, ['l'] = CC_ALPHA,
+	['m'] = CC_ALPHA, ['n'] = CC_ALPHA, ['o'] = CC_ALPHA, ['p'] = CC_ALPHA,
+	['q'] = CC_ALPHA, ['r'] = CC_ALPHA, ['s'] = CC_ALPHA, ['t'] = CC_ALPHA,
+	['u'] = CC_ALPHA, ['v'] = CC_ALPHA, ['w'] = CC_ALPHA, ['x'] = CC_ALPHA,
+	['y'] = CC_ALPHA, ['z'] = CC_ALPHA,
+};
+
+#define CHAR_IS(c, cc) (char_class[(unsigned char)(c)] & (cc))
+
+/* portable fallback, 8 bytes at a time */
+
+#define SWAR_ONES UINT64_C(0x0101010101010101)
+#define SWAR_HIGH UINT64_C(0x8080808080808080)
+#define SWAR_ZERO(v) (((v) - SWAR_ONES) & ~(v) & SWAR_HIGH)
+#define SWAR_HAS(v, c) SWAR_ZERO((v) ^ (SWAR_ONES * (uint8_t)(c)))
+/* some byte is below c, c <= 128 */
+#define SWAR_LESS(v, c) (((v) - SWAR_ONES * (uint8_t)(c)) & ~(v) & SWAR_HIGH)
+
+static size_t
+lex_space_end_swar(const char *s, size_t len)
+{
+	size_t i;
+
+	/* blanks come in short runs, a word-wise test would not pay off */
+	for (i = 0; i < len && CHAR_IS(s[i], CC_SPACE); i++)
+		;
+
+	return (i);
+}
+
+static size_t
+lex_delim_swar(const char *s, size_t len)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, s + i, 8);
+		if (SWAR_ZERO(v) | SWAR_HAS(v, ' ') | SWAR_HAS(v, '(')
+			| SWAR_HAS(v, ')') | SWAR_HAS(v, '\t') | SWAR_HAS(v, '\n')
+			| SWAR_HAS(v, '\v') | SWAR_HAS(v, '\f') | SWAR_HAS(v, '\r'))
+		{
+			break;
+		}
+	}
+
+	for (; i < len && !CHAR_IS(s[i], CC_DELIM); i++)
+		;
+
+	return (i);
+}
+
+static size_t
+lex_quote_swar(const char *s, size_t len)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, s + i, 8);
+		if (SWAR_ZERO(v) | SWAR_HAS(v, '"') | SWAR_HAS(v, '\\')) break;
+	}
+
+	for (; i < len && s[i] != '"' && s[i] != '\\' && s[i] != '\0'; i++)
+		;
+
+	return (i);
+}
+
+static size_t
+lex_newline_swar(const char *s, size_t len)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, s + i, 8);
+		if (SWAR_ZERO(v) | SWAR_HAS(v, '\n')) break;
+	}
+
+	for (; i < len && s[i] != '\n' && s[i] != '\0'; i++)
+		;
+
+	return (i);
+}
+
+#ifndef USE_SSE2
+static const struct lex_ops lex_swar = {
+	lex_space_end_swar,
+	lex_delim_swar,
+	lex_quote_swar,
+	lex_newline_swar
+};
+#endif /* !USE_SSE2 */
+
+#ifdef USE_SSE2
+
+/* bytes in " \t\n\v\f\r" */
+static inline __m128i
+sse2_space(__m128i v)
+{
+	__m128i t;
+
+	t = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	return (_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+						 _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t)));
+}
+
+static size_t
+lex_space_end_sse2(const char *s, size_t len)
+{
+	__m128i v;
+	size_t i;
+	int m;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = ~_mm_movemask_epi8(sse2_space(v)) & 0xFFFF;
+		if (m != 0) return (i + (size_t)__builtin_ctz((unsigned int)m));
+	}
+
+	return (i + lex_space_end_swar(s + i, len - i));
+}
+
+static size_t
+lex_delim_sse2(const char *s, size_t len)
+{
+	__m128i v;
+	__m128i r;
+	size_t i;
+	int m;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		r = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+						 _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+		r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		m = _mm_movemask_epi8(_mm_or_si128(r, sse2_space(v)));
+		if (m != 0) return (i + (size_t)__builtin_ctz((unsigned int)m));
+	}
+
+	return (i + lex_delim_swar(s + i, len - i));
+}
+
+static size_t
+lex_quote_sse2(const char *s, size_t len)
+{
+	__m128i v;
+	__m128i r;
+	size_t i;
+	int m;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		r = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+						 _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		m = _mm_movemask_epi8(r);
+		if (m != 0) return (i + (size_t)__builtin_ctz((unsigned int)m));
+	}
+
+	return (i + lex_quote_swar(s + i, len - i));
+}
+
+static size_t
+lex_newline_sse2(const char *s, size_t len)
+{
+	__m128i v;
+	size_t i;
+	int m;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+						 _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+		if (m != 0) return (i + (size_t)__builtin_ctz((unsigned int)m));
+	}
+
+	return (i + lex_newline_swar(s + i, len - i));
+}
+
+static const struct lex_ops lex_sse2 = {
+	lex_space_end_sse2,
+	lex_delim_sse2,
+	lex_quote_sse2,
+	lex_newline_sse2
+};
+
+#endif /* USE_SSE2 */
+
+#ifdef USE_AVX2
+
+# define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i
+avx2_space(__m256i v)
+{
+	__m256i t;
+
+	t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	return (_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+				_mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t)));
+}
+
+static AVX2 size_t
+lex_space_end_avx2(const char *s, size_t len)
+{
+	__m256i v;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = ~(unsigned int)_mm256_movemask_epi8(avx2_space(v));
+		if (m != 0) return (i + (size_t)__builtin_ctz(m));
+	}
+
+	return (i + lex_space_end_sse2(s + i, len - i));
+}
+
+static AVX2 size_t
+lex_delim_avx2(const char *s, size_t len)
+{
+	__m256i v;
+	__m256i r;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		r = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+							_mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+		r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(r,
+															   avx2_space(v)));
+		if (m != 0) return (i + (size_t)__builtin_ctz(m));
+	}
+
+	return (i + lex_delim_sse2(s + i, len - i));
+}
+
+static AVX2 size_t
+lex_quote_avx2(const char *s, size_t len)
+{
+	__m256i v;
+	__m256i r;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		r = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+							_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+		r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		m = (unsigned int)_mm256_movemask_epi8(r);
+		if (m != 0) return (i + (size_t)__builtin_ctz(m));
+	}
+
+	return (i + lex_quote_sse2(s + i, len - i));
+}
+
+static AVX2 size_t
+lex_newline_avx2(const char *s, size_t len)
+{
+	__m256i v;
+	unsigned int m;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = (unsigned int)_mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+							_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+		if (m != 0) return (i + (size_t)__builtin_ctz(m));
+	}
+
+	return (i + lex_newline_sse2(s + i, len - i));
+}
+
+static const struct lex_ops lex_avx2 = {
+	lex_space_end_avx2,
+	lex_delim_avx2,
+	lex_quote_avx2,
+	lex_newline_avx2
+};
+
+#endif /* USE_AVX2 */
+
+static const struct lex_ops *
+lex_select(void)
+{
+#ifdef USE_AVX2
+	if (__builtin_cpu_supports("avx2")) return (&lex_avx2);
+#endif /* USE_AVX2 */
+#ifdef USE_SSE2
+	return (&lex_sse2);
+#else
+	return (&lex_swar);
+#endif /* USE_SSE2 */
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * parser
+ * ---------------------------------------------------------------------------
+ */
+
+struct cstr {
+	size_t cap;
+	size_t cnt;
+	char *s;
+	const struct sconf_allocator *mem;
+};
+
+enum token_kind {
+	TOK_EOF,
+	TOK_OPEN,
+	TOK_CLOSE,
+	TOK_SYMBOL,
+	TOK_STRING,
+	TOK_INT,
+	TOK_DOUBLE,
+	TOK_BOOL,
+	TOK_CHAR,
+	TOK_NIL
+};
+
+struct token {
+	enum token_kind kind;
+	size_t off;      /* first byte in the input */
+	const char *ptr; /* raw bytes of symbols and strings */
+	size_t len;
+	int escaped;     /* string holds escape sequences */
+	union {
+		int64_t as_int;
+		double as_double;
+	} value;
+};
+
+struct parser {
+	const char *data;
+	size_t len;
+	size_t off;
+	struct cstr buff;
+	struct arena *arena; /* NULL when nodes are malloc'ed */
+	const struct sconf_allocator *mem; /* of the parser's own buffers */
+	unsigned int flags;  /* SCONF_OPT_* */
+	size_t max_depth;    /* 0 for no limit */
+	int raw;             /* hand escaped strings undecoded to handlers */
+	const struct lex_ops *lex;
+	struct intern *intern; /* symbol table of the document, if any */
+	struct token tok;    /* last token read */
+	struct sconf **stack; /* open lists while building a tree */
+	size_t stack_cap;
+};
+
+/* a handler returned SCONF_FALSE */
+#define PARSE_ABORTED (-1)
+
+#define CSTR_BASE_CAP 8
+
+static inline void
+cstr_init(struct cstr *cs, const struct sconf_allocator *mem)
+{
+	cs->cap = 0;
+	cs->cnt = 0;
+	cs->s = NULL;
+	cs->mem = mem;
+}
+
+static inline void
+cstr_destroy(struct cstr *cs)
+{
+	cs->cap = 0;
+	cs->cnt = 0;
+	mem_free(cs->mem, cs->s);
+	cs->s = NULL;
+}
+
+static inline void
+cstr_reset(struct cstr *cs)
+{
+	cs->cnt = 0;
+}
+
+static inline int
+cstr_grow(struct cstr *cs)
+{
+	size_t cap;
+	char *tmp;
+
+	if (cs->cap < (cs->cnt + 1))
+	{
+		cap = cs->cap >= CSTR_BASE_CAP ? cs->cap * 2 : CSTR_BASE_CAP;
+		tmp = (char *)mem_realloc(cs->mem, cs->s, cap * sizeof(char));
+		if (tmp == NULL)
+		{
+			sconf_last_error = SCONF_ERR_MALLOC;
+			return (SCONF_FALSE);
+		}
+		cs->s = tmp;
+		cs->cap = cap;
+	}
+
+	return (SCONF_TRUE);
+}
+
+static int
+cstr_append(struct cstr *cs, char c)
+{
+	if (cstr_grow(cs) != SCONF_TRUE) return (SCONF_FALSE);
+
+	cs->s[cs->cnt++] = c;
+	return (SCONF_TRUE);
+}
+
+static int
+cstr_reserve(struct cstr *cs, size_t len)
+{
+	size_t cap;
+	char *tmp;
+
+	if (cs->cap >= cs->cnt + len) return (SCONF_TRUE);
+
+	cap = cs->cap >= CSTR_BASE_CAP ? cs->cap : CSTR_BASE_CAP;
+	while (cap < cs->cnt + len)
+	{
+		cap *= 2;
+	}
+
+	tmp = (char *)mem_realloc(cs->mem, cs->s, cap);
+	if (tmp == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+	cs->s = tmp;
+	cs->cap = cap;
+
+	return (SCONF_TRUE);
+}
+
+static int
+cstr_append_mem(struct cstr *cs, const char *mem, size_t len)
+{
+	if (cstr_reserve(cs, len) != SCONF_TRUE) return (SCONF_FALSE);
+
+	memcpy(cs->s + cs->cnt, mem, len);
+	cs->cnt += len;
+
+	return (SCONF_TRUE);
+}
+
+static inline void
+parse_init(struct parser *p, const char *str, size_t len, struct arena *arena,
+		   const struct sconf_opts *opts)
+{
+	p->data = str;
+	p->len = len;
+	p->off = 0;
+	p->arena = arena;
+	p->mem = opts_mem(opts);
+	p->flags = (opts != NULL) ? opts->flags : 0;
+	p->max_depth = (opts != NULL) ? opts->max_depth : 0;
+	p->raw = 0;
+	p->lex = lex_select();
+	p->intern = NULL;
+	p->stack = NULL;
+	p->stack_cap = 0;
+	cstr_init(&p->buff, p->mem);
+}
+
+static inline void
+parse_fini(struct parser *p)
+{
+	cstr_destroy(&p->buff);
+	mem_free(p->mem, p->stack);
+	p->stack = NULL;
+	p->stack_cap = 0;
+}
+
+static struct sconf *
+parse_node(struct parser *p)
+{
+	struct sconf *sexp;
+
+	if (p->arena == NULL)
+	{
+		sexp = sconf_new();
+	}
+	else
+	{
+		sexp = (struct sconf *)arena_alloc(p->arena, sizeof(struct sconf),
+										   ARENA_NODE_ALIGN);
+		if (sexp != NULL)
+		{
+			sexp->view_len = 0;
+			sexp->next = NULL;
+			sexp->prev = NULL;
+		}
+	}
+
+	if (sexp != NULL)
+	{
+		sexp->type = SCONF_T_NIL;
+		sexp->flags = (p->arena != NULL) ? SCONF_F_ARENA : 0;
+	}
+
+	return (sexp);
+}
+
+static struct sconf *
+parse_list(struct parser *p)
+{
+	struct list_obj *obj;
+
+	if (p->arena == NULL) return (sconf_new_list());
+
+	obj = (struct list_obj *)arena_alloc(p->arena, sizeof(struct list_obj),
+										 ARENA_NODE_ALIGN);
+	if (obj == NULL) return (NULL);
+
+	return (list_init(obj, SCONF_F_ARENA));
+}
+
+static void
+parse_discard(struct parser *p, struct sconf *sexp)
+{
+	/* arena nodes are released with their document */
+	if (p->arena == NULL)
+	{
+		sconf_destroy(sexp);
+	}
+}
+
+static char *
+parse_alloc_str(struct parser *p, size_t len)
+{
+	char *ptr;
+
+	if (p->arena == NULL)
+	{
+		ptr = (char *)mem_alloc(heap_mem, len + 1);
+	}
+	else
+	{
+		ptr = (char *)arena_alloc(p->arena, len + 1, 1);
+	}
+
+	if (ptr == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+	}
+
+	return (ptr);
+}
+
+static size_t
+string_unescape(char *dst, const char *src, size_t len)
+{
+	size_t i;
+	size_t n;
+
+	n = 0;
+	for (i = 0; i < len; i++)
+	{
+		if (src[i] != '\\' || i + 1 >= len)
+		{
+			dst[n++] = src[i];
+			continue;
+		}
+
+		i++;
+		switch (src[i])
+		{
+		case 'n':
+			dst[n++] = '\n';
+			break;
+		case 'r':
+			dst[n++] = '\r';
+			break;
+		case 't':
+			dst[n++] = '\t';
+			break;
+		case '"':
+		case '\\':
+			dst[n++] = src[i];
+			break;
+		default:
+			dst[n++] = '\\';
+			dst[n++] = src[i];
+			break;
+		}
+	}
+
+	return (n);
+}
+
+/*
+ * Store the raw bytes [str, str + len) of a string or symbol, either as a
+ * view on the input or as a null-terminated copy.
+ */
+static int
+parse_text(struct sconf *itm, struct parser *p, enum sconf_type type,
+		   const char *str, size_t len, int escaped)
+{
+	char *ptr;
+
+	itm->type = type;
+	/* the length of a view has 32 bits, longer text is copied */
+	if ((p->flags & SCONF_OPT_ZEROCOPY) && len <= UINT32_MAX)
+	{
+		itm->flags |= SCONF_F_VIEW | (escaped ? SCONF_F_ESCAPED : 0);
+		itm->value.as_view = str;
+		itm->view_len = (uint32_t)len;
+		return (SCONF_TRUE);
+	}
+
+	if (type == SCONF_T_SYMBOL && p->intern != NULL)
+	{
+		itm->value.as_string = (char *)intern_get(p->intern, str, len);
+		if (itm->value.as_string == NULL)
+		{
+			itm->type = SCONF_T_NIL;
+			sconf_last_error = SCONF_ERR_MALLOC;
+			return (SCONF_FALSE);
+		}
+		itm->flags |= SCONF_F_INTERNED;
+		return (SCONF_TRUE);
+	}
+
+	ptr = parse_alloc_str(p, len);
+	if (ptr == NULL)
+	{
+		itm->type = SCONF_T_NIL;
+		return (SCONF_FALSE);
+	}
+
+	if (escaped)
+	{
+		len = string_unescape(ptr, str, len);
+	}
+	else
+	{
+		memcpy(ptr, str, len);
+	}
+	ptr[len] = '\0';
+
+	itm->value.as_string = ptr;
+	return (SCONF_TRUE);
+}
+
+static inline int
+parse_get(const struct parser *p)
+{
+	int c;
+
+	if (p->off >= p->len) return (EOF);
+
+	c = *(p->data + p->off);
+	if (c == '\0') return (EOF);
+
+	return (c);
+}
+
+static inline int
+parse_next(struct parser *p)
+{
+	int c;
+
+	c = parse_get(p);
+	if (c == EOF) return (EOF);
+
+	p->off++;
+
+	return (c);
+}
+
+static void
+parse_comment(struct parser *p)
+{
+	/* skip the ';' and everything up to and including the newline */
+	p->off++;
+	p->off += p->lex->newline(p->data + p->off, p->len - p->off);
+	if (p->off < p->len && p->data[p->off] == '\n')
+	{
+		p->off++;
+	}
+}
+
+static void
+parse_skip(struct parser *p)
+{
+redo:
+	/* most gaps are a single blank, don't pay for a call on those */
+	while (p->off < p->len && CHAR_IS(p->data[p->off], CC_SPACE))
+	{
+		p->off++;
+		if (p->off < p->len && CHAR_IS(p->data[p->off], CC_SPACE))
+		{
+			p->off += p->lex->space_end(p->data + p->off, p->len - p->off);
+		}
+	}
+
+	if (parse_get(p) == ';')
+	{
+		parse_comment(p);
+		goto redo;
+	}
+}
+
+/*
+ * Numbers are scanned into a 64-bit decimal significand and a power of
+ * ten. Integers are exact, doubles go through Clinger's fast path when
+ * both operands are exact, then Eisel-Lemire, and only fall back to
+ * strtod() for subnormals and significands over 19 digits.
+ */
+
+#define NUMBER_MAX_DIGITS 19   /* always fit in an uint64_t */
+#define NUMBER_MAX_EXP    100000
+
+struct number {
+	uint64_t mant;   /* leading significant digits */
+	int64_t exp10;   /* value is mant * 10^exp10 */
+	int neg;
+	int floating;    /* has a fraction or an exponent */
+	int truncated;   /* non-zero digits did not fit in mant */
+};
+
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int
+clz64(uint64_t v)
+{
+#ifdef __GNUC__
+	return (__builtin_clzll(v));
+#else
+	int n;
+
+	for (n = 0; !(v & (UINT64_C(1) << 63)); n++) v <<= 1;
+	return (n);
+#endif /* __GNUC__ */
+}
+
+static inline void
+mul_64x64(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r;
+
+	r = (unsigned __int128)a * b;
+	*hi = (uint64_t)(r >> 64);
+	*lo = (uint64_t)r;
+#else
+	uint64_t ll;
+	uint64_t lh;
+	uint64_t hl;
+	uint64_t mid;
+
+	ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+	lh = (a & 0xFFFFFFFF) * (b >> 32);
+	hl = (a >> 32) * (b & 0xFFFFFFFF);
+	mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+	*lo = (mid << 32) | (ll & 0xFFFFFFFF);
+	*hi = (a >> 32) * (b >> 32) + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif /* __SIZEOF_INT128__ */
+}
+
+static inline void
+number_digit(struct number *num, int d, int *digits, int frac)
+{
+	if (*digits < NUMBER_MAX_DIGITS)
+	{
+		num->mant = num->mant * 10 + (uint64_t)d;
+		if (num->mant != 0) (*digits)++;
+		if (frac) num->exp10--;
+	}
+	else
+	{
+		if (d != 0) num->truncated = 1;
+		if (!frac) num->exp10++;
+	}
+}
+
+/*
+ * Split s[0, len) into a struct number. Return SCONF_FALSE if it is not
+ * entirely a number.
+ */
+static int
+number_scan(struct number *num, const char *s, size_t len)
+{
+	int64_t exp;
+	size_t i;
+	int digits;
+	int esign;
+	int c;
+
+	memset(num, 0, sizeof(*num));
+	i = 0;
+	if (len > 0 && s[0] == '-')
+	{
+		num->neg = 1;
+		i++;
+	}
+
+	if (len - i > 2 && s[i] == '0' && (s[i + 1] == 'x' || s[i + 1] == 'X'))
+	{
+		for (i += 2; i < len; i++)
+		{
+			c = (unsigned char)s[i];
+			if (CHAR_IS(c, CC_DIGIT)) c -= '0';
+			else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+			else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+			else return (SCONF_FALSE);
+
+			if (num->mant >> 60) num->truncated = 1;
+			num->mant = (num->mant << 4) | (uint64_t)c;
+		}
+		return (SCONF_TRUE);
+	}
+
+	digits = 0;
+	if (i == len || (!CHAR_IS(s[i], CC_DIGIT) && s[i] != '.'))
+	{
+		return (SCONF_FALSE);
+	}
+
+	for (; i < len && CHAR_IS(s[i], CC_DIGIT); i++)
+	{
+		number_digit(num, s[i] - '0', &digits, 0);
+	}
+
+	if (i < len && s[i] == '.')
+	{
+		num->floating = 1;
+		/* "-." and "." alone are not numbers */
+		if (i == (size_t)num->neg
+			&& (i + 1 == len || !CHAR_IS(s[i + 1], CC_DIGIT)))
+		{
+			return (SCONF_FALSE);
+		}
+		for (i++; i < len && CHAR_IS(s[i], CC_DIGIT); i++)
+		{
+			number_digit(num, s[i] - '0', &digits, 1);
+		}
+	}
+
+	if (i < len && (s[i] == 'e' || s[i] == 'E'))
+	{
+		num->floating = 1;
+		esign = 1;
+		if (++i < len && (s[i] == '-' || s[i] == '+'))
+		{
+			if (s[i++] == '-') esign = -1;
+		}
+		if (i == len || !CHAR_IS(s[i], CC_DIGIT)) return (SCONF_FALSE);
+
+		for (exp = 0; i < len && CHAR_IS(s[i], CC_DIGIT); i++)
+		{
+			if (exp < NUMBER_MAX_EXP) exp = exp * 10 + (s[i] - '0');
+		}
+		num->exp10 += esign * exp;
+	}
+
+	return ((i == len) ? SCONF_TRUE : SCONF_FALSE);
+}
+
+/*
+ * Correctly rounded mant * 10^exp10. Return SCONF_FALSE when the fast
+ * algorithms cannot decide and strtod() must be used instead.
+ */
+static int
+number_double(const struct number *num, double *out)
+{
+	uint64_t w;
+	uint64_t hi;
+	uint64_t lo;
+	uint64_t hi2;
+	uint64_t lo2;
+	uint64_t m;
+	uint64_t upper;
+	int64_t q;
+	int64_t power2;
+	int shift;
+	int lz;
+	double d;
+
+	w = num->mant;
+	q = num->exp10;
+	if (w == 0 || q < POW5_MIN)
+	{
+		d = 0.0;
+		goto done;
+	}
+
+	if (num->truncated) return (SCONF_FALSE);
+
+	if (q > POW5_MAX)
+	{
+		d = HUGE_VAL;
+		goto done;
+	}
+
+#if FLT_EVAL_METHOD == 0
+	/* both w and 10^|q| are exact doubles, so is the rounded result */
+	if (w <= (UINT64_C(1) << 53) && q >= -22 && q <= 22)
+	{
+		d = (double)w;
+		d = (q < 0) ? d / pow10_exact[-q] : d * pow10_exact[q];
+		goto done;
+	}
+#endif /* FLT_EVAL_METHOD == 0 */
+
+	/* Eisel-Lemire: w * 5^q truncated to 128 bits is enough to round */
+	lz = clz64(w);
+	w <<= lz;
+	mul_64x64(w, pow5_128[q - POW5_MIN][0], &hi, &lo);
+	if ((hi & 0x1FF) == 0x1FF)
+	{
+		mul_64x64(w, pow5_128[q - POW5_MIN][1], &hi2, &lo2);
+		lo += hi2;
+		if (hi2 > lo) hi++;
+	}
+
+	upper = hi >> 63;
+	shift = (int)upper + 9;
+	m = hi >> shift;
+	/* floor(q * log2(10)) + 63, plus the double exponent bias */
+	power2 = (((152170 + 65536) * q) >> 16) + 63 + (int64_t)upper - lz + 1023;
+	if (power2 <= 0) return (SCONF_FALSE);
+
+	/* exactly halfway between two doubles: round to even */
+	if (lo <= 1 && q >= -4 && q <= 23 && (m & 3) == 1 && (m << shift) == hi)
+	{
+		m &= ~UINT64_C(1);
+	}
+
+	m += m & 1;
+	m >>= 1;
+	if (m >= (UINT64_C(2) << 52))
+	{
+		m = UINT64_C(1) << 52;
+		power2++;
+	}
+
+	if (power2 >= 0x7FF)
+	{
+		d = HUGE_VAL;
+		goto done;
+	}
+
+	m = (m & ~(UINT64_C(1) << 52)) | ((uint64_t)power2 << 52);
+	memcpy(&d, &m, sizeof(d));
+
+done:
+	*out = num->neg ? -d : d;
+	return (SCONF_TRUE);
+}
+
+/* strtod() with the C decimal point whatever the current locale is */
+static int
+number_strtod(struct cstr *buff, const char *s, size_t len, double *out)
+{
+	const char *dp;
+	size_t i;
+
+	dp = localeconv()->decimal_point;
+	cstr_reset(buff);
+	for (i = 0; i < len; i++)
+	{
+		if (s[i] == '.')
+		{
+			if (cstr_append_mem(buff, dp, strlen(dp)) != SCONF_TRUE)
+			{
+				return (SCONF_FALSE);
+			}
+		}
+		else if (cstr_append_mem(buff, s + i, 1) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
+	}
+	if (cstr_append_mem(buff, "", 1) != SCONF_TRUE) return (SCONF_FALSE);
+
+	*out = strtod(buff->s, NULL);
+	return (SCONF_TRUE);
+}
+
+static int
+parse_number(struct token *tok, struct parser *p)
+{
+	struct number num;
+	const char *str;
+	size_t len;
+	double d;
+
+	/* a number runs up to the next delimiter, like a symbol */
+	str = p->data + p->off;
+	len = 1 + p->lex->delim(str + 1, p->len - p->off - 1);
+	p->off += len;
+
+	if (number_scan(&num, str, len) != SCONF_TRUE)
+	{
+		sconf_last_error = SCONF_ERR_NUMBER;
+		return (SCONF_FALSE);
+	}
+
+	if (!num.floating)
+	{
+		if (num.truncated || num.exp10 != 0
+			|| num.mant > (uint64_t)INT64_MAX + (uint64_t)num.neg)
+		{
+			sconf_last_error = SCONF_ERR_NUMBER;
+			return (SCONF_FALSE);
+		}
+
+		tok->kind = TOK_INT;
+		if (num.neg)
+		{
+			tok->value.as_int = (num.mant == (uint64_t)INT64_MAX + 1)
+				? INT64_MIN : -(int64_t)num.mant;
+		}
+		else
+		{
+			tok->value.as_int = (int64_t)num.mant;
+		}
+		return (SCONF_TRUE);
+	}
+
+	if (number_double(&num, &d) != SCONF_TRUE
+		&& number_strtod(&p->buff, str, len, &d) != SCONF_TRUE)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+
+	if (d == HUGE_VAL || d == -HUGE_VAL)
+	{
+		sconf_last_error = SCONF_ERR_NUMBER;
+		return (SCONF_FALSE);
+	}
+
+	tok->kind = TOK_DOUBLE;
+	tok->value.as_double = d;
+	return (SCONF_TRUE);
+}
+
+#define SYMBOL_IS(s, n, kw) \
+	((n) == sizeof(kw) - 1 && memcmp((s), (kw), sizeof(kw) - 1) == 0)
+
+static int
+parse_symbol(struct token *tok, struct parser *p)
+{
+	const char *sym;
+	size_t len;
+
+	/* the first byte is always part of the symbol */
+	sym = p->data + p->off;
+	len = 1 + p->lex->delim(sym + 1, p->len - p->off - 1);
+	p->off += len;
+
+	if (SYMBOL_IS(sym, len, "yes") || SYMBOL_IS(sym, len, "true"))
+	{
+		tok->kind = TOK_BOOL;
+		tok->value.as_int = SCONF_TRUE;
+	}
+	else if (SYMBOL_IS(sym, len, "no") || SYMBOL_IS(sym, len, "false"))
+	{
+		tok->kind = TOK_BOOL;
+		tok->value.as_int = SCONF_FALSE;
+	}
+	else if (SYMBOL_IS(sym, len, "nil"))
+	{
+		tok->kind = TOK_NIL;
+	}
+	else if (SYMBOL_IS(sym, len, "+inf.0") || SYMBOL_IS(sym, len, "-inf.0"))
+	{
+		/* R7RS spelling, as written by sconf_write() */
+		tok->kind = TOK_DOUBLE;
+		tok->value.as_double = (sym[0] == '-') ? -HUGE_VAL : HUGE_VAL;
+	}
+	else if (SYMBOL_IS(sym, len, "+nan.0"))
+	{
+		tok->kind = TOK_DOUBLE;
+		tok->value.as_double = NAN;
+	}
+	else
+	{
+		tok->kind = TOK_SYMBOL;
+		tok->ptr = sym;
+		tok->len = len;
+	}
+
+	return (SCONF_TRUE);
+}
+
+static int
+parse_char(struct token *tok, struct parser *p)
+{
+	int c;
+
+	cstr_reset(&p->buff);
+
+	c = parse_next(p);
+	if (c == EOF)
+	{
+		sconf_last_error = SCONF_ERR_EOF;
+		return (SCONF_FALSE);
+	}
+
+	for (;;)
+	{
+		if (cstr_append(&p->buff, c) != SCONF_TRUE) return (SCONF_FALSE);
+		c = parse_get(p);
+		if (c == EOF || !CHAR_IS(c, CC_ALPHA)) break;
+		c = parse_next(p);
+	}
+
+	if (cstr_append(&p->buff, '\0') != SCONF_TRUE) return (SCONF_FALSE);
+
+	tok->kind = TOK_CHAR;
+
+	if (strcmp(p->buff.s, "newline") == 0)
+	{
+		tok->value.as_int = 0xA;
+	}
+	else if (strcmp(p->buff.s, "alarm") == 0)
+	{
+		tok->value.as_int = 0x7;
+	}
+	else if (strcmp(p->buff.s, "backspace") == 0)
+	{
+		tok->value.as_int = 0x8;
+	}
+	else if (strcmp(p->buff.s, "delete") == 0)
+	{
+		tok->value.as_int = 0x7F;
+	}
+	else if (strcmp(p->buff.s, "escape") == 0)
+	{
+		tok->value.as_int = 0x1B;
+	}
+	else if (strcmp(p->buff.s, "space") == 0)
+	{
+		tok->value.as_int = ' ';
+	}
+	else if (strcmp(p->buff.s, "null") == 0)
+	{
+		tok->value.as_int = 0x0;
+	}
+	else if (strcmp(p->buff.s, "return") == 0)
+	{
+		tok->value.as_int = 0xD;
+	}
+	else if (strcmp(p->buff.s, "tab") == 0)
+	{
+		tok->value.as_int = 0x9;
+	}
+	else
+	{
+		tok->value.as_int = p->buff.s[0];
+	}
+	return (SCONF_TRUE);
+}
+
+static int
+parse_string(struct token *tok, struct parser *p)
+{
+	const char *str;
+	int c;
+
+	/* only find the closing quote, escapes are decoded by consumers */
+	str = p->data + p->off;
+	tok->escaped = 0;
+	for (;;)
+	{
+		p->off += p->lex->quote(p->data + p->off, p->len - p->off);
+		c = parse_next(p);
+		if (c == '"')
+		{
+			tok->kind = TOK_STRING;
+			tok->ptr = str;
+			tok->len = (size_t)(p->data + p->off - 1 - str);
+			return (SCONF_TRUE);
+		}
+		else if (c != '\\' || parse_next(p) == EOF)
+		{
+			break;
+		}
+		tok->escaped = 1;
+	}
+
+	/* unexpected eof */
+	sconf_last_error = SCONF_ERR_EOF;
+	return (SCONF_FALSE);
+}
+
+/*
+ * Read the next token. A ')' only closes a list, at top-level the parser
+ * has always read it as a symbol.
+ */
+/* '-' alone or followed by a letter ("->", "-v") starts a symbol */
+static inline int
+parse_is_number(const struct parser *p)
+{
+	const char *s;
+	size_t n;
+
+	s = p->data + p->off;
+	n = p->len - p->off;
+	if (s[0] != '-') return (SCONF_TRUE);
+
+	return ((n > 1 && (CHAR_IS(s[1], CC_DIGIT)
+					   || (s[1] == '.' && n > 2 && CHAR_IS(s[2], CC_DIGIT))))
+			? SCONF_TRUE : SCONF_FALSE);
+}
+
+static int
+parse_token(struct token *tok, struct parser *p, int inlist)
+{
+	int c;
+
+	parse_skip(p);
+
+	tok->off = p->off;
+	c = parse_get(p);
+	switch (c)
+	{
+	case EOF:
+		tok->kind = TOK_EOF;
+		return (SCONF_TRUE);
+	case '(':
+		p->off++;
+		tok->kind = TOK_OPEN;
+		return (SCONF_TRUE);
+	case ')':
+		if (!inlist) return (parse_symbol(tok, p));
+		p->off++;
+		tok->kind = TOK_CLOSE;
+		return (SCONF_TRUE);
+	case '\\':
+		p->off++;
+		return (parse_char(tok, p));
+	case '"':
+		p->off++;
+		return (parse_string(tok, p));
+	default:
+		if (CHAR_IS(c, CC_NUMSTART) && parse_is_number(p))
+		{
+			return (parse_number(tok, p));
+		}
+		return (parse_symbol(tok, p));
+	}
+}
+
+/* record where the last error happened, see sconf_get_error_location() */
+static void
+parse_locate(const char *data, size_t off)
+{
+	const char *line;
+	const char *nl;
+	size_t n;
+
+	n = 1;
+	line = data;
+	while ((nl = memchr(line, '\n', off - (size_t)(line - data))) != NULL)
+	{
+		line = nl + 1;
+		n++;
+	}
+
+	error_loc.offset = off;
+	error_loc.line = n;
+	error_loc.column = off - (size_t)(line - data) + 1;
+	error_loc_err = sconf_last_error;
+}
+
+/*
+ * Drive the handler with the events of one value. Return SCONF_TRUE,
+ * SCONF_FALSE on error or empty input, PARSE_ABORTED if a handler failed.
+ */
+static int
+parse_emit(struct parser *p, const struct sconf_handler *h, void *ud)
+{
+	struct token *tok;
+	const char *str;
+	size_t depth;
+	size_t len;
+	int ret;
+
+	tok = &p->tok;
+	depth = 0;
+	do
+	{
+		if (parse_token(tok, p, depth > 0) != SCONF_TRUE)
+		{
+			ret = SCONF_FALSE;
+			goto fail;
+		}
+
+		ret = SCONF_TRUE;
+		switch (tok->kind)
+		{
+		case TOK_EOF:
+			/* empty input is no error */
+			if (depth == 0) return (SCONF_FALSE);
+
+			sconf_last_error = SCONF_ERR_EOF;
+			ret = SCONF_FALSE;
+			goto fail;
+		case TOK_OPEN:
+			if (p->max_depth != 0 && depth >= p->max_depth)
+			{
+				sconf_last_error = SCONF_ERR_DEPTH;
+				ret = SCONF_FALSE;
+				goto fail;
+			}
+			depth++;
+			if (h->begin_list != NULL) ret = h->begin_list(ud);
+			break;
+		case TOK_CLOSE:
+			depth--;
+			if (h->end_list != NULL) ret = h->end_list(ud);
+			break;
+		case TOK_SYMBOL:
+			if (h->symbol != NULL) ret = h->symbol(ud, tok->ptr, tok->len);
+			break;
+		case TOK_STRING:
+			if (h->string == NULL) break;
+
+			str = tok->ptr;
+			len = tok->len;
+			if (tok->escaped && !p->raw)
+			{
+				cstr_reset(&p->buff);
+				if (cstr_reserve(&p->buff, len) != SCONF_TRUE)
+				{
+					ret = SCONF_FALSE;
+					goto fail;
+				}
+				len = string_unescape(p->buff.s, str, len);
+				str = p->buff.s;
+			}
+			ret = h->string(ud, str, len);
+			break;
+		case TOK_INT:
+			if (h->integer != NULL) ret = h->integer(ud, tok->value.as_int);
+			break;
+		case TOK_DOUBLE:
+			if (h->real != NULL) ret = h->real(ud, tok->value.as_double);
+			break;
+		case TOK_BOOL:
+			if (h->boolean != NULL)
+			{
+				ret = h->boolean(ud, (enum sconf_bool)tok->value.as_int);
+			}
+			break;
+		case TOK_CHAR:
+			if (h->character != NULL)
+			{
+				ret = h->character(ud, (char)tok->value.as_int);
+			}
+			break;
+		case TOK_NIL:
+			if (h->nil != NULL) ret = h->nil(ud);
+			break;
+		}
+
+		if (ret != SCONF_TRUE)
+		{
+			ret = PARSE_ABORTED;
+			goto fail;
+		}
+	}
+	while (depth > 0);
+
+	return (SCONF_TRUE);
+
+fail:
+	parse_locate(p->data, tok->off);
+	return (ret);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * tree builder
+ * ---------------------------------------------------------------------------
+ */
+
+struct build {
+	struct parser *p;
+	struct sconf *root;
+	size_t depth;
+};
+
+#define BUILD_STACK_BASE_CAP 16
+
+/* nodes are linked as soon as created, so discarding the root on error
+ * releases everything built so far. */
+static struct sconf *
+build_node(struct build *b, int list)
+{
+	struct sconf *sexp;
+
+	sexp = list ? parse_list(b->p) : parse_node(b->p);
+	if (sexp == NULL) return (NULL);
+
+	if (b->depth == 0)
+	{
+		b->root = sexp;
+	}
+	else
+	{
+		sconf_list_append(b->p->stack[b->depth - 1], sexp);
+	}
+
+	return (sexp);
+}
+
+static int
+build_begin_list(void *ud)
+{
+	struct build *b = (struct build *)ud;
+	struct parser *p = b->p;
+	struct sconf **stack;
+	struct sconf *sexp;
+	size_t cap;
+
+	if (b->depth == p->stack_cap)
+	{
+		cap = p->stack_cap ? p->stack_cap * 2 : BUILD_STACK_BASE_CAP;
+		stack = (struct sconf **)mem_realloc(p->mem, p->stack,
+											 cap * sizeof(struct sconf *));
+		if (stack == NULL)
+		{
+			sconf_last_error = SCONF_ERR_MALLOC;
+			return (SCONF_FALSE);
+		}
+		p->stack = stack;
+		p->stack_cap = cap;
+	}
+
+	sexp = build_node(b, 1);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	p->stack[b->depth++] = sexp;
+
+	return (SCONF_TRUE);
+}
+
+/* the length of a list is known once it closes, index it there so that
+ * readers never have to */
+static int
+build_end_list(void *ud)
+{
+	struct build *b = (struct build *)ud;
+
+	b->depth--;
+	return (list_index_new(b->p->stack[b->depth], b->p->arena));
+}
+
+static int
+build_symbol(void *ud, const char *sym, size_t len)
+{
+	struct build *b = (struct build *)ud;
+	struct sconf *sexp;
+
+	sexp = build_node(b, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	return (parse_text(sexp, b->p, SCONF_T_SYMBOL, sym, len, 0));
+}
+
+static int
+build_string(void *ud, const char *str, size_t len)
+{
+	struct build *b = (struct build *)ud;
+	struct sconf *sexp;
+
+	sexp = build_node(b, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	/* raw mode, escapes are still there */
+	return (parse_text(sexp, b->p, SCONF_T_STRING, str, len,
+					   b->p->tok.escaped));
+}
+
+static int
+build_integer(void *ud, int64_t i)
+{
+	struct sconf *sexp;
+
+	sexp = build_node((struct build *)ud, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	sexp->type = SCONF_T_INT;
+	sexp->value.as_int = i;
+	return (SCONF_TRUE);
+}
+
+static int
+build_real(void *ud, double d)
+{
+	struct sconf *sexp;
+
+	sexp = build_node((struct build *)ud, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	sexp->type = SCONF_T_DOUBLE;
+	sexp->value.as_double = d;
+	return (SCONF_TRUE);
+}
+
+static int
+build_boolean(void *ud, enum sconf_bool bval)
+{
+	struct sconf *sexp;
+
+	sexp = build_node((struct build *)ud, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	sexp->type = SCONF_T_BOOL;
+	sexp->value.as_int = bval;
+	return (SCONF_TRUE);
+}
+
+static int
+build_character(void *ud, char c)
+{
+	struct sconf *sexp;
+
+	sexp = build_node((struct build *)ud, 0);
+	if (sexp == NULL) return (SCONF_FALSE);
+
+	sexp->type = SCONF_T_CHAR;
+	sexp->value.as_int = c;
+	return (SCONF_TRUE);
+}
+
+static int
+build_nil(void *ud)
+{
+	return (build_node((struct build *)ud, 0) != NULL);
+}
+
+static const struct sconf_handler build_handler = {
+	build_begin_list,
+	build_end_list,
+	build_symbol,
+	build_string,
+	build_integer,
+	build_real,
+	build_boolean,
+	build_character,
+	build_nil
+};
+
+static struct sconf *
+parse_tree(struct parser *p)
+{
+	struct build b;
+
+	b.p = p;
+	b.root = NULL;
+	b.depth = 0;
+
+	p->raw = 1;
+	if (parse_emit(p, &build_handler, &b) != SCONF_TRUE)
+	{
+		parse_discard(p, b.root);
+		return (NULL);
+	}
+
+	return (b.root);
+}
+
+int
+sconf_sax_parse(const char *str, size_t len, const struct sconf_handler *h,
+				void *ud)
+{
+	struct parser p;
+	int ret;
+
+	if (str == NULL || len == 0 || h == NULL)
+	{
+		return (SCONF_FALSE);
+	}
+
+	parse_init(&p, str, len, NULL, NULL);
+	ret = parse_emit(&p, h, ud);
+	parse_fini(&p);
+
+	if (ret == PARSE_ABORTED)
+	{
+		sconf_last_error = SCONF_ERR_ABORTED;
+		return (SCONF_FALSE);
+	}
+
+	return (ret);
+}
+
+struct sconf *
+sconf_parse_with_len(const char *str, size_t len)
+{
+	return (sconf_parse_opts(str, len, NULL));
+}
+
+struct sconf *
+sconf_parse_opts(const char *str, size_t len, const struct sconf_opts *opts)
+{
+	struct parser p;
+	struct sconf *sexp;
+
+	if (str == NULL || len == 0)
+	{
+		return (NULL);
+	}
+
+	parse_init(&p, str, len, NULL, opts);
+	/* views need a document to live in */
+	p.flags &= ~SCONF_OPT_ZEROCOPY;
+	sexp = parse_tree(&p);
+	parse_fini(&p);
+
+	return (sexp);
+}
+
+struct sconf_doc *
+sconf_doc_parse(const char *str, size_t len)
+{
+	return (sconf_doc_parse_opts(str, len, NULL));
+}
+
+struct sconf_doc *
+sconf_doc_parse_opts(const char *str, size_t len,
+					 const struct sconf_opts *opts)
+{
+	const struct sconf_allocator *mem;
+	struct parser p;
+	struct sconf_doc *doc;
+
+	if (str == NULL || len == 0)
+	{
+		return (NULL);
+	}
+
+	mem = opts_mem(opts);
+	doc = (struct sconf_doc *)mem_alloc(mem, sizeof(struct sconf_doc));
+	if (doc == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	/* the input size is a good guess of what the tree will need */
+	arena_init(&doc->arena, len, mem);
+	intern_init(&doc->symbols, &doc->arena);
+	memset(&doc->src, 0, sizeof(struct source));
+	parse_init(&p, str, len, &doc->arena, opts);
+	p.intern = &doc->symbols;
+
+	doc->root = parse_tree(&p);
+	parse_fini(&p);
+	if (doc->root == NULL)
+	{
+		sconf_doc_destroy(doc);
+		return (NULL);
+	}
+
+	return (doc);
+}
+
+struct sconf *
+sconf_doc_root(const struct sconf_doc *doc)
+{
+	if (doc == NULL) return (NULL);
+
+	return (doc->root);
+}
+
+const char *
+sconf_doc_string(struct sconf_doc *doc, struct sconf *sexp, size_t *len)
+{
+	char *ptr;
+	size_t n;
+
+	if (!sconf_is_string(sexp) && !sconf_is_symbol(sexp)) return (NULL);
+
+	if (!(sexp->flags & SCONF_F_VIEW))
+	{
+		n = strlen(sexp->value.as_string);
+	}
+	else if (sexp->flags & SCONF_F_ESCAPED)
+	{
+		if (doc == NULL) return (NULL);
+
+		/* decoded text is never longer than its escaped form */
+		ptr = (char *)arena_alloc(&doc->arena, sexp->view_len + 1, 1);
+		if (ptr == NULL) return (NULL);
+
+		n = string_unescape(ptr, sexp->value.as_view,
+							sexp->view_len);
+		ptr[n] = '\0';
+
+		sexp->flags &= ~(SCONF_F_VIEW | SCONF_F_ESCAPED);
+		sexp->value.as_string = ptr;
+	}
+	else
+	{
+		if (len != NULL) *len = sexp->view_len;
+		return (sexp->value.as_view);
+	}
+
+	if (len != NULL) *len = n;
+	return (sexp->value.as_string);
+}
+
+const char *
+sconf_doc_symbol(const struct sconf_doc *doc, const char *sym)
+{
+	if (doc == NULL || sym == NULL) return (NULL);
+
+	return (intern_find(&doc->symbols, sym, strlen(sym)));
+}
+
+int
+sconf_doc_index(struct sconf_doc *doc, struct sconf *lst)
+{
+	if (doc == NULL || !sconf_is_list(lst) || !(lst->flags & SCONF_F_ARENA))
+	{
+		sconf_last_error = SCONF_ERR_NOTALIST;
+		return (SCONF_FALSE);
+	}
+
+	return (list_index_new(lst, &doc->arena));
+}
+
+void
+sconf_doc_destroy(struct sconf_doc *doc)
+{
+	const struct sconf_allocator *mem;
+
+	if (doc == NULL) return;
+
+	mem = doc->arena.mem;
+	intern_fini(&doc->symbols);
+	arena_destroy(&doc->arena);
+	source_release(&doc->src);
+	mem_free(mem, doc);
+}
+
+struct sconf_reader {
+	struct parser p;
+	enum sconf_error err; /* sticky once a form failed to parse */
+};
+
+struct sconf_reader *
+sconf_reader_new(const char *str, size_t len)
+{
+	struct sconf_reader *rd;
+
+	if (str == NULL) return (NULL);
+
+	rd = (struct sconf_reader *)mem_alloc(heap_mem,
+										  sizeof(struct sconf_reader));
+	if (rd == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	parse_init(&rd->p, str, len, NULL, NULL);
+	rd->err = SCONF_OK;
+
+	return (rd);
+}
+
+struct sconf *
+sconf_reader_next(struct sconf_reader *rd)
+{
+	struct sconf *sexp;
+
+	if (rd == NULL) return (NULL);
+
+	if (rd->err != SCONF_OK)
+	{
+		sconf_last_error = rd->err;
+		return (NULL);
+	}
+
+	parse_skip(&rd->p);
+	if (parse_get(&rd->p) == EOF)
+	{
+		sconf_last_error = SCONF_OK;
+		return (NULL);
+	}
+
+	sexp = parse_tree(&rd->p);
+	if (sexp == NULL)
+	{
+		rd->err = sconf_last_error;
+		return (NULL);
+	}
+
+	return (sexp);
+}
+
+size_t
+sconf_reader_offset(const struct sconf_reader *rd)
+{
+	if (rd == NULL) return (0);
+
+	return (rd->p.off);
+}
+
+void
+sconf_reader_destroy(struct sconf_reader *rd)
+{
+	if (rd == NULL) return;
+
+	parse_fini(&rd->p);
+	mem_free(heap_mem, rd);
+}
+
+struct sconf *
+sconf_parse(const char *str)
+{
+	if (str == NULL || *str == '\0')
+	{
+		return (NULL);
+	}
+
+	return (sconf_parse_with_len(str, strlen(str)));
+}
+
+static struct sconf *
+load_source(struct source *src)
+{
+	struct sconf *sexp;
+
+	sexp = sconf_parse_with_len(src->data, src->len);
+	source_release(src);
+
+	return (sexp);
+}
+
+/* documents with views keep their input, which must not be a mapping */
+static inline int
+opts_map(const struct sconf_opts *opts)
+{
+	return (opts == NULL || !(opts->flags & SCONF_OPT_ZEROCOPY));
+}
+
+static struct sconf_doc *
+load_doc_source(struct source *src, const struct sconf_opts *opts)
+{
+	struct sconf_doc *doc;
+
+	doc = sconf_doc_parse_opts(src->data, src->len, opts);
+	if (doc != NULL && !opts_map(opts))
+	{
+		/* views point into the input, hand it over to the document */
+		doc->src = *src;
+		return (doc);
+	}
+
+	source_release(src);
+	return (doc);
+}
+
+struct sconf *
+sconf_load(FILE *fp)
+{
+	struct source src;
+
+	if (fp == NULL) return (NULL);
+
+	if (source_load_stream(&src, fp, heap_mem) != SCONF_TRUE) return (NULL);
+
+	return (load_source(&src));
+}
+
+struct sconf *
+sconf_load_fd(int fd)
+{
+	struct source src;
+
+	if (source_load_fd(&src, fd, heap_mem, SCONF_TRUE) != SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	return (load_source(&src));
+}
+
+struct sconf *
+sconf_load_path(const char *path)
+{
+	struct source src;
+
+	if (source_load_path(&src, path, heap_mem, SCONF_TRUE) != SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	return (load_source(&src));
+}
+
+struct sconf_doc *
+sconf_doc_load_fd(int fd, const struct sconf_opts *opts)
+{
+	struct source src;
+
+	if (source_load_fd(&src, fd, opts_mem(opts), opts_map(opts)) != SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	return (load_doc_source(&src, opts));
+}
+
+struct sconf_doc *
+sconf_doc_load_path(const char *path, const struct sconf_opts *opts)
+{
+	struct source src;
+
+	if (source_load_path(&src, path, opts_mem(opts), opts_map(opts))
+		!= SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	return (load_doc_source(&src, opts));
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * parallel
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Finding every form boundary is a sequential pass over the whole input,
+ * so cuts are guessed instead, at lines starting with '(', and checked
+ * once the chunks are parsed. A chunk starting at a boundary reads into
+ * complete forms only if its end is a boundary too: a cut inside a list or
+ * a string leaves it unterminated, and comments never span a newline. The
+ * first chunk starts at a boundary, so checking them in order and carrying
+ * on with a failed one over the next ones gives the sequential result.
+ */
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+#define PARALLEL_CHUNKS_PER_THREAD 4
+
+struct par_chunk {
+	size_t start;
+	size_t end;
+	size_t resume;       /* end of the last complete form */
+	struct arena arena;
+	struct sconf *first; /* forms, linked like list items */
+	struct sconf *last;
+	enum sconf_error err;
+	int located;         /* err_off is set */
+	size_t err_off;      /* from the start of the input */
+};
+
+struct par {
+	const char *data;
+	const struct sconf_opts *opts;
+	const struct sconf_allocator *mem;
+	struct par_chunk *chunks;
+	size_t nchunks;
+	size_t next;         /* first chunk no worker took yet */
+#ifdef USE_PTHREAD
+	pthread_mutex_t lock;
+#endif /* USE_PTHREAD */
+};
+
+static unsigned int
+par_threads(unsigned int n)
+{
+#ifdef USE_PTHREAD
+# ifdef _SC_NPROCESSORS_ONLN
+	long ncpu;
+
+	if (n == 0)
+	{
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (ncpu > 0) ? (unsigned int)ncpu : 1;
+	}
+# endif /* _SC_NPROCESSORS_ONLN */
+	return ((n > 0) ? n : 1);
+#else
+	(void)n;
+	return (1);
+#endif /* USE_PTHREAD */
+}
+
+/* the first line starting with '(' after off, len if there is none */
+static size_t
+par_cut(const char *data, size_t len, size_t off)
+{
+	const char *nl;
+
+	while (off < len && (nl = memchr(data + off, '\n', len - off)) != NULL)
+	{
+		off = (size_t)(nl - data) + 1;
+		if (off < len && data[off] == '(') return (off);
+	}
+
+	return (len);
+}
+
+static int
+par_split(struct par *par, size_t len, size_t n)
+{
+	struct par_chunk *c;
+	size_t start;
+	size_t cut;
+	size_t k;
+
+	par->chunks = (struct par_chunk *)mem_calloc(par->mem, n,
+												 sizeof(struct par_chunk));
+	if (par->chunks == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+
+	par->nchunks = 0;
+	start = 0;
+	for (k = 1; k <= n; k++)
+	{
+		cut = (k < n) ? par_cut(par->data, len, len / n * k) : len;
+		if (cut <= start) continue;
+
+		c = par->chunks + par->nchunks++;
+		c->start = start;
+		c->end = cut;
+		c->resume = start;
+		c->first = NULL;
+		c->last = NULL;
+		arena_init(&c->arena, cut - start, par->mem);
+		start = cut;
+	}
+
+	return (SCONF_TRUE);
+}
+
+/* parse from where the chunk was left, appending to its forms */
+static void
+par_parse(const struct par *par, struct par_chunk *c)
+{
+	struct sconf_location loc;
+	struct parser p;
+	struct sconf *sexp;
+	size_t mark;
+
+	c->err = SCONF_OK;
+	c->located = SCONF_FALSE;
+
+	parse_init(&p, par->data + c->resume, c->end - c->resume, &c->arena,
+			   par->opts);
+	for (;;)
+	{
+		parse_skip(&p);
+		mark = p.off;
+		if (parse_get(&p) == EOF) break;
+
+		sexp = parse_tree(&p);
+		if (sexp == NULL)
+		{
+			c->err = sconf_last_error;
+			if (sconf_get_error_location(&loc) == SCONF_TRUE)
+			{
+				c->located = SCONF_TRUE;
+				c->err_off = c->resume + loc.offset;
+			}
+			break;
+		}
+
+		if (c->last == NULL)
+		{
+			c->first = sexp;
+		}
+		else
+		{
+			c->last->next = sexp;
+			sexp->prev = c->last;
+		}
+		c->last = sexp;
+	}
+	c->resume += mark;
+	parse_fini(&p);
+}
+
+static struct par_chunk *
+par_take(struct par *par)
+{
+	size_t i;
+
+#ifdef USE_PTHREAD
+	pthread_mutex_lock(&par->lock);
+#endif /* USE_PTHREAD */
+	i = par->next;
+	if (i < par->nchunks) par->next++;
+#ifdef USE_PTHREAD
+	pthread_mutex_unlock(&par->lock);
+#endif /* USE_PTHREAD */
+
+	return ((i < par->nchunks) ? par->chunks + i : NULL);
+}
+
+static void *
+par_worker(void *ud)
+{
+	struct par *par = (struct par *)ud;
+	struct par_chunk *c;
+
+	while ((c = par_take(par)) != NULL)
+	{
+		par_parse(par, c);
+	}
+
+	return (NULL);
+}
+
+/* the calling thread works too, and alone if no thread can be started */
+static void
+par_run(struct par *par, unsigned int nthreads)
+{
+#ifdef USE_PTHREAD
+	pthread_t *tids;
+	unsigned int started;
+
+	if (nthreads > par->nchunks) nthreads = (unsigned int)par->nchunks;
+
+	tids = NULL;
+	started = 0;
+	if (nthreads > 1)
+	{
+		tids = (pthread_t *)mem_calloc(par->mem, nthreads - 1,
+									   sizeof(pthread_t));
+	}
+	if (tids != NULL)
+	{
+		while (started < nthreads - 1
+			   && pthread_create(&tids[started], NULL, par_worker, par) == 0)
+		{
+			started++;
+		}
+	}
+
+	par_worker(par);
+
+	while (started > 0)
+	{
+		pthread_join(tids[--started], NULL);
+	}
+	mem_free(par->mem, tids);
+#else
+	(void)nthreads;
+	par_worker(par);
+#endif /* USE_PTHREAD */
+}
+
+/* check the chunks in order and hand their forms and arenas to doc */
+static int
+par_collect(struct par *par, struct sconf_doc *doc)
+{
+	struct arena_chunk *tail;
+	struct list_obj *obj;
+	struct sconf *root;
+	struct sconf *child;
+	struct par_chunk *c;
+	size_t step;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	obj = (struct list_obj *)arena_alloc(&doc->arena, sizeof(struct list_obj),
+										 ARENA_NODE_ALIGN);
+	if (obj == NULL) return (SCONF_FALSE);
+	root = list_init(obj, SCONF_F_ARENA);
+
+	for (i = 0; i < par->nchunks; i = j)
+	{
+		c = par->chunks + i;
+		j = i + 1;
+		for (step = 1; c->err == SCONF_ERR_EOF && j < par->nchunks; step *= 2)
+		{
+			/*
+			 * The cut was inside a form: go on from it over the next
+			 * chunks, twice as many each time a form is still open so
+			 * that one huge form is not parsed over and over.
+			 */
+			for (k = j + step; j < k && j < par->nchunks; j++)
+			{
+				arena_destroy(&par->chunks[j].arena);
+			}
+			c->end = par->chunks[j - 1].end;
+			par_parse(par, c);
+		}
+
+		if (c->err != SCONF_OK)
+		{
+			sconf_last_error = c->err;
+			error_loc_err = SCONF_OK;
+			if (c->located) parse_locate(par->data, c->err_off);
+			return (SCONF_FALSE);
+		}
+
+		/* keep the document's own chunk in front for later allocations */
+		if (c->arena.head != NULL)
+		{
+			for (tail = c->arena.head; tail->next != NULL; tail = tail->next)
+				;
+			tail->next = doc->arena.head->next;
+			doc->arena.head->next = c->arena.head;
+			c->arena.head = NULL;
+		}
+
+		if (c->first == NULL) continue;
+
+		child = root->value.as_child;
+		if (child == NULL)
+		{
+			root->value.as_child = c->first;
+		}
+		else
+		{
+			child->prev->next = c->first;
+			c->first->prev = child->prev;
+		}
+		root->value.as_child->prev = c->last;
+	}
+
+	doc->root = root;
+	return (list_index_new(root, &doc->arena));
+}
+
+struct sconf_doc *
+sconf_doc_parse_parallel(const char *str, size_t len, unsigned int nthreads,
+						 const struct sconf_opts *opts)
+{
+	struct sconf_doc *doc;
+	struct par par;
+	size_t n;
+	size_t i;
+
+	if (str == NULL || len == 0)
+	{
+		return (NULL);
+	}
+
+	par.mem = opts_mem(opts);
+	doc = (struct sconf_doc *)mem_alloc(par.mem, sizeof(struct sconf_doc));
+	if (doc == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	/* the forms come with the arenas of the chunks */
+	arena_init(&doc->arena, 0, par.mem);
+	intern_init(&doc->symbols, &doc->arena);
+	memset(&doc->src, 0, sizeof(struct source));
+	doc->root = NULL;
+
+	nthreads = par_threads(nthreads);
+	n = len / PARALLEL_MIN_CHUNK;
+	if (n > (size_t)nthreads * PARALLEL_CHUNKS_PER_THREAD)
+	{
+		n = (size_t)nthreads * PARALLEL_CHUNKS_PER_THREAD;
+	}
+
+	par.data = str;
+	par.opts = opts;
+	par.next = 0;
+	if (par_split(&par, len, (n > 0) ? n : 1) != SCONF_TRUE)
+	{
+		sconf_doc_destroy(doc);
+		return (NULL);
+	}
+
+#ifdef USE_PTHREAD
+	pthread_mutex_init(&par.lock, NULL);
+#endif /* USE_PTHREAD */
+	par_run(&par, nthreads);
+#ifdef USE_PTHREAD
+	pthread_mutex_destroy(&par.lock);
+#endif /* USE_PTHREAD */
+
+	if (par_collect(&par, doc) != SCONF_TRUE)
+	{
+		sconf_doc_destroy(doc);
+		doc = NULL;
+	}
+
+	for (i = 0; i < par.nchunks; i++)
+	{
+		arena_destroy(&par.chunks[i].arena);
+	}
+	mem_free(par.mem, par.chunks);
+
+	return (doc);
+}
+
+struct sconf_doc *
+sconf_doc_load_parallel(const char *path, unsigned int nthreads,
+						const struct sconf_opts *opts)
+{
+	struct sconf_doc *doc;
+	struct source src;
+
+	if (source_load_path(&src, path, opts_mem(opts), opts_map(opts))
+		!= SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	doc = sconf_doc_parse_parallel(src.data, src.len, nthreads, opts);
+	if (doc != NULL && !opts_map(opts))
+	{
+		doc->src = src;
+		return (doc);
+	}
+
+	source_release(&src);
+	return (doc);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * stream
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * The scanner only tracks what is needed to find where a top-level form
+ * ends, following the same token rules as the parser, so that it can be
+ * suspended at any byte and resumed with the next chunk.
+ */
+enum scan_state {
+	SCAN_SPACE,
+	SCAN_COMMENT,
+	SCAN_STRING,
+	SCAN_STRING_ESC,
+	SCAN_CHAR,
+	SCAN_CHAR_NAME,
+	SCAN_SYMBOL      /* numbers too, both run up to a delimiter */
+};
+
+struct scan {
+	enum scan_state state;
+	const struct lex_ops *lex;
+	size_t depth;
+	int inform; /* a top-level form is open */
+	size_t start; /* where it started in the current chunk */
+};
+
+struct sconf_stream {
+	struct scan scan;
+	struct cstr carry; /* open form started in a previous chunk */
+	sconf_stream_cb cb;
+	void *ud;
+};
+
+static inline void
+scan_init(struct scan *s)
+{
+	s->state = SCAN_SPACE;
+	s->lex = lex_select();
+	s->depth = 0;
+	s->inform = 0;
+	s->start = 0;
+}
+
+/* an atom can only be closed by the byte following it */
+static inline int
+scan_in_atom(const struct scan *s)
+{
+	return (s->state == SCAN_CHAR || s->state == SCAN_CHAR_NAME
+			|| s->state == SCAN_SYMBOL);
+}
+
+/*
+ * Scan buf[*off, len) for the end of the current top-level form. Return
+ * SCONF_TRUE with *off just past the form, or SCONF_FALSE with *off set
+ * to len once the whole chunk is consumed.
+ */
+static int
+scan_form(struct scan *s, const char *buf, size_t len, size_t *off)
+{
+	size_t i;
+	int c;
+
+	for (i = *off; i < len; i++)
+	{
+		c = (unsigned char)buf[i];
+		switch (s->state)
+		{
+		case SCAN_COMMENT:
+			if (c != '\n')
+			{
+				i += s->lex->newline(buf + i, len - i);
+				if (i == len || buf[i] != '\n') continue;
+			}
+			s->state = SCAN_SPACE;
+			continue;
+		case SCAN_STRING:
+			if (c != '"' && c != '\\')
+			{
+				i += s->lex->quote(buf + i, len - i);
+				if (i == len) continue;
+				c = (unsigned char)buf[i];
+			}
+
+			if (c == '\\')
+			{
+				s->state = SCAN_STRING_ESC;
+			}
+			else if (c == '"')
+			{
+				s->state = SCAN_SPACE;
+				if (s->depth == 0) goto form_next;
+			}
+			continue;
+		case SCAN_STRING_ESC:
+			s->state = SCAN_STRING;
+			continue;
+		case SCAN_CHAR:
+			s->state = SCAN_CHAR_NAME;
+			continue;
+		case SCAN_CHAR_NAME:
+			if (CHAR_IS(c, CC_ALPHA)) continue;
+			break;
+		case SCAN_SYMBOL:
+			if (!CHAR_IS(c, CC_SPACE) && c != '(' && c != ')') continue;
+			break;
+		case SCAN_SPACE:
+			break;
+		}
+
+		if (s->state != SCAN_SPACE)
+		{
+			/* c ends the atom but is not part of it */
+			s->state = SCAN_SPACE;
+			if (s->depth == 0) goto form;
+		}
+
+		if (CHAR_IS(c, CC_SPACE)) continue;
+
+		if (c == ';')
+		{
+			s->state = SCAN_COMMENT;
+			continue;
+		}
+
+		if (!s->inform)
+		{
+			s->inform = 1;
+			s->start = i;
+		}
+
+		switch (c)
+		{
+		case '(':
+			s->depth++;
+			break;
+		case ')':
+			if (s->depth == 0)
+			{
+				/* the parser reads a stray ')' as a symbol */
+				s->state = SCAN_SYMBOL;
+			}
+			else if (--s->depth == 0)
+			{
+				goto form_next;
+			}
+			break;
+		case '"':
+			s->state = SCAN_STRING;
+			break;
+		case '\\':
+			s->state = SCAN_CHAR;
+			break;
+		default:
+			s->state = SCAN_SYMBOL;
+			break;
+		}
+	}
+
+	*off = len;
+	return (SCONF_FALSE);
+
+form_next:
+	i++;
+form:
+	*off = i;
+	s->inform = 0;
+	return (SCONF_TRUE);
+}
+
+struct sconf_stream *
+sconf_stream_new(sconf_stream_cb cb, void *ud)
+{
+	struct sconf_stream *st;
+
+	if (cb == NULL) return (NULL);
+
+	st = (struct sconf_stream *)mem_alloc(heap_mem,
+										  sizeof(struct sconf_stream));
+	if (st == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	scan_init(&st->scan);
+	cstr_init(&st->carry, heap_mem);
+	st->cb = cb;
+	st->ud = ud;
+
+	return (st);
+}
+
+static int
+stream_emit(struct sconf_stream *st, const char *str, size_t len)
+{
+	struct sconf *sexp;
+
+	sexp = sconf_parse_with_len(str, len);
+	if (sexp == NULL)
+	{
+		/* the location would be relative to the form */
+		error_loc_err = SCONF_OK;
+		return (SCONF_FALSE);
+	}
+
+	return (st->cb(sexp, st->ud));
+}
+
+int
+sconf_stream_feed(struct sconf_stream *st, const char *buf, size_t len)
+{
+	size_t start;
+	size_t off;
+	int ret;
+
+	if (st == NULL || (buf == NULL && len > 0)) return (SCONF_FALSE);
+
+	off = 0;
+	while (off < len)
+	{
+		if (scan_form(&st->scan, buf, len, &off) != SCONF_TRUE) break;
+
+		if (st->carry.cnt == 0)
+		{
+			/* the whole form is in this chunk, parse it in place */
+			start = st->scan.start;
+			ret = stream_emit(st, buf + start, off - start);
+		}
+		else
+		{
+			if (cstr_append_mem(&st->carry, buf, off) != SCONF_TRUE)
+			{
+				return (SCONF_FALSE);
+			}
+			ret = stream_emit(st, st->carry.s, st->carry.cnt);
+			cstr_reset(&st->carry);
+		}
+
+		if (ret != SCONF_TRUE) return (SCONF_FALSE);
+	}
+
+	if (st->scan.inform)
+	{
+		/* keep what we have of the open form for the next chunk */
+		start = (st->carry.cnt == 0) ? st->scan.start : 0;
+		return (cstr_append_mem(&st->carry, buf + start, len - start));
+	}
+
+	return (SCONF_TRUE);
+}
+
+int
+sconf_stream_finish(struct sconf_stream *st)
+{
+	int ret;
+
+	if (st == NULL) return (SCONF_FALSE);
+
+	ret = SCONF_TRUE;
+	if (st->scan.inform)
+	{
+		if (st->scan.depth == 0 && scan_in_atom(&st->scan))
+		{
+			ret = stream_emit(st, st->carry.s, st->carry.cnt);
+		}
+		else
+		{
+			sconf_last_error = SCONF_ERR_EOF;
+			ret = SCONF_FALSE;
+		}
+	}
+
+	scan_init(&st->scan);
+	cstr_reset(&st->carry);
+
+	return (ret);
+}
+
+void
+sconf_stream_destroy(struct sconf_stream *st)
+{
+	if (st == NULL) return;
+
+	cstr_destroy(&st->carry);
+	mem_free(heap_mem, st);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * tree walker
+ * ---------------------------------------------------------------------------
+ */
+
+#define WALK_STACK_BASE_CAP 16
+
+static int
+walk_atom(const struct sconf *sexp, const struct sconf_handler *h, void *ud,
+		  struct cstr *scratch)
+{
+	const char *ptr;
+	size_t len;
+
+	switch (sexp->type)
+	{
+	case SCONF_T_SYMBOL:
+		if (h->symbol == NULL) return (SCONF_TRUE);
+		symbol_bytes(sexp, &ptr, &len);
+		return (h->symbol(ud, ptr, len));
+	case SCONF_T_STRING:
+		if (h->string == NULL) return (SCONF_TRUE);
+		symbol_bytes(sexp, &ptr, &len);
+		if (sexp->flags & SCONF_F_ESCAPED)
+		{
+			cstr_reset(scratch);
+			if (cstr_reserve(scratch, len) != SCONF_TRUE)
+			{
+				return (PARSE_ABORTED);
+			}
+			len = string_unescape(scratch->s, ptr, len);
+			ptr = scratch->s;
+		}
+		return (h->string(ud, ptr, len));
+	case SCONF_T_INT:
+		if (h->integer == NULL) return (SCONF_TRUE);
+		return (h->integer(ud, sexp->value.as_int));
+	case SCONF_T_DOUBLE:
+		if (h->real == NULL) return (SCONF_TRUE);
+		return (h->real(ud, sexp->value.as_double));
+	case SCONF_T_BOOL:
+		if (h->boolean == NULL) return (SCONF_TRUE);
+		return (h->boolean(ud, (enum sconf_bool)sexp->value.as_int));
+	case SCONF_T_CHAR:
+		if (h->character == NULL) return (SCONF_TRUE);
+		return (h->character(ud, (char)sexp->value.as_int));
+	case SCONF_T_NIL:
+		if (h->nil == NULL) return (SCONF_TRUE);
+		return (h->nil(ud));
+	case SCONF_T_LIST:
+		break;
+	}
+
+	return (SCONF_TRUE);
+}
+
+/*
+ * Replay a tree as parser events, the inverse of the tree builder.
+ * Return SCONF_FALSE if a handler failed, handlers set the error.
+ */
+static int
+tree_emit(const struct sconf *sexp, const struct sconf_handler *h, void *ud)
+{
+	const struct sconf **stack;
+	const struct sconf **tmp;
+	struct cstr scratch;
+	size_t depth;
+	size_t cap;
+	int ret;
+
+	cstr_init(&scratch, heap_mem);
+	stack = NULL;
+	depth = 0;
+	cap = 0;
+	ret = SCONF_TRUE;
+	for (;;)
+	{
+		if (sexp->type != SCONF_T_LIST)
+		{
+			ret = walk_atom(sexp, h, ud, &scratch);
+			if (ret != SCONF_TRUE) break;
+		}
+		else
+		{
+			if (h->begin_list != NULL && h->begin_list(ud) != SCONF_TRUE)
+			{
+				ret = SCONF_FALSE;
+				break;
+			}
+
+			if (sexp->value.as_child != NULL)
+			{
+				if (depth == cap)
+				{
+					cap = cap ? cap * 2 : WALK_STACK_BASE_CAP;
+					tmp = (const struct sconf **)mem_realloc(heap_mem, stack,
+								cap * sizeof(const struct sconf *));
+					if (tmp == NULL)
+					{
+						ret = PARSE_ABORTED;
+						break;
+					}
+					stack = tmp;
+				}
+				sexp = sexp->value.as_child;
+				stack[depth++] = sexp;
+				continue;
+			}
+
+			if (h->end_list != NULL && h->end_list(ud) != SCONF_TRUE)
+			{
+				ret = SCONF_FALSE;
+				break;
+			}
+		}
+
+		while (depth > 0 && stack[depth - 1]->next == NULL)
+		{
+			depth--;
+			if (h->end_list != NULL && h->end_list(ud) != SCONF_TRUE)
+			{
+				ret = SCONF_FALSE;
+				break;
+			}
+		}
+		if (ret != SCONF_TRUE || depth == 0) break;
+
+		sexp = stack[depth - 1]->next;
+		stack[depth - 1] = sexp;
+	}
+
+	mem_free(heap_mem, stack);
+	cstr_destroy(&scratch);
+
+	if (ret == PARSE_ABORTED)
+	{
+		/* our own allocations failed */
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+
+	return (ret);
+}
+
+/* build a malloc'ed tree from events, see tree_emit() */
+struct tree_sink {
+	struct parser p;
+	struct build b;
+};
+
+static inline void
+tree_sink_init(struct tree_sink *t)
+{
+	parse_init(&t->p, NULL, 0, NULL, NULL);
+	t->p.raw = 1;
+	t->p.tok.escaped = 0;
+	t->b.p = &t->p;
+	t->b.root = NULL;
+	t->b.depth = 0;
+}
+
+static inline struct sconf *
+tree_sink_fini(struct tree_sink *t, int ok)
+{
+	if (!ok)
+	{
+		parse_discard(&t->p, t->b.root);
+		t->b.root = NULL;
+	}
+	parse_fini(&t->p);
+
+	return (t->b.root);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * pool
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * A pool node is two 32-bit words. The low 3 bits of val hold the type,
+ * the other 29 bits its payload:
+ *
+ *  - list:            index of the first child, 0 if empty
+ *  - string, symbol:  offset in the string table
+ *  - int:             bit 0 set: index in the word table, otherwise a
+ *                     28-bit two's complement value in bits 1-28
+ *  - double:          index in the word table
+ *  - bool, char:      the value
+ *
+ * Node 0 is never used so that 0 can mean "none".
+ */
+#define POOL_TYPE_BITS  3
+#define POOL_TYPE_MASK  ((1U << POOL_TYPE_BITS) - 1)
+#define POOL_MAX_PAYLOAD ((1U << (32 - POOL_TYPE_BITS)) - 1)
+#define POOL_INT_BOXED  1U
+#define POOL_INT_BIAS   (1 << 27)
+
+#define POOL_BASE_CAP   64
+
+struct pool_node {
+	uint32_t val;
+	uint32_t next;
+};
+
+struct sconf_pool {
+	struct pool_node *nodes;
+	size_t nnodes;
+	size_t nodes_cap;
+	uint64_t *words;    /* boxed ints and doubles */
+	size_t nwords;
+	size_t words_cap;
+	char *strs;         /* null-terminated strings, deduplicated */
+	size_t nstrs;
+	size_t strs_cap;
+	sconf_ref root;
+	const struct sconf_allocator *mem;
+};
+
+/* grow a pool table of cnt elements of sz bytes so it fits more */
+static int
+pool_reserve(const struct sconf_allocator *mem, void **tab, size_t *cap,
+			 size_t cnt, size_t more, size_t sz)
+{
+	size_t ncap;
+	void *tmp;
+
+	if (cnt + more <= *cap) return (SCONF_TRUE);
+
+	ncap = (*cap != 0) ? *cap : POOL_BASE_CAP;
+	while (ncap < cnt + more) ncap *= 2;
+
+	tmp = mem_realloc(mem, *tab, ncap * sz);
+	if (tmp == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+	*tab = tmp;
+	*cap = ncap;
+
+	return (SCONF_TRUE);
+}
+
+static inline enum sconf_type
+pool_tag(const struct sconf_pool *pool, sconf_ref ref)
+{
+	return ((enum sconf_type)(pool->nodes[ref].val & POOL_TYPE_MASK));
+}
+
+static inline uint32_t
+pool_payload(const struct sconf_pool *pool, sconf_ref ref)
+{
+	return (pool->nodes[ref].val >> POOL_TYPE_BITS);
+}
+
+struct pool_build {
+	struct sconf_pool *pool;
+	sconf_ref *open;    /* open lists */
+	sconf_ref *last;    /* their last child so far */
+	size_t depth;
+	size_t cap;
+	uint32_t *dedup;    /* open addressing set of string offsets + 1 */
+	size_t dedup_mask;
+	size_t dedup_cnt;
+};
+
+/* add a node and link it as the last child of the innermost list */
+static sconf_ref
+pool_add(struct pool_build *pb, enum sconf_type type, uint32_t payload)
+{
+	struct sconf_pool *pool = pb->pool;
+	sconf_ref ref;
+	sconf_ref up;
+
+	/* refs of first children are stored as payloads too */
+	if (payload > POOL_MAX_PAYLOAD || pool->nnodes > POOL_MAX_PAYLOAD)
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (SCONF_REF_NONE);
+	}
+
+	if (pool_reserve(pool->mem, (void **)&pool->nodes, &pool->nodes_cap,
+					 pool->nnodes, 1, sizeof(struct pool_node)) != SCONF_TRUE)
+	{
+		return (SCONF_REF_NONE);
+	}
+
+	ref = (sconf_ref)pool->nnodes++;
+	pool->nodes[ref].val = (payload << POOL_TYPE_BITS) | (uint32_t)type;
+	pool->nodes[ref].next = SCONF_REF_NONE;
+
+	if (pb->depth == 0)
+	{
+		pool->root = ref;
+	}
+	else if (pb->last[pb->depth - 1] == SCONF_REF_NONE)
+	{
+		up = pb->open[pb->depth - 1];
+		pool->nodes[up].val |= ref << POOL_TYPE_BITS;
+		pb->last[pb->depth - 1] = ref;
+	}
+	else
+	{
+		pool->nodes[pb->last[pb->depth - 1]].next = ref;
+		pb->last[pb->depth - 1] = ref;
+	}
+
+	return (ref);
+}
+
+static int
+pool_word(struct pool_build *pb, uint64_t w, uint32_t *idx)
+{
+	struct sconf_pool *pool = pb->pool;
+
+	if (pool->nwords > POOL_MAX_PAYLOAD)
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (SCONF_FALSE);
+	}
+	if (pool_reserve(pool->mem, (void **)&pool->words, &pool->words_cap,
+					 pool->nwords, 1, sizeof(uint64_t)) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+
+	*idx = (uint32_t)pool->nwords;
+	pool->words[pool->nwords++] = w;
+	return (SCONF_TRUE);
+}
+
+static int
+pool_dedup_grow(struct pool_build *pb)
+{
+	uint32_t *old;
+	size_t old_cap;
+	size_t cap;
+	size_t i;
+	size_t j;
+	const char *s;
+
+	old = pb->dedup;
+	old_cap = (old != NULL) ? pb->dedup_mask + 1 : 0;
+	cap = (old_cap != 0) ? old_cap * 2 : POOL_BASE_CAP;
+
+	pb->dedup = (uint32_t *)mem_calloc(pb->pool->mem, cap, sizeof(uint32_t));
+	if (pb->dedup == NULL)
+	{
+		pb->dedup = old;
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (SCONF_FALSE);
+	}
+	pb->dedup_mask = cap - 1;
+
+	for (i = 0; i < old_cap; i++)
+	{
+		if (old[i] == 0) continue;
+
+		s = pb->pool->strs + old[i] - 1;
+		for (j = str_hash(s, strlen(s)) & pb->dedup_mask; pb->dedup[j] != 0;
+			 j = (j + 1) & pb->dedup_mask)
+			;
+		pb->dedup[j] = old[i];
+	}
+	mem_free(pb->pool->mem, old);
+
+	return (SCONF_TRUE);
+}
+
+/* offset of str in the string table, stored on first use */
+static int
+pool_str(struct pool_build *pb, const char *str, size_t len, uint32_t *off)
+{
+	struct sconf_pool *pool = pb->pool;
+	const char *s;
+	size_t i;
+
+	if (pb->dedup == NULL || (pb->dedup_cnt + 1) * 2 > pb->dedup_mask + 1)
+	{
+		if (pool_dedup_grow(pb) != SCONF_TRUE) return (SCONF_FALSE);
+	}
+
+	for (i = str_hash(str, len) & pb->dedup_mask; pb->dedup[i] != 0;
+		 i = (i + 1) & pb->dedup_mask)
+	{
+		s = pool->strs + pb->dedup[i] - 1;
+		if (strncmp(s, str, len) == 0 && s[len] == '\0')
+		{
+			*off = pb->dedup[i] - 1;
+			return (SCONF_TRUE);
+		}
+	}
+
+	if (pool->nstrs + len + 1 > UINT32_MAX - 1)
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (SCONF_FALSE);
+	}
+	if (pool_reserve(pool->mem, (void **)&pool->strs, &pool->strs_cap,
+					 pool->nstrs, len + 1, 1) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+
+	*off = (uint32_t)pool->nstrs;
+	memcpy(pool->strs + pool->nstrs, str, len);
+	pool->strs[pool->nstrs + len] = '\0';
+	pool->nstrs += len + 1;
+
+	pb->dedup[i] = *off + 1;
+	pb->dedup_cnt++;
+	return (SCONF_TRUE);
+}
+
+static int
+pool_begin_list(void *ud)
+{
+	struct pool_build *pb = (struct pool_build *)ud;
+	sconf_ref *tmp;
+	sconf_ref ref;
+	size_t cap;
+
+	if (pb->depth == pb->cap)
+	{
+		cap = pb->cap ? pb->cap * 2 : BUILD_STACK_BASE_CAP;
+		tmp = (sconf_ref *)mem_realloc(pb->pool->mem, pb->open,
+									   cap * sizeof(sconf_ref));
+		if (tmp == NULL) goto err_malloc;
+		pb->open = tmp;
+		tmp = (sconf_ref *)mem_realloc(pb->pool->mem, pb->last,
+									   cap * sizeof(sconf_ref));
+		if (tmp == NULL) goto err_malloc;
+		pb->last = tmp;
+		pb->cap = cap;
+	}
+
+	ref = pool_add(pb, SCONF_T_LIST, 0);
+	if (ref == SCONF_REF_NONE) return (SCONF_FALSE);
+
+	pb->open[pb->depth] = ref;
+	pb->last[pb->depth] = SCONF_REF_NONE;
+	pb->depth++;
+	return (SCONF_TRUE);
+
+err_malloc:
+	sconf_last_error = SCONF_ERR_MALLOC;
+	return (SCONF_FALSE);
+}
+
+static int
+pool_end_list(void *ud)
+{
+	((struct pool_build *)ud)->depth--;
+	return (SCONF_TRUE);
+}
+
+static int
+pool_text(struct pool_build *pb, enum sconf_type type, const char *str,
+		  size_t len)
+{
+	uint32_t off;
+
+	if (pool_str(pb, str, len, &off) != SCONF_TRUE) return (SCONF_FALSE);
+
+	return (pool_add(pb, type, off) != SCONF_REF_NONE);
+}
+
+static int
+pool_symbol(void *ud, const char *sym, size_t len)
+{
+	return (pool_text((struct pool_build *)ud, SCONF_T_SYMBOL, sym, len));
+}
+
+static int
+pool_string(void *ud, const char *str, size_t len)
+{
+	return (pool_text((struct pool_build *)ud, SCONF_T_STRING, str, len));
+}
+
+static int
+pool_integer(void *ud, int64_t i)
+{
+	struct pool_build *pb = (struct pool_build *)ud;
+	uint32_t idx;
+
+	if (i >= -POOL_INT_BIAS && i < POOL_INT_BIAS)
+	{
+		return (pool_add(pb, SCONF_T_INT,
+						 (uint32_t)(i + POOL_INT_BIAS) << 1) != SCONF_REF_NONE);
+	}
+
+	if (pool_word(pb, (uint64_t)i, &idx) != SCONF_TRUE) return (SCONF_FALSE);
+	if (idx > (POOL_MAX_PAYLOAD >> 1))
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (SCONF_FALSE);
+	}
+
+	return (pool_add(pb, SCONF_T_INT, (idx << 1) | POOL_INT_BOXED)
+			!= SCONF_REF_NONE);
+}
+
+static int
+pool_real(void *ud, double d)
+{
+	struct pool_build *pb = (struct pool_build *)ud;
+	uint64_t w;
+	uint32_t idx;
+
+	memcpy(&w, &d, sizeof(w));
+	if (pool_word(pb, w, &idx) != SCONF_TRUE) return (SCONF_FALSE);
+
+	return (pool_add(pb, SCONF_T_DOUBLE, idx) != SCONF_REF_NONE);
+}
+
+static int
+pool_boolean(void *ud, enum sconf_bool b)
+{
+	return (pool_add((struct pool_build *)ud, SCONF_T_BOOL, (uint32_t)b)
+			!= SCONF_REF_NONE);
+}
+
+static int
+pool_character(void *ud, char c)
+{
+	return (pool_add((struct pool_build *)ud, SCONF_T_CHAR,
+					 (unsigned char)c) != SCONF_REF_NONE);
+}
+
+static int
+pool_nil(void *ud)
+{
+	return (pool_add((struct pool_build *)ud, SCONF_T_NIL, 0)
+			!= SCONF_REF_NONE);
+}
+
+static const struct sconf_handler pool_handler = {
+	pool_begin_list,
+	pool_end_list,
+	pool_symbol,
+	pool_string,
+	pool_integer,
+	pool_real,
+	pool_boolean,
+	pool_character,
+	pool_nil
+};
+
+static struct sconf_pool *
+pool_build_init(struct pool_build *pb, const struct sconf_allocator *mem)
+{
+	memset(pb, 0, sizeof(*pb));
+	pb->pool = (struct sconf_pool *)mem_calloc(mem, 1,
+											   sizeof(struct sconf_pool));
+	if (pb->pool == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	pb->pool->mem = mem;
+
+	/* reserve node 0 */
+	pb->pool->nnodes = 1;
+	if (pool_reserve(mem, (void **)&pb->pool->nodes, &pb->pool->nodes_cap,
+					 0, 1, sizeof(struct pool_node)) != SCONF_TRUE)
+	{
+		mem_free(mem, pb->pool);
+		return (NULL);
+	}
+	pb->pool->nodes[0].val = SCONF_T_NIL;
+	pb->pool->nodes[0].next = SCONF_REF_NONE;
+
+	return (pb->pool);
+}
+
+static struct sconf_pool *
+pool_build_fini(struct pool_build *pb, int ok)
+{
+	mem_free(pb->pool->mem, pb->open);
+	mem_free(pb->pool->mem, pb->last);
+	mem_free(pb->pool->mem, pb->dedup);
+
+	if (!ok || pb->pool->root == SCONF_REF_NONE)
+	{
+		sconf_pool_destroy(pb->pool);
+		return (NULL);
+	}
+
+	return (pb->pool);
+}
+
+struct sconf_pool *
+sconf_pool_parse(const char *str, size_t len, const struct sconf_opts *opts)
+{
+	struct pool_build pb;
+	struct parser p;
+	int ret;
+
+	if (str == NULL || len == 0) return (NULL);
+
+	if (pool_build_init(&pb, opts_mem(opts)) == NULL) return (NULL);
+
+	parse_init(&p, str, len, NULL, opts);
+	ret = parse_emit(&p, &pool_handler, &pb);
+	parse_fini(&p);
+
+	return (pool_build_fini(&pb, ret == SCONF_TRUE));
+}
+
+struct sconf_pool *
+sconf_pool_from_tree(const struct sconf *sexp)
+{
+	struct pool_build pb;
+
+	if (sexp == NULL) return (NULL);
+
+	if (pool_build_init(&pb, heap_mem) == NULL) return (NULL);
+
+	return (pool_build_fini(&pb, tree_emit(sexp, &pool_handler, &pb)));
+}
+
+/* replay a pool subtree as parser events */
+static int
+pool_emit(const struct sconf_pool *pool, sconf_ref ref,
+		  const struct sconf_handler *h, void *ud)
+{
+	sconf_ref *stack;
+	sconf_ref *tmp;
+	const char *s;
+	size_t depth;
+	size_t cap;
+	int ret;
+
+	stack = NULL;
+	depth = 0;
+	cap = 0;
+	for (;;)
+	{
+		ret = SCONF_TRUE;
+		switch (pool_tag(pool, ref))
+		{
+		case SCONF_T_LIST:
+			ret = h->begin_list(ud);
+			if (ret != SCONF_TRUE) break;
+
+			if (sconf_pool_first(pool, ref) != SCONF_REF_NONE)
+			{
+				if (depth == cap)
+				{
+					cap = cap ? cap * 2 : WALK_STACK_BASE_CAP;
+					tmp = (sconf_ref *)mem_realloc(pool->mem, stack,
+												   cap * sizeof(sconf_ref));
+					if (tmp == NULL)
+					{
+						sconf_last_error = SCONF_ERR_MALLOC;
+						ret = SCONF_FALSE;
+						break;
+					}
+					stack = tmp;
+				}
+				ref = sconf_pool_first(pool, ref);
+				stack[depth++] = ref;
+				continue;
+			}
+			ret = h->end_list(ud);
+			break;
+		case SCONF_T_SYMBOL:
+		case SCONF_T_STRING:
+			s = sconf_pool_string(pool, ref);
+			ret = (pool_tag(pool, ref) == SCONF_T_SYMBOL)
+				? h->symbol(ud, s, strlen(s)) : h->string(ud, s, strlen(s));
+			break;
+		case SCONF_T_INT:
+			ret = h->integer(ud, sconf_pool_int(pool, ref));
+			break;
+		case SCONF_T_DOUBLE:
+			ret = h->real(ud, sconf_pool_double(pool, ref));
+			break;
+		case SCONF_T_BOOL:
+			ret = h->boolean(ud, (enum sconf_bool)sconf_pool_int(pool, ref));
+			break;
+		case SCONF_T_CHAR:
+			ret = h->character(ud, (char)sconf_pool_int(pool, ref));
+			break;
+		case SCONF_T_NIL:
+			ret = h->nil(ud);
+			break;
+		}
+		if (ret != SCONF_TRUE) break;
+
+		while (depth > 0 && pool->nodes[stack[depth - 1]].next == 0)
+		{
+			depth--;
+			ret = h->end_list(ud);
+			if (ret != SCONF_TRUE) break;
+		}
+		if (ret != SCONF_TRUE || depth == 0) break;
+
+		ref = pool->nodes[stack[depth - 1]].next;
+		stack[depth - 1] = ref;
+	}
+
+	mem_free(pool->mem, stack);
+	return (ret);
+}
+
+struct sconf *
+sconf_pool_to_tree(const struct sconf_pool *pool, sconf_ref ref)
+{
+	struct tree_sink t;
+
+	if (pool == NULL || ref == SCONF_REF_NONE || ref >= pool->nnodes)
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (NULL);
+	}
+
+	tree_sink_init(&t);
+	return (tree_sink_fini(&t, pool_emit(pool, ref, &build_handler, &t.b)
+						   == SCONF_TRUE));
+}
+
+sconf_ref
+sconf_pool_root(const struct sconf_pool *pool)
+{
+	return ((pool != NULL) ? pool->root : SCONF_REF_NONE);
+}
+
+enum sconf_type
+sconf_pool_type(const struct sconf_pool *pool, sconf_ref ref)
+{
+	return (pool_tag(pool, ref));
+}
+
+sconf_ref
+sconf_pool_first(const struct sconf_pool *pool, sconf_ref ref)
+{
+	if (pool_tag(pool, ref) != SCONF_T_LIST) return (SCONF_REF_NONE);
+
+	return (pool_payload(pool, ref));
+}
+
+sconf_ref
+sconf_pool_next(const struct sconf_pool *pool, sconf_ref ref)
+{
+	return (pool->nodes[ref].next);
+}
+
+int64_t
+sconf_pool_int(const struct sconf_pool *pool, sconf_ref ref)
+{
+	uint32_t payload;
+
+	payload = pool_payload(pool, ref);
+	switch (pool_tag(pool, ref))
+	{
+	case SCONF_T_INT:
+		if (payload & POOL_INT_BOXED)
+		{
+			return ((int64_t)pool->words[payload >> 1]);
+		}
+		return ((int64_t)(payload >> 1) - POOL_INT_BIAS);
+	case SCONF_T_BOOL:
+	case SCONF_T_CHAR:
+		return ((int64_t)payload);
+	default:
+		return (0);
+	}
+}
+
+double
+sconf_pool_double(const struct sconf_pool *pool, sconf_ref ref)
+{
+	double d;
+
+	if (pool_tag(pool, ref) != SCONF_T_DOUBLE) return (0.0);
+
+	memcpy(&d, pool->words + pool_payload(pool, ref), sizeof(d));
+	return (d);
+}
+
+const char *
+sconf_pool_string(const struct sconf_pool *pool, sconf_ref ref)
+{
+	if (pool_tag(pool, ref) != SCONF_T_STRING
+		&& pool_tag(pool, ref) != SCONF_T_SYMBOL)
+	{
+		return (NULL);
+	}
+
+	return (pool->strs + pool_payload(pool, ref));
+}
+
+size_t
+sconf_pool_memory(const struct sconf_pool *pool)
+{
+	if (pool == NULL) return (0);
+
+	return (sizeof(struct sconf_pool)
+			+ pool->nnodes * sizeof(struct pool_node)
+			+ pool->nwords * sizeof(uint64_t) + pool->nstrs);
+}
+
+void
+sconf_pool_destroy(struct sconf_pool *pool)
+{
+	if (pool == NULL) return;
+
+	mem_free(pool->mem, pool->nodes);
+	mem_free(pool->mem, pool->words);
+	mem_free(pool->mem, pool->strs);
+	mem_free(pool->mem, pool);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * tape
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * A tape is the tree flattened in document order, one 16-byte entry per
+ * object. The low 8 bits of head hold the type, the rest:
+ *
+ *  - list:            index of the entry following the list
+ *  - string, symbol:  length in bytes
+ *
+ * val holds the element count of lists, the offset of strings and
+ * symbols in the string table, and the value of other objects.
+ */
+#define TAPE_TYPE_BITS 8
+#define TAPE_TYPE_MASK ((UINT64_C(1) << TAPE_TYPE_BITS) - 1)
+
+struct tape_entry {
+	uint64_t head;
+	uint64_t val;
+};
+
+struct sconf_tape {
+	struct tape_entry *ents;
+	size_t nents;
+	size_t ents_cap;
+	char *strs;         /* null-terminated strings */
+	size_t nstrs;
+	size_t strs_cap;
+	const struct sconf_allocator *mem;
+};
+
+struct tape_build {
+	struct sconf_tape *tape;
+	size_t *open;       /* entries of the open lists */
+	size_t depth;
+	size_t cap;
+};
+
+static inline enum sconf_type
+tape_tag(const struct sconf_tape *tape, size_t pos)
+{
+	return ((enum sconf_type)(tape->ents[pos].head & TAPE_TYPE_MASK));
+}
+
+/* index of the entry following the subtree at pos */
+static inline size_t
+tape_skip(const struct sconf_tape *tape, size_t pos)
+{
+	if (tape_tag(tape, pos) != SCONF_T_LIST) return (pos + 1);
+
+	return ((size_t)(tape->ents[pos].head >> TAPE_TYPE_BITS));
+}
+
+static int
+tape_push(struct tape_build *tb, enum sconf_type type, uint64_t head,
+		  uint64_t val)
+{
+	struct sconf_tape *tape = tb->tape;
+	struct tape_entry *ent;
+
+	if (pool_reserve(tape->mem, (void **)&tape->ents, &tape->ents_cap,
+					 tape->nents, 1, sizeof(struct tape_entry)) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+
+	ent = tape->ents + tape->nents++;
+	ent->head = (head << TAPE_TYPE_BITS) | (uint64_t)type;
+	ent->val = val;
+
+	/* count the element in its list */
+	if (tb->depth > 0) tape->ents[tb->open[tb->depth - 1]].val++;
+
+	return (SCONF_TRUE);
+}
+
+static int
+tape_begin_list(void *ud)
+{
+	struct tape_build *tb = (struct tape_build *)ud;
+	size_t *tmp;
+	size_t cap;
+
+	if (tb->depth == tb->cap)
+	{
+		cap = tb->cap ? tb->cap * 2 : BUILD_STACK_BASE_CAP;
+		tmp = (size_t *)mem_realloc(tb->tape->mem, tb->open,
+									cap * sizeof(size_t));
+		if (tmp == NULL)
+		{
+			sconf_last_error = SCONF_ERR_MALLOC;
+			return (SCONF_FALSE);
+		}
+		tb->open = tmp;
+		tb->cap = cap;
+	}
+
+	if (tape_push(tb, SCONF_T_LIST, 0, 0) != SCONF_TRUE) return (SCONF_FALSE);
+
+	tb->open[tb->depth++] = tb->tape->nents - 1;
+	return (SCONF_TRUE);
+}
+
+static int
+tape_end_list(void *ud)
+{
+	struct tape_build *tb = (struct tape_build *)ud;
+	struct tape_entry *ent;
+
+	ent = tb->tape->ents + tb->open[--tb->depth];
+	ent->head |= (uint64_t)tb->tape->nents << TAPE_TYPE_BITS;
+	return (SCONF_TRUE);
+}
+
+static int
+tape_text(struct tape_build *tb, enum sconf_type type, const char *str,
+		  size_t len)
+{
+	struct sconf_tape *tape = tb->tape;
+	size_t off;
+
+	if (pool_reserve(tape->mem, (void **)&tape->strs, &tape->strs_cap,
+					 tape->nstrs, len + 1, 1) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+
+	off = tape->nstrs;
+	memcpy(tape->strs + off, str, len);
+	tape->strs[off + len] = '\0';
+	tape->nstrs += len + 1;
+
+	return (tape_push(tb, type, len, off));
+}
+
+static int
+tape_symbol(void *ud, const char *sym, size_t len)
+{
+	return (tape_text((struct tape_build *)ud, SCONF_T_SYMBOL, sym, len));
+}
+
+static int
+tape_string(void *ud, const char *str, size_t len)
+{
+	return (tape_text((struct tape_build *)ud, SCONF_T_STRING, str, len));
+}
+
+static int
+tape_integer(void *ud, int64_t i)
+{
+	return (tape_push((struct tape_build *)ud, SCONF_T_INT, 0, (uint64_t)i));
+}
+
+static int
+tape_real(void *ud, double d)
+{
+	uint64_t w;
+
+	memcpy(&w, &d, sizeof(w));
+	return (tape_push((struct tape_build *)ud, SCONF_T_DOUBLE, 0, w));
+}
+
+static int
+tape_boolean(void *ud, enum sconf_bool b)
+{
+	return (tape_push((struct tape_build *)ud, SCONF_T_BOOL, 0, (uint64_t)b));
+}
+
+static int
+tape_character(void *ud, char c)
+{
+	return (tape_push((struct tape_build *)ud, SCONF_T_CHAR, 0,
+					  (unsigned char)c));
+}
+
+static int
+tape_nil(void *ud)
+{
+	return (tape_push((struct tape_build *)ud, SCONF_T_NIL, 0, 0));
+}
+
+static const struct sconf_handler tape_handler = {
+	tape_begin_list,
+	tape_end_list,
+	tape_symbol,
+	tape_string,
+	tape_integer,
+	tape_real,
+	tape_boolean,
+	tape_character,
+	tape_nil
+};
+
+static struct sconf_tape *
+tape_build_init(struct tape_build *tb, const struct sconf_allocator *mem)
+{
+	memset(tb, 0, sizeof(*tb));
+	tb->tape = (struct sconf_tape *)mem_calloc(mem, 1,
+											   sizeof(struct sconf_tape));
+	if (tb->tape == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	tb->tape->mem = mem;
+
+	return (tb->tape);
+}
+
+static struct sconf_tape *
+tape_build_fini(struct tape_build *tb, int ok)
+{
+	mem_free(tb->tape->mem, tb->open);
+
+	if (!ok || tb->tape->nents == 0)
+	{
+		sconf_tape_destroy(tb->tape);
+		return (NULL);
+	}
+
+	return (tb->tape);
+}
+
+struct sconf_tape *
+sconf_tape_parse(const char *str, size_t len, const struct sconf_opts *opts)
+{
+	struct tape_build tb;
+	struct parser p;
+	int ret;
+
+	if (str == NULL || len == 0) return (NULL);
+
+	if (tape_build_init(&tb, opts_mem(opts)) == NULL) return (NULL);
+
+	parse_init(&p, str, len, NULL, opts);
+	ret = parse_emit(&p, &tape_handler, &tb);
+	parse_fini(&p);
+
+	return (tape_build_fini(&tb, ret == SCONF_TRUE));
+}
+
+struct sconf_tape *
+sconf_tape_from_tree(const struct sconf *sexp)
+{
+	struct tape_build tb;
+
+	if (sexp == NULL) return (NULL);
+
+	if (tape_build_init(&tb, heap_mem) == NULL) return (NULL);
+
+	return (tape_build_fini(&tb, tree_emit(sexp, &tape_handler, &tb)));
+}
+
+/* replay the subtree at pos as parser events */
+static int
+tape_emit(const struct sconf_tape *tape, size_t pos,
+		  const struct sconf_handler *h, void *ud)
+{
+	const struct tape_entry *ent;
+	size_t *stack;
+	size_t *tmp;
+	size_t depth;
+	size_t cap;
+	size_t end;
+	double d;
+	int ret;
+
+	stack = NULL;
+	depth = 0;
+	cap = 0;
+	ret = SCONF_TRUE;
+	for (end = tape_skip(tape, pos); ret == SCONF_TRUE; pos++)
+	{
+		/* entries are in document order, lists close where they skip to */
+		while (depth > 0 && stack[depth - 1] == pos && ret == SCONF_TRUE)
+		{
+			depth--;
+			ret = h->end_list(ud);
+		}
+		if (ret != SCONF_TRUE || pos == end) break;
+
+		ent = tape->ents + pos;
+		switch (tape_tag(tape, pos))
+		{
+		case SCONF_T_LIST:
+			if (depth == cap)
+			{
+				cap = cap ? cap * 2 : WALK_STACK_BASE_CAP;
+				tmp = (size_t *)mem_realloc(tape->mem, stack,
+											cap * sizeof(size_t));
+				if (tmp == NULL)
+				{
+					sconf_last_error = SCONF_ERR_MALLOC;
+					ret = SCONF_FALSE;
+					break;
+				}
+				stack = tmp;
+			}
+			stack[depth++] = tape_skip(tape, pos);
+			ret = h->begin_list(ud);
+			break;
+		case SCONF_T_SYMBOL:
+			ret = h->symbol(ud, tape->strs + ent->val,
+							(size_t)(ent->head >> TAPE_TYPE_BITS));
+			break;
+		case SCONF_T_STRING:
+			ret = h->string(ud, tape->strs + ent->val,
+							(size_t)(ent->head >> TAPE_TYPE_BITS));
+			break;
+		case SCONF_T_INT:
+			ret = h->integer(ud, (int64_t)ent->val);
+			break;
+		case SCONF_T_DOUBLE:
+			memcpy(&d, &ent->val, sizeof(d));
+			ret = h->real(ud, d);
+			break;
+		case SCONF_T_BOOL:
+			ret = h->boolean(ud, (enum sconf_bool)ent->val);
+			break;
+		case SCONF_T_CHAR:
+			ret = h->character(ud, (char)ent->val);
+			break;
+		case SCONF_T_NIL:
+			ret = h->nil(ud);
+			break;
+		}
+	}
+
+	mem_free(tape->mem, stack);
+	return (ret);
+}
+
+struct sconf *
+sconf_cursor_to_tree(const struct sconf_cursor *cur)
+{
+	struct tree_sink t;
+
+	if (cur == NULL || cur->tape == NULL || cur->pos >= cur->end)
+	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (NULL);
+	}
+
+	tree_sink_init(&t);
+	return (tree_sink_fini(&t, tape_emit(cur->tape, cur->pos, &build_handler,
+										 &t.b) == SCONF_TRUE));
+}
+
+int
+sconf_tape_cursor(const struct sconf_tape *tape, struct sconf_cursor *cur)
+{
+	if (tape == NULL || cur == NULL) return (SCONF_FALSE);
+
+	cur->tape = tape;
+	cur->pos = 0;
+	cur->end = tape->nents;
+	return (SCONF_TRUE);
+}
+
+enum sconf_type
+sconf_cursor_type(const struct sconf_cursor *cur)
+{
+	return (tape_tag(cur->tape, cur->pos));
+}
+
+int
+sconf_cursor_first(const struct sconf_cursor *cur, struct sconf_cursor *child)
+{
+	size_t end;
+
+	if (tape_tag(cur->tape, cur->pos) != SCONF_T_LIST
+		|| cur->tape->ents[cur->pos].val == 0)
+	{
+		return (SCONF_FALSE);
+	}
+
+	/* child may be cur */
+	end = tape_skip(cur->tape, cur->pos);
+	child->tape = cur->tape;
+	child->pos = cur->pos + 1;
+	child->end = end;
+	return (SCONF_TRUE);
+}
+
+int
+sconf_cursor_next(struct sconf_cursor *cur)
+{
+	size_t pos;
+
+	pos = tape_skip(cur->tape, cur->pos);
+	if (pos >= cur->end) return (SCONF_FALSE);
+
+	cur->pos = pos;
+	return (SCONF_TRUE);
+}
+
+size_t
+sconf_cursor_skip(const struct sconf_cursor *cur)
+{
+	return (tape_skip(cur->tape, cur->pos));
+}
+
+size_t
+sconf_cursor_count(const struct sconf_cursor *cur)
+{
+	if (tape_tag(cur->tape, cur->pos) != SCONF_T_LIST) return (0);
+
+	return ((size_t)cur->tape->ents[cur->pos].val);
+}
+
+int64_t
+sconf_cursor_int(const struct sconf_cursor *cur)
+{
+	switch (tape_tag(cur->tape, cur->pos))
+	{
+	case SCONF_T_INT:
+	case SCONF_T_BOOL:
+	case SCONF_T_CHAR:
+		return ((int64_t)cur->tape->ents[cur->pos].val);
+	default:
+		return (0);
+	}
+}
+
+double
+sconf_cursor_double(const struct sconf_cursor *cur)
+{
+	double d;
+
+	if (tape_tag(cur->tape, cur->pos) != SCONF_T_DOUBLE) return (0.0);
+
+	memcpy(&d, &cur->tape->ents[cur->pos].val, sizeof(d));
+	return (d);
+}
+
+const char *
+sconf_cursor_string(const struct sconf_cursor *cur, size_t *len)
+{
+	const struct tape_entry *ent;
+
+	if (tape_tag(cur->tape, cur->pos) != SCONF_T_STRING
+		&& tape_tag(cur->tape, cur->pos) != SCONF_T_SYMBOL)
+	{
+		return (NULL);
+	}
+
+	ent = cur->tape->ents + cur->pos;
+	if (len != NULL) *len = (size_t)(ent->head >> TAPE_TYPE_BITS);
+	return (cur->tape->strs + ent->val);
+}
+
+size_t
+sconf_tape_memory(const struct sconf_tape *tape)
+{
+	if (tape == NULL) return (0);
+
+	return (sizeof(struct sconf_tape)
+			+ tape->nents * sizeof(struct tape_entry) + tape->nstrs);
+}
+
+void
+sconf_tape_destroy(struct sconf_tape *tape)
+{
+	if (tape == NULL) return;
+
+	mem_free(tape->mem, tape->ents);
+	mem_free(tape->mem, tape->strs);
+	mem_free(tape->mem, tape);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * binary
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Layout, integers are LEB128 varints:
+ *
+ *   magic "\x89SCB", version byte
+ *   object count, list depth, string table size, body size
+ *   string table: null-terminated strings, each stored once
+ *   body: objects in document order, a type byte then
+ *
+ *    - list:            element count, elements follow
+ *    - string, symbol:  offset in the string table
+ *    - int:             zigzag varint
+ *    - double:          8 bytes, little-endian IEEE 754
+ *    - bool, char:      1 byte
+ *    - nil:             nothing
+ *
+ * The counts in the header let the loader carve the whole tree out of a
+ * single allocation.
+ */
+#define BIN_MAGIC_LEN  4
+#define BIN_HEADER_LEN (BIN_MAGIC_LEN + 1)
+#define BIN_VARINT_MAX 10
+
+static const char bin_magic[BIN_MAGIC_LEN] = { '\x89', 'S', 'C', 'B' };
+
+struct bin_in {
+	const unsigned char *ptr;
+	const unsigned char *end;
+};
+
+struct bin_frame {
+	struct sconf *lst;
+	uint64_t left;      /* elements still to read */
+};
+
+static inline void
+bin_put_varint(struct cstr *cs, uint64_t v)
+{
+	/* caller reserved BIN_VARINT_MAX bytes */
+	while (v >= 0x80)
+	{
+		cs->s[cs->cnt++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	cs->s[cs->cnt++] = (char)v;
+}
+
+/* body of a pool, see sconf_pool_from_tree() */
+static int
+bin_encode(struct cstr *cs, const struct sconf_pool *pool, size_t *maxdepth)
+{
+	sconf_ref *stack;
+	sconf_ref *tmp;
+	sconf_ref ref;
+	sconf_ref child;
+	enum sconf_type type;
+	uint64_t w;
+	int64_t i;
+	size_t count;
+	size_t depth;
+	size_t cap;
+	double d;
+	int k;
+
+	stack = NULL;
+	depth = 0;
+	cap = 0;
+	*maxdepth = 0;
+	ref = pool->root;
+	while (ref != SCONF_REF_NONE)
+	{
+		if (cstr_reserve(cs, 1 + 8 + BIN_VARINT_MAX) != SCONF_TRUE) break;
+
+		type = sconf_pool_type(pool, ref);
+		cs->s[cs->cnt++] = (char)type;
+		switch (type)
+		{
+		case SCONF_T_LIST:
+			count = 0;
+			child = sconf_pool_first(pool, ref);
+			for (; child != SCONF_REF_NONE; child = sconf_pool_next(pool, child))
+			{
+				count++;
+			}
+			bin_put_varint(cs, count);
+			if (count == 0) break;
+
+			if (depth == cap)
+			{
+				cap = cap ? cap * 2 : WALK_STACK_BASE_CAP;
+				tmp = (sconf_ref *)mem_realloc(pool->mem, stack,
+											   cap * sizeof(sconf_ref));
+				if (tmp == NULL)
+				{
+					sconf_last_error = SCONF_ERR_MALLOC;
+					mem_free(pool->mem, stack);
+					return (SCONF_FALSE);
+				}
+				stack = tmp;
+			}
+			stack[depth++] = sconf_pool_next(pool, ref);
+			if (depth > *maxdepth) *maxdepth = depth;
+			ref = sconf_pool_first(pool, ref);
+			continue;
+		case SCONF_T_STRING:
+		case SCONF_T_SYMBOL:
+			bin_put_varint(cs, (uint64_t)(sconf_pool_string(pool, ref)
+										  - pool->strs));
+			break;
+		case SCONF_T_INT:
+			i = sconf_pool_int(pool, ref);
+			bin_put_varint(cs, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+			break;
+		case SCONF_T_DOUBLE:
+			d = sconf_pool_double(pool, ref);
+			memcpy(&w, &d, sizeof(w));
+			for (k = 0; k < 8; k++)
+			{
+				cs->s[cs->cnt++] = (char)(w >> (k * 8));
+			}
+			break;
+		case SCONF_T_BOOL:
+		case SCONF_T_CHAR:
+			cs->s[cs->cnt++] = (char)sconf_pool_int(pool, ref);
+			break;
+		case SCONF_T_NIL:
+			break;
+		}
+
+		ref = sconf_pool_next(pool, ref);
+		while (ref == SCONF_REF_NONE && depth > 0)
+		{
+			ref = stack[--depth];
+		}
+	}
+
+	mem_free(pool->mem, stack);
+	return (ref == SCONF_REF_NONE ? SCONF_TRUE : SCONF_FALSE);
+}
+
+int
+sconf_save_binary(FILE *fp, const struct sconf *sexp)
+{
+	struct sconf_pool *pool;
+	struct cstr head;
+	struct cstr body;
+	size_t depth;
+	int ret;
+
+	if (fp == NULL || sexp == NULL) return (SCONF_FALSE);
+
+	/* the pool already holds the deduplicated string table */
+	pool = sconf_pool_from_tree(sexp);
+	if (pool == NULL) return (SCONF_FALSE);
+
+	cstr_init(&head, heap_mem);
+	cstr_init(&body, heap_mem);
+	ret = bin_encode(&body, pool, &depth);
+	if (ret == SCONF_TRUE)
+	{
+		ret = cstr_reserve(&head, BIN_HEADER_LEN + 4 * BIN_VARINT_MAX);
+	}
+	if (ret == SCONF_TRUE)
+	{
+		memcpy(head.s, bin_magic, BIN_MAGIC_LEN);
+		head.s[BIN_MAGIC_LEN] = SCONF_BINARY_VERSION;
+		head.cnt = BIN_HEADER_LEN;
+		bin_put_varint(&head, pool->nnodes - 1);
+		bin_put_varint(&head, depth);
+		bin_put_varint(&head, pool->nstrs);
+		bin_put_varint(&head, body.cnt);
+
+		if (fwrite(head.s, 1, head.cnt, fp) != head.cnt
+			|| fwrite(pool->strs, 1, pool->nstrs, fp) != pool->nstrs
+			|| fwrite(body.s, 1, body.cnt, fp) != body.cnt)
+		{
+			sconf_last_error = SCONF_ERR_IO;
+			ret = SCONF_FALSE;
+		}
+	}
+
+	cstr_destroy(&head);
+	cstr_destroy(&body);
+	sconf_pool_destroy(pool);
+
+	return (ret);
+}
+
+static inline int
+bin_get_varint(struct bin_in *in, uint64_t *v)
+{
+	unsigned int shift;
+	uint64_t b;
+
+	*v = 0;
+	for (shift = 0; in->ptr < in->end && shift < 64; shift += 7)
+	{
+		b = *in->ptr++;
+		*v |= (b & 0x7f) << shift;
+		if (!(b & 0x80)) return (SCONF_TRUE);
+	}
+
+	return (SCONF_FALSE);
+}
+
+/*
+ * Decode the body into nodes, strings point into strs. Lists need room for
+ * their index and are taken from the arena instead.
+ */
+static struct sconf *
+bin_decode(struct bin_in *in, struct arena *arena, struct sconf *nodes,
+		   uint64_t nobjs, struct bin_frame *frames, uint64_t maxdepth,
+		   char *strs, uint64_t nstrs)
+{
+	struct list_obj *obj;
+	struct sconf *root;
+	struct sconf *sexp;
+	uint64_t depth;
+	uint64_t n;
+	uint64_t v;
+	int k;
+
+	root = NULL;
+	depth = 0;
+	for (n = 0; n < nobjs && in->ptr < in->end; n++)
+	{
+		if (*in->ptr == SCONF_T_LIST)
+		{
+			obj = (struct list_obj *)arena_alloc(arena,
+												 sizeof(struct list_obj),
+												 ARENA_NODE_ALIGN);
+			if (obj == NULL) return (NULL);
+			sexp = list_init(obj, SCONF_F_ARENA);
+		}
+		else
+		{
+			sexp = nodes + n;
+			sexp->type = *in->ptr;
+			sexp->flags = SCONF_F_ARENA;
+			sexp->view_len = 0;
+			sexp->next = NULL;
+			sexp->prev = NULL;
+		}
+		in->ptr++;
+		if (root == NULL) root = sexp;
+		if (depth > 0)
+		{
+			sconf_list_append(frames[depth - 1].lst, sexp);
+			frames[depth - 1].left--;
+		}
+
+		switch (sexp->type)
+		{
+		case SCONF_T_LIST:
+			if (bin_get_varint(in, &v) != SCONF_TRUE) return (NULL);
+			if (v == 0) break;
+
+			if (depth == maxdepth) return (NULL);
+			frames[depth].lst = sexp;
+			frames[depth].left = v;
+			depth++;
+			continue;
+		case SCONF_T_STRING:
+		case SCONF_T_SYMBOL:
+			if (bin_get_varint(in, &v) != SCONF_TRUE || v >= nstrs)
+			{
+				return (NULL);
+			}
+			sexp->value.as_string = strs + v;
+			break;
+		case SCONF_T_INT:
+			if (bin_get_varint(in, &v) != SCONF_TRUE) return (NULL);
+			sexp->value.as_int = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+			break;
+		case SCONF_T_DOUBLE:
+			if (in->end - in->ptr < 8) return (NULL);
+			for (v = 0, k = 0; k < 8; k++)
+			{
+				v |= (uint64_t)*in->ptr++ << (k * 8);
+			}
+			memcpy(&sexp->value.as_double, &v, sizeof(double));
+			break;
+		case SCONF_T_BOOL:
+		case SCONF_T_CHAR:
+			if (in->ptr == in->end) return (NULL);
+			sexp->value.as_int = (sexp->type == SCONF_T_CHAR)
+				? (char)*in->ptr : (*in->ptr != 0);
+			in->ptr++;
+			break;
+		case SCONF_T_NIL:
+			break;
+		default:
+			return (NULL);
+		}
+
+		while (depth > 0 && frames[depth - 1].left == 0)
+		{
+			depth--;
+			if (list_index_new(frames[depth].lst, arena) != SCONF_TRUE)
+			{
+				return (NULL);
+			}
+		}
+		if (depth == 0) break;
+	}
+
+	if (depth != 0 || n + 1 != nobjs || in->ptr != in->end) return (NULL);
+
+	return (root);
+}
+
+/* strings are copied unless the document already owns the input */
+static struct sconf_doc *
+bin_load(const char *data, size_t len, struct source *src)
+{
+	struct sconf_doc *doc;
+	struct bin_in in;
+	uint64_t nobjs;
+	uint64_t depth;
+	uint64_t nstrs;
+	uint64_t nbody;
+	size_t sz;
+	char *block;
+	char *strs;
+
+	in.ptr = (const unsigned char *)data;
+	in.end = in.ptr + len;
+	if (len < BIN_HEADER_LEN || memcmp(data, bin_magic, BIN_MAGIC_LEN) != 0
+		|| data[BIN_MAGIC_LEN] != SCONF_BINARY_VERSION)
+	{
+		sconf_last_error = SCONF_ERR_FORMAT;
+		return (NULL);
+	}
+	in.ptr += BIN_HEADER_LEN;
+
+	/* every object takes at least one byte of the body, which keeps the
+	 * allocation below in proportion with the input. */
+	if (bin_get_varint(&in, &nobjs) != SCONF_TRUE
+		|| bin_get_varint(&in, &depth) != SCONF_TRUE
+		|| bin_get_varint(&in, &nstrs) != SCONF_TRUE
+		|| bin_get_varint(&in, &nbody) != SCONF_TRUE
+		|| nstrs > (uint64_t)(in.end - in.ptr)
+		|| nbody != (uint64_t)(in.end - in.ptr) - nstrs
+		|| nobjs == 0 || nobjs > nbody || depth > nobjs
+		|| (nstrs > 0 && in.ptr[nstrs - 1] != '\0'))
+	{
+		sconf_last_error = SCONF_ERR_FORMAT;
+		return (NULL);
+	}
+
+	doc = (struct sconf_doc *)mem_alloc(heap_mem, sizeof(struct sconf_doc));
+	if (doc == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	intern_init(&doc->symbols, &doc->arena);
+	memset(&doc->src, 0, sizeof(struct source));
+	doc->root = NULL;
+
+	sz = (size_t)nobjs * sizeof(struct sconf)
+		+ (size_t)depth * sizeof(struct bin_frame);
+	arena_init(&doc->arena, sz, heap_mem);
+	block = (char *)arena_alloc(&doc->arena,
+								sz + (src == NULL ? (size_t)nstrs : 0),
+								ARENA_NODE_ALIGN);
+	if (block == NULL)
+	{
+		sconf_doc_destroy(doc);
+		return (NULL);
+	}
+
+	strs = (char *)in.ptr;
+	if (src == NULL)
+	{
+		strs = block + sz;
+		memcpy(strs, in.ptr, (size_t)nstrs);
+	}
+	in.ptr += nstrs;
+
+	sconf_last_error = SCONF_OK;
+	doc->root = bin_decode(&in, &doc->arena, (struct sconf *)block, nobjs,
+						   (struct bin_frame *)(block + nobjs
+												* sizeof(struct sconf)),
+						   depth, strs, nstrs);
+	if (doc->root == NULL)
+	{
+		if (sconf_last_error != SCONF_ERR_MALLOC)
+		{
+			sconf_last_error = SCONF_ERR_FORMAT;
+		}
+		sconf_doc_destroy(doc);
+		return (NULL);
+	}
+
+	if (src != NULL) doc->src = *src;
+	return (doc);
+}
+
+struct sconf_doc *
+sconf_load_binary(const void *buf, size_t len)
+{
+	if (buf == NULL) return (NULL);
+
+	return (bin_load((const char *)buf, len, NULL));
+}
+
+struct sconf_doc *
+sconf_load_binary_path(const char *path)
+{
+	struct sconf_doc *doc;
+	struct source src;
+
+	if (source_load_path(&src, path, heap_mem, SCONF_FALSE) != SCONF_TRUE)
+	{
+		return (NULL);
+	}
+
+	/* strings are read in place, the buffer goes to the document */
+	doc = bin_load(src.data, src.len, &src);
+	if (doc == NULL) source_release(&src);
+
+	return (doc);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * writer
+ * ---------------------------------------------------------------------------
+ */
+
+#define WRITER_BUF_LEN   4096
+#define WRITER_TOKEN_MAX 32    /* longest number or character name */
+#define WRITER_STACK_LEN 32
+#define WRITER_INDENT    2
+
+struct writer {
+	sconf_write_fn fn;
+	void *ud;
+	int failed;         /* fn asked to stop */
+	size_t len;
+	char buf[WRITER_BUF_LEN];
+};
+
+static void
+writer_flush(struct writer *w)
+{
+	if (w->len > 0 && !w->failed && w->fn(w->ud, w->buf, w->len) != SCONF_TRUE)
+	{
+		w->failed = 1;
+	}
+	w->len = 0;
+}
+
+/* room for n more bytes in the buffer, n <= WRITER_BUF_LEN */
+static inline char *
+writer_room(struct writer *w, size_t n)
+{
+	if (WRITER_BUF_LEN - w->len < n) writer_flush(w);
+
+	return (w->buf + w->len);
+}
+
+static void
+writer_put(struct writer *w, const char *s, size_t n)
+{
+	if (WRITER_BUF_LEN - w->len < n)
+	{
+		writer_flush(w);
+		if (n >= WRITER_BUF_LEN)
+		{
+			/* no point copying large chunks around */
+			if (!w->failed && w->fn(w->ud, s, n) != SCONF_TRUE) w->failed = 1;
+			return;
+		}
+	}
+
+	memcpy(w->buf + w->len, s, n);
+	w->len += n;
+}
+
+static inline void
+writer_byte(struct writer *w, char c)
+{
+	if (w->len == WRITER_BUF_LEN) writer_flush(w);
+
+	w->buf[w->len++] = c;
+}
+
+static const char digits2[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* digits of v ending at end, return the first one */
+static char *
+format_u64(char *end, uint64_t v)
+{
+	while (v >= 100)
+	{
+		end -= 2;
+		memcpy(end, digits2 + (v % 100) * 2, 2);
+		v /= 100;
+	}
+
+	if (v >= 10)
+	{
+		end -= 2;
+		memcpy(end, digits2 + v * 2, 2);
+	}
+	else
+	{
+		*--end = (char)('0' + v);
+	}
+
+	return (end);
+}
+
+static size_t
+format_int(char *buf, int64_t i)
+{
+	char tmp[20];
+	char *p;
+	size_t n;
+
+	n = 0;
+	if (i < 0) buf[n++] = '-';
+
+	p = format_u64(tmp + sizeof(tmp), (i < 0) ? -(uint64_t)i : (uint64_t)i);
+	memcpy(buf + n, p, (size_t)(tmp + sizeof(tmp) - p));
+
+	return (n + (size_t)(tmp + sizeof(tmp) - p));
+}
+
+/*
+ * Shortest decimal reading back as a given double, after Giulietti's
+ * Schubfach. The value c 2^q is scaled by 10^-k using 126 bits of 5^-k
+ * taken from the parser table.
+ */
+#define DTOA_C_MIN  (UINT64_C(1) << 52)
+#define DTOA_Q_MIN  (-1074)
+#define DTOA_C_TINY 3
+#define DTOA_MASK63 ((UINT64_C(1) << 63) - 1)
+
+/* floor(q log10(2)), floor(q log10(2) + log10(3/4)), floor(e log2(10)) */
+#define FLOG10_POW2(q) \
+	((int)(((int64_t)(q) * INT64_C(661971961083)) >> 41))
+#define FLOG10_3Q_POW2(q) \
+	((int)(((int64_t)(q) * INT64_C(661971961083) \
+			- INT64_C(274743187321)) >> 41))
+#define FLOG2_POW10(e) \
+	((int)(((int64_t)(e) * INT64_C(913124641741)) >> 38))
+
+/* g cp / 2^127 rounded to odd, g being split in two 63-bit limbs */
+static inline uint64_t
+dtoa_rop(uint64_t g1, uint64_t g0, uint64_t cp)
+{
+	uint64_t x1;
+	uint64_t x0;
+	uint64_t y1;
+	uint64_t y0;
+	uint64_t z;
+
+	mul_64x64(g0, cp, &x1, &x0);
+	mul_64x64(g1, cp, &y1, &y0);
+	z = (y0 >> 1) + x1;
+
+	return ((y1 + (z >> 63)) | (((z & DTOA_MASK63) + DTOA_MASK63) >> 63));
+}
+
+/* c 2^q is f 10^e, dk adjusts e when c was scaled by 10 */
+static void
+dtoa_shortest(uint64_t c, int q, int dk, uint64_t *f, int *e)
+{
+	uint64_t cb;
+	uint64_t cbl;
+	uint64_t cbr;
+	uint64_t vb;
+	uint64_t vbl;
+	uint64_t vbr;
+	uint64_t s;
+	uint64_t t;
+	uint64_t hi;
+	uint64_t lo;
+	uint64_t g1;
+	uint64_t g0;
+	int64_t cmp;
+	int out;
+	int uin;
+	int win;
+	int k;
+	int h;
+
+	out = (int)(c & 1);
+	cb = c << 2;
+	cbr = cb + 2;
+	if (c != DTOA_C_MIN || q == DTOA_Q_MIN)
+	{
+		cbl = cb - 2;
+		k = FLOG10_POW2(q);
+	}
+	else
+	{
+		/* closer lower neighbor at a power of two */
+		cbl = cb - 1;
+		k = FLOG10_3Q_POW2(q);
+	}
+	h = q + FLOG2_POW10(-k) + 2;
+
+	/* g = floor(5^-k on 126 bits) + 1, undo the rounded up entries */
+	hi = pow5_128[-k - POW5_MIN][0];
+	lo = pow5_128[-k - POW5_MIN][1];
+	if (-k >= -27 && -k <= -1 && lo-- == 0) hi--;
+	lo = (lo >> 2) | (hi << 62);
+	hi >>= 2;
+	if (++lo == 0) hi++;
+	g1 = (hi << 1) | (lo >> 63);
+	g0 = lo & DTOA_MASK63;
+
+	vb = dtoa_rop(g1, g0, cb << h);
+	vbl = dtoa_rop(g1, g0, cbl << h);
+	vbr = dtoa_rop(g1, g0, cbr << h);
+
+	*e = k + dk;
+	s = vb >> 2;
+	if (s >= 100)
+	{
+		/* try one digit less first */
+		t = s / 10 * 10;
+		uin = vbl + out <= t << 2;
+		win = ((t + 10) << 2) + out <= vbr;
+		if (uin != win)
+		{
+			*f = uin ? t : t + 10;
+			return;
+		}
+	}
+
+	t = s + 1;
+	uin = vbl + out <= s << 2;
+	win = (t << 2) + out <= vbr;
+	if (uin != win)
+	{
+		*f = uin ? s : t;
+		return;
+	}
+
+	/* both fit, take the closest one */
+	cmp = (int64_t)(vb - ((s + t) << 1));
+	*f = (cmp < 0 || (cmp == 0 && (s & 1) == 0)) ? s : t;
+}
+
+/* f 10^e as the parser reads it back: always a '.' or an exponent */
+static size_t
+format_decimal(char *buf, uint64_t f, int e)
+{
+	char tmp[20];
+	char *p;
+	size_t n;
+	size_t i;
+	int dp;
+
+	p = format_u64(tmp + sizeof(tmp), f);
+	n = (size_t)(tmp + sizeof(tmp) - p);
+	while (n > 1 && p[n - 1] == '0')
+	{
+		n--;
+		e++;
+	}
+
+	/* position of the decimal point from the first digit */
+	dp = (int)n + e;
+	i = 0;
+	if (dp > 0 && dp <= 21)
+	{
+		if ((size_t)dp >= n)
+		{
+			memcpy(buf, p, n);
+			memset(buf + n, '0', (size_t)dp - n);
+			i = (size_t)dp;
+			buf[i++] = '.';
+			buf[i++] = '0';
+		}
+		else
+		{
+			memcpy(buf, p, (size_t)dp);
+			buf[dp] = '.';
+			memcpy(buf + dp + 1, p + dp, n - (size_t)dp);
+			i = n + 1;
+		}
+	}
+	else if (dp <= 0 && dp > -6)
+	{
+		buf[i++] = '0';
+		buf[i++] = '.';
+		memset(buf + i, '0', (size_t)-dp);
+		i += (size_t)-dp;
+		memcpy(buf + i, p, n);
+		i += n;
+	}
+	else
+	{
+		buf[i++] = p[0];
+		if (n > 1)
+		{
+			buf[i++] = '.';
+			memcpy(buf + i, p + 1, n - 1);
+			i += n - 1;
+		}
+		buf[i++] = 'e';
+		i += format_int(buf + i, dp - 1);
+	}
+
+	return (i);
+}
+
+static size_t
+format_double(char *buf, double d)
+{
+	uint64_t bits;
+	uint64_t t;
+	uint64_t c;
+	uint64_t f;
+	size_t n;
+	int bq;
+	int mq;
+	int e;
+
+	memcpy(&bits, &d, sizeof(bits));
+	t = bits & (DTOA_C_MIN - 1);
+	bq = (int)(bits >> 52) & 0x7FF;
+	if (bq == 0x7FF)
+	{
+		memcpy(buf, (t != 0) ? "+nan.0" : (bits >> 63) ? "-inf.0" : "+inf.0",
+			   6);
+		return (6);
+	}
+
+	n = 0;
+	if (bits >> 63) buf[n++] = '-';
+
+	f = 0;
+	e = 0;
+	if (bq != 0)
+	{
+		mq = 1075 - bq;
+		c = DTOA_C_MIN | t;
+		if (mq > 0 && mq < 53 && ((c >> mq) << mq) == c)
+		{
+			/* small integers are exact */
+			f = c >> mq;
+		}
+		else
+		{
+			dtoa_shortest(c, -mq, 0, &f, &e);
+		}
+	}
+	else if (t != 0)
+	{
+		if (t < DTOA_C_TINY)
+		{
+			dtoa_shortest(t * 10, DTOA_Q_MIN, -1, &f, &e);
+		}
+		else
+		{
+			dtoa_shortest(t, DTOA_Q_MIN, 0, &f, &e);
+		}
+	}
+
+	return (n + format_decimal(buf + n, f, e));
+}
+
+/* length of the run that needs no escaping */
+static size_t
+write_plain_end(const char *s, size_t len)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, s + i, 8);
+		if (SWAR_LESS(v, 0x20) | SWAR_HAS(v, '"') | SWAR_HAS(v, '\\')) break;
+	}
+
+	for (; i < len; i++)
+	{
+		switch (s[i])
+		{
+		case '"':
+		case '\\':
+		case '\n':
+		case '\r':
+		case '\t':
+			return (i);
+		default:
+			break;
+		}
+	}
+
+	return (i);
+}
+
+static void
+write_string(struct writer *w, const char *s, size_t len)
+{
+	char *p;
+	size_t n;
+
+	writer_byte(w, '"');
+	for (;;)
+	{
+		n = write_plain_end(s, len);
+		writer_put(w, s, n);
+		if (n == len) break;
+
+		p = writer_room(w, 2);
+		p[0] = '\\';
+		switch (s[n])
+		{
+		case '\n':
+			p[1] = 'n';
+			break;
+		case '\r':
+			p[1] = 'r';
+			break;
+		case '\t':
+			p[1] = 't';
+			break;
+		default:
+			p[1] = s[n];
+			break;
+		}
+		w->len += 2;
+		s += n + 1;
+		len -= n + 1;
+	}
+	writer_byte(w, '"');
+}
+
+static void
+write_char(struct writer *w, char c)
+{
+	const char *name;
+	char *p;
+
+	switch (c)
+	{
+	case 0x0:
+		name = "null";
+		break;
+	case 0x7:
+		name = "alarm";
+		break;
+	case 0x8:
+		name = "backspace";
+		break;
+	case 0x9:
+		name = "tab";
+		break;
+	case 0xA:
+		name = "newline";
+		break;
+	case 0xD:
+		name = "return";
+		break;
+	case 0x1B:
+		name = "escape";
+		break;
+	case ' ':
+		name = "space";
+		break;
+	case 0x7F:
+		name = "delete";
+		break;
+	default:
+		name = NULL;
+		break;
+	}
+
+	p = writer_room(w, WRITER_TOKEN_MAX);
+	*p++ = '\\';
+	if (name != NULL)
+	{
+		memcpy(p, name, strlen(name));
+		w->len += 1 + strlen(name);
+	}
+	else
+	{
+		*p = c;
+		w->len += 2;
+	}
+}
+
+/*
+ * Whether the parser reads s back as the same symbol: it must not be empty,
+ * hold a delimiter, start like a number, string, char or comment, or be a
+ * keyword.
+ */
+static int
+write_symbol_ok(const char *s, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || s[0] == ';' || s[0] == '"' || s[0] == '\\'
+		|| CHAR_IS(s[0], CC_DIGIT))
+	{
+		return (SCONF_FALSE);
+	}
+	if (s[0] == '-' && len > 1 && (CHAR_IS(s[1], CC_DIGIT)
+		|| (s[1] == '.' && len > 2 && CHAR_IS(s[2], CC_DIGIT))))
+	{
+		return (SCONF_FALSE);
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		if (CHAR_IS(s[i], CC_DELIM)) return (SCONF_FALSE);
+	}
+
+	if (SYMBOL_IS(s, len, "yes") || SYMBOL_IS(s, len, "true")
+		|| SYMBOL_IS(s, len, "no") || SYMBOL_IS(s, len, "false")
+		|| SYMBOL_IS(s, len, "nil") || SYMBOL_IS(s, len, "+inf.0")
+		|| SYMBOL_IS(s, len, "-inf.0") || SYMBOL_IS(s, len, "+nan.0"))
+	{
+		return (SCONF_FALSE);
+	}
+
+	return (SCONF_TRUE);
+}
+
+static int
+write_atom(struct writer *w, const struct sconf *sexp)
+{
+	const char *s;
+	size_t len;
+
+	switch (sexp->type)
+	{
+	case SCONF_T_SYMBOL:
+		if (sexp->flags & SCONF_F_VIEW)
+		{
+			s = sexp->value.as_view;
+			len = sexp->view_len;
+		}
+		else
+		{
+			s = sexp->value.as_string;
+			len = strlen(s);
+		}
+		if (write_symbol_ok(s, len) != SCONF_TRUE)
+		{
+			sconf_last_error = SCONF_ERR_SYMBOL;
+			return (SCONF_FALSE);
+		}
+		writer_put(w, s, len);
+		break;
+	case SCONF_T_STRING:
+		if ((sexp->flags & SCONF_F_ESCAPED) && (sexp->flags & SCONF_F_VIEW))
+		{
+			/* still in input syntax */
+			writer_byte(w, '"');
+			writer_put(w, sexp->value.as_view, sexp->view_len);
+			writer_byte(w, '"');
+		}
+		else if (sexp->flags & SCONF_F_VIEW)
+		{
+			write_string(w, sexp->value.as_view, sexp->view_len);
+		}
+		else
+		{
+			write_string(w, sexp->value.as_string,
+						 strlen(sexp->value.as_string));
+		}
+		break;
+	case SCONF_T_INT:
+		writer_room(w, WRITER_TOKEN_MAX);
+		w->len += format_int(w->buf + w->len, sexp->value.as_int);
+		break;
+	case SCONF_T_DOUBLE:
+		writer_room(w, WRITER_TOKEN_MAX);
+		w->len += format_double(w->buf + w->len, sexp->value.as_double);
+		break;
+	case SCONF_T_NIL:
+		writer_put(w, "nil", 3);
+		break;
+	case SCONF_T_BOOL:
+		if (sexp->value.as_int == SCONF_TRUE)
+		{
+			writer_put(w, "true", 4);
+		}
+		else
+		{
+			writer_put(w, "false", 5);
+		}
+		break;
+	case SCONF_T_CHAR:
+		write_char(w, (char)sexp->value.as_int);
+		break;
+	case SCONF_T_LIST:
+		break;
+	}
+
+	return (SCONF_TRUE);
+}
+
+static void
+write_indent(struct writer *w, size_t depth)
+{
+	static const char spaces[] = "                                ";
+	size_t n;
+
+	writer_byte(w, '\n');
+	for (depth *= WRITER_INDENT; depth > 0; depth -= n)
+	{
+		n = (depth < sizeof(spaces) - 1) ? depth : sizeof(spaces) - 1;
+		writer_put(w, spaces, n);
+	}
+}
+
+/*
+ * Write a tree through fn. Pretty output starts every list on its own
+ * line but the first element of another list.
+ */
+static int
+write_run(const struct sconf *sexp, unsigned int flags, sconf_write_fn fn,
+		  void *ud)
+{
+	const struct sconf *fixed[WRITER_STACK_LEN];
+	const struct sconf **stack;
+	const struct sconf **tmp;
+	const struct sconf *top;
+	struct writer w;
+	size_t depth;
+	size_t cap;
+	int first;          /* sexp is the first element of its list */
+	int ret;
+
+	w.fn = fn;
+	w.ud = ud;
+	w.failed = 0;
+	w.len = 0;
+
+	/* stack[i] is the child being written in the i-th open list */
+	stack = fixed;
+	cap = WRITER_STACK_LEN;
+	depth = 0;
+	first = 0;
+	ret = SCONF_TRUE;
+	for (;;)
+	{
+		if (sexp->type != SCONF_T_LIST)
+		{
+			if (write_atom(&w, sexp) != SCONF_TRUE)
+			{
+				ret = SCONF_FALSE;
+				break;
+			}
+		}
+		else
+		{
+			if (depth > 0 && !first && (flags & SCONF_WRITE_PRETTY))
+			{
+				write_indent(&w, depth);
+			}
+			writer_byte(&w, '(');
+
+			if (sexp->value.as_child != NULL)
+			{
+				if (depth == cap)
+				{
+					tmp = (const struct sconf **)mem_alloc(heap_mem, cap * 2
+								* sizeof(const struct sconf *));
+					if (tmp == NULL)
+					{
+						sconf_last_error = SCONF_ERR_MALLOC;
+						ret = SCONF_FALSE;
+						break;
+					}
+					memcpy(tmp, stack, depth * sizeof(const struct sconf *));
+					if (stack != fixed) mem_free(heap_mem, stack);
+					stack = tmp;
+					cap *= 2;
+				}
+				sexp = sexp->value.as_child;
+				stack[depth++] = sexp;
+				first = 1;
+				continue;
+			}
+			writer_byte(&w, ')');
+		}
+
+		/* go to the next sibling, closing exhausted lists on the way */
+		while (depth > 0)
+		{
+			top = stack[depth - 1];
+			if (top->next != NULL)
+			{
+				sexp = top->next;
+				stack[depth - 1] = sexp;
+				first = 0;
+				if (!(flags & SCONF_WRITE_PRETTY)
+					|| sexp->type != SCONF_T_LIST)
+				{
+					writer_byte(&w, ' ');
+				}
+				break;
+			}
+			depth--;
+			writer_byte(&w, ')');
+		}
+
+		if (depth == 0 || w.failed) break;
+	}
+
+	if (stack != fixed) mem_free(heap_mem, stack);
+
+	writer_flush(&w);
+	if (w.failed)
+	{
+		sconf_last_error = SCONF_ERR_ABORTED;
+		ret = SCONF_FALSE;
+	}
+
+	return (ret);
+}
+
+int
+sconf_write(const struct sconf *sexp, unsigned int flags, sconf_write_fn fn,
+			void *ud)
+{
+	if (sexp == NULL || fn == NULL) return (SCONF_FALSE);
+
+	return (write_run(sexp, flags, fn, ud));
+}
+
+static int
+write_cstr(void *ud, const char *buf, size_t len)
+{
+	return (cstr_append_mem((struct cstr *)ud, buf, len));
+}
+
+char *
+sconf_write_str(const struct sconf *sexp, unsigned int flags, size_t *len)
+{
+	struct cstr cs;
+
+	if (sexp == NULL) return (NULL);
+
+	cstr_init(&cs, heap_mem);
+	if (write_run(sexp, flags, write_cstr, &cs) != SCONF_TRUE
+		|| cstr_append_mem(&cs, "", 1) != SCONF_TRUE)
+	{
+		/* only the string can stop the writing */
+		if (sconf_last_error == SCONF_ERR_ABORTED)
+		{
+			sconf_last_error = SCONF_ERR_MALLOC;
+		}
+		cstr_destroy(&cs);
+		return (NULL);
+	}
+
+	if (len != NULL) *len = cs.cnt - 1;
+	return (cs.s);
+}
+
+static int
+write_file(void *ud, const char *buf, size_t len)
+{
+	return ((fwrite(buf, 1, len, (FILE *)ud) == len)
+			? SCONF_TRUE : SCONF_FALSE);
+}
+
+void
+sconf_dump(FILE *fp, const struct sconf *sexp)
+{
+	if (fp == NULL || sexp == NULL) return;
+
+	if (write_run(sexp, SCONF_WRITE_PRETTY, write_file, fp) != SCONF_TRUE
+		&& sconf_last_error == SCONF_ERR_ABORTED)
+	{
+		sconf_last_error = SCONF_ERR_IO;
+	}
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * query
+ * ---------------------------------------------------------------------------
+ *
+ * A query is the list of its steps, a wildcard has a NULL name. It runs
+ * as a depth-first walk that keeps the next sibling to try at each step
+ * in the iterator, so only the entries matched by a step are descended
+ * into and nothing is allocated.
+ */
+
+struct query_step {
+	const char *name;
+	size_t len;
+};
+
+struct sconf_query {
+	size_t nsteps;
+	struct query_step steps[SCONF_QUERY_MAX_STEPS];
+	char names[];
+};
+
+static inline int
+query_match(const struct query_step *step, const struct sconf *entry)
+{
+	const char *ptr;
+	size_t len;
+
+	if (entry->type != SCONF_T_LIST) return (SCONF_FALSE);
+	if (step->name == NULL) return (SCONF_TRUE);
+
+	return ((assoc_key(entry, &ptr, &len) == SCONF_TRUE
+			 && len == step->len && memcmp(ptr, step->name, len) == 0)
+			? SCONF_TRUE : SCONF_FALSE);
+}
+
+/* the elements of an entry, past its key if it has one */
+static inline struct sconf *
+query_body(const struct sconf *entry)
+{
+	struct sconf *head;
+
+	head = entry->value.as_child;
+	if (head != NULL && head->type == SCONF_T_SYMBOL) return (head->next);
+	return (head);
+}
+
+struct sconf_query *
+sconf_query_compile(const char *path)
+{
+	struct sconf_query *q;
+	const char *end;
+	char *names;
+	size_t len;
+	size_t i;
+
+	if (path == NULL) goto err_query;
+	if (*path == '/') path++;
+
+	len = strlen(path);
+	q = (struct sconf_query *)mem_alloc(heap_mem,
+										sizeof(struct sconf_query) + len + 1);
+	if (q == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	names = q->names;
+	memcpy(names, path, len + 1);
+
+	for (i = 0;; i++)
+	{
+		end = strchr(names, '/');
+		len = (end != NULL) ? (size_t)(end - names) : strlen(names);
+		if (len == 0 || i == SCONF_QUERY_MAX_STEPS)
+		{
+			mem_free(heap_mem, q);
+			goto err_query;
+		}
+
+		q->steps[i].name = (len == 1 && *names == '*') ? NULL : names;
+		q->steps[i].len = len;
+		if (end == NULL) break;
+
+		names[len] = '\0';
+		names += len + 1;
+	}
+	q->nsteps = i + 1;
+
+	return (q);
+
+err_query:
+	sconf_last_error = SCONF_ERR_QUERY;
+	return (NULL);
+}
+
+void
+sconf_query_exec(const struct sconf_query *q, const struct sconf *lst,
+				 struct sconf_query_iter *it)
+{
+	it->query = NULL;
+	it->depth = 0;
+	if (q == NULL) return;
+
+	if (!sconf_is_list(lst))
+	{
+		sconf_last_error = SCONF_ERR_NOTALIST;
+		return;
+	}
+
+	it->query = q;
+	it->pos[0] = lst->value.as_child;
+}
+
+struct sconf *
+sconf_query_next(struct sconf_query_iter *it)
+{
+	const struct sconf_query *q;
+	struct sconf *cur;
+	size_t d;
+
+	q = it->query;
+	while (q != NULL)
+	{
+		d = it->depth;
+		for (cur = it->pos[d]; cur != NULL; cur = cur->next)
+		{
+			if (query_match(q->steps + d, cur) == SCONF_TRUE) break;
+		}
+
+		if (cur == NULL)
+		{
+			if (d == 0) break;
+			it->depth--;
+			continue;
+		}
+
+		it->pos[d] = cur->next;
+		if (d + 1 == q->nsteps) return (cur);
+
+		it->pos[d + 1] = query_body(cur);
+		it->depth++;
+	}
+
+	it->query = NULL;
+	return (NULL);
+}
+
+struct sconf *
+sconf_query_get(const struct sconf_query *q, const struct sconf *lst)
+{
+	struct sconf_query_iter it;
+
+	sconf_query_exec(q, lst, &it);
+	return (sconf_query_next(&it));
+}
+
+void
+sconf_query_destroy(struct sconf_query *q)
+{
+	mem_free(heap_mem, q);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * snapshot
+ * ---------------------------------------------------------------------------
+ *
+ * sconf_current_get() loads the snapshot pointer and then takes a
+ * reference, so a publisher must not drop the slot's reference between
+ * the two. Readers announce themselves in one of two counters, picked by
+ * the phase. A publisher swaps the pointer, flips the phase and waits for
+ * the counter of the old phase to drain: readers that saw the old pointer
+ * all registered there, and new readers go to the other counter, so the
+ * wait is bounded however busy the readers are.
+ *
+ * A reader that loaded the phase before a flip would register in the
+ * counter nobody waits for anymore, so it reads the phase again once
+ * registered and starts over if it changed. Publishers take a lock: the
+ * next one must not flip the phase back before the readers of the
+ * previous one drained.
+ */
+
+#ifdef __GNUC__
+# define SHARED_LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+# define SHARED_XCHG(x, v) __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+# define SHARED_FLIP(x) __atomic_fetch_xor(&(x), 1, __ATOMIC_SEQ_CST)
+# define SHARED_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+# define SHARED_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#else
+# define SHARED_LOAD(x) (x)
+# define SHARED_XCHG(x, v) shared_xchg((void **)&(x), (v))
+# define SHARED_FLIP(x) (((x) ^= 1) ^ 1)
+# define SHARED_INC(x) (++(x))
+# define SHARED_DEC(x) (--(x))
+
+static inline void *
+shared_xchg(void **ptr, void *val)
+{
+	void *old;
+
+	old = *ptr;
+	*ptr = val;
+	return (old);
+}
+#endif /* __GNUC__ */
+
+struct sconf_snapshot {
+	unsigned long refs;
+	struct sconf_doc *doc;
+};
+
+struct sconf_current {
+	struct sconf_snapshot *snap;
+	unsigned int phase;
+	unsigned long readers[2];
+#ifdef USE_PTHREAD
+	pthread_mutex_t lock; /* one publisher at a time */
+#endif /* USE_PTHREAD */
+};
+
+static int
+snapshot_freeze(struct sconf_doc *doc)
+{
+	struct sconf **stack;
+	struct sconf **tmp;
+	struct sconf *sexp;
+	size_t depth;
+	size_t cap;
+	int ret;
+
+	sexp = doc->root;
+	if (sexp == NULL) return (SCONF_TRUE);
+
+	stack = NULL;
+	depth = 0;
+	cap = 0;
+	ret = SCONF_TRUE;
+	for (;;)
+	{
+		if (sexp->type == SCONF_T_LIST)
+		{
+			if (sconf_doc_index(doc, sexp) != SCONF_TRUE)
+			{
+				ret = SCONF_FALSE;
+				break;
+			}
+
+			if (sexp->value.as_child != NULL)
+			{
+				if (depth == cap)
+				{
+					cap = cap ? cap * 2 : WALK_STACK_BASE_CAP;
+					tmp = (struct sconf **)mem_realloc(heap_mem, stack,
+											cap * sizeof(struct sconf *));
+					if (tmp == NULL)
+					{
+						ret = SCONF_FALSE;
+						break;
+					}
+					stack = tmp;
+				}
+				sexp = sexp->value.as_child;
+				stack[depth++] = sexp;
+				continue;
+			}
+		}
+		else if ((sexp->flags & (SCONF_F_VIEW | SCONF_F_ESCAPED))
+				 == (SCONF_F_VIEW | SCONF_F_ESCAPED)
+				 && sconf_doc_string(doc, sexp, NULL) == NULL)
+		{
+			ret = SCONF_FALSE;
+			break;
+		}
+
+		while (depth > 0 && stack[depth - 1]->next == NULL) depth--;
+		if (depth == 0) break;
+
+		sexp = stack[depth - 1]->next;
+		stack[depth - 1] = sexp;
+	}
+
+	mem_free(heap_mem, stack);
+	return (ret);
+}
+
+struct sconf_snapshot *
+sconf_snapshot_new(struct sconf_doc *doc)
+{
+	struct sconf_snapshot *snap;
+
+	if (doc == NULL) return (NULL);
+
+	snap = (struct sconf_snapshot *)mem_alloc(doc->arena.mem,
+											  sizeof(struct sconf_snapshot));
+	if (snap == NULL || snapshot_freeze(doc) != SCONF_TRUE)
+	{
+		mem_free(doc->arena.mem, snap);
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	snap->refs = 1;
+	snap->doc = doc;
+
+	return (snap);
+}
+
+struct sconf_snapshot *
+sconf_snapshot_acquire(struct sconf_snapshot *snap)
+{
+	if (snap != NULL) SHARED_INC(snap->refs);
+
+	return (snap);
+}
+
+void
+sconf_snapshot_release(struct sconf_snapshot *snap)
+{
+	const struct sconf_allocator *mem;
+
+	if (snap == NULL || SHARED_DEC(snap->refs) != 0) return;
+
+	mem = snap->doc->arena.mem;
+	sconf_doc_destroy(snap->doc);
+	mem_free(mem, snap);
+}
+
+struct sconf *
+sconf_snapshot_root(const struct sconf_snapshot *snap)
+{
+	if (snap == NULL) return (NULL);
+
+	return (snap->doc->root);
+}
+
+struct sconf_current *
+sconf_current_new(struct sconf_snapshot *snap)
+{
+	struct sconf_current *cur;
+
+	cur = (struct sconf_current *)mem_alloc(heap_mem,
+											sizeof(struct sconf_current));
+	if (cur == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+	cur->snap = snap;
+	cur->phase = 0;
+	cur->readers[0] = 0;
+	cur->readers[1] = 0;
+#ifdef USE_PTHREAD
+	pthread_mutex_init(&cur->lock, NULL);
+#endif /* USE_PTHREAD */
+
+	return (cur);
+}
+
+struct sconf_snapshot *
+sconf_current_get(struct sconf_current *cur)
+{
+	struct sconf_snapshot *snap;
+	unsigned int phase;
+
+	for (;;)
+	{
+		phase = SHARED_LOAD(cur->phase) & 1;
+		SHARED_INC(cur->readers[phase]);
+		if ((SHARED_LOAD(cur->phase) & 1) == phase) break;
+		SHARED_DEC(cur->readers[phase]);
+	}
+	snap = sconf_snapshot_acquire(SHARED_LOAD(cur->snap));
+	SHARED_DEC(cur->readers[phase]);
+
+	return (snap);
+}
+
+void
+sconf_current_publish(struct sconf_current *cur, struct sconf_snapshot *snap)
+{
+	struct sconf_snapshot *old;
+	unsigned int phase;
+
+#ifdef USE_PTHREAD
+	pthread_mutex_lock(&cur->lock);
+#endif /* USE_PTHREAD */
+	old = (struct sconf_snapshot *)SHARED_XCHG(cur->snap, snap);
+	phase = SHARED_FLIP(cur->phase) & 1;
+	while (SHARED_LOAD(cur->readers[phase]) != 0)
+	{
+#ifdef USE_PTHREAD
+		sched_yield();
+#endif /* USE_PTHREAD */
+	}
+#ifdef USE_PTHREAD
+	pthread_mutex_unlock(&cur->lock);
+#endif /* USE_PTHREAD */
+
+	sconf_snapshot_release(old);
+}
+
+void
+sconf_current_destroy(struct sconf_current *cur)
+{
+	if (cur == NULL) return;
+
+	sconf_snapshot_release(cur->snap);
+#ifdef USE_PTHREAD
+	pthread_mutex_destroy(&cur->lock);
+#endif /* USE_PTHREAD */
+	mem_free(heap_mem, cur);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * reload
+ * ---------------------------------------------------------------------------
+ *
+ * The directory is watched rather than the file, so that a file replaced
+ * by a rename, as editors and deployment tools do, keeps being followed.
+ * Only closes after writing are looked at, never plain modifications,
+ * which would show a half-written file.
+ */
+
+struct sconf_reload {
+	struct sconf_current *cur;
+	unsigned long generation;
+	char *path;
+	struct sconf_opts parse;
+	struct sconf_reload_opts opts;
+#ifdef USE_PTHREAD
+	pthread_mutex_t lock; /* one reload at a time */
+#endif /* USE_PTHREAD */
+#ifdef USE_INOTIFY
+	const char *base;     /* file name within path */
+	int watching;
+	int ifd;
+	int wake[2];          /* written to stop the watcher */
+	pthread_t watcher;
+#endif /* USE_INOTIFY */
+};
+
+static int
+reload_run(struct sconf_reload *rl)
+{
+	struct sconf_snapshot *snap;
+	struct sconf_doc *doc;
+	struct source src;
+	enum sconf_error err;
+	unsigned long gen;
+
+#ifdef USE_PTHREAD
+	pthread_mutex_lock(&rl->lock);
+#endif /* USE_PTHREAD */
+
+	/*
+	 * Read the file, never map it: the file is rewritten in place while
+	 * the server runs, a mapping would show the new bytes through live
+	 * snapshots and raise SIGBUS once truncated.
+	 */
+	snap = NULL;
+	doc = NULL;
+	if (source_load_path(&src, rl->path, opts_mem(rl->opts.parse),
+						 SCONF_FALSE) == SCONF_TRUE)
+	{
+		doc = load_doc_source(&src, rl->opts.parse);
+	}
+	if (doc != NULL && rl->opts.validate != NULL
+		&& rl->opts.validate(rl->opts.ud, sconf_doc_root(doc)) != SCONF_TRUE)
+	{
+		sconf_doc_destroy(doc);
+		doc = NULL;
+		sconf_last_error = SCONF_ERR_ABORTED;
+	}
+	if (doc != NULL)
+	{
+		snap = sconf_snapshot_new(doc);
+		if (snap == NULL) sconf_doc_destroy(doc);
+	}
+
+	if (snap != NULL)
+	{
+		/* the slot's reference keeps snap alive for the callback */
+		sconf_current_publish(rl->cur, snap);
+		gen = SHARED_INC(rl->generation);
+		err = SCONF_OK;
+	}
+	else
+	{
+		gen = SHARED_LOAD(rl->generation);
+		err = sconf_last_error;
+	}
+
+	if (rl->opts.changed != NULL)
+	{
+		rl->opts.changed(rl->opts.ud, snap, gen, err);
+	}
+
+#ifdef USE_PTHREAD
+	pthread_mutex_unlock(&rl->lock);
+#endif /* USE_PTHREAD */
+
+	return ((snap != NULL) ? SCONF_TRUE : SCONF_FALSE);
+}
+
+#ifdef USE_INOTIFY
+static void *
+reload_watch(void *arg)
+{
+	struct sconf_reload *rl;
+	struct pollfd fds[2];
+	const struct inotify_event *ev;
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	ssize_t n;
+	ssize_t i;
+	int changed;
+
+	rl = (struct sconf_reload *)arg;
+	fds[0].fd = rl->ifd;
+	fds[0].events = POLLIN;
+	fds[1].fd = rl->wake[0];
+	fds[1].events = POLLIN;
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents != 0) break;
+
+		/* a save often comes as several events, reload once for all */
+		changed = 0;
+		while ((n = read(rl->ifd, u.buf, sizeof(u.buf))) > 0)
+		{
+			for (i = 0; i < n; i += (ssize_t)(sizeof(*ev) + ev->len))
+			{
+				ev = (const struct inotify_event *)(u.buf + i);
+				if (ev->len > 0 && strcmp(ev->name, rl->base) == 0) changed = 1;
+			}
+		}
+
+		if (changed) reload_run(rl);
+	}
+
+	return (NULL);
+}
+
+static int
+reload_watch_start(struct sconf_reload *rl)
+{
+	char *dir;
+	char *sep;
+
+	dir = mem_strdup(heap_mem, rl->path);
+	if (dir == NULL) return (SCONF_FALSE);
+
+	sep = strrchr(dir, '/');
+	if (sep == NULL)
+	{
+		rl->base = rl->path;
+		strcpy(dir, ".");
+	}
+	else
+	{
+		rl->base = rl->path + (sep - dir) + 1;
+		/* keep the slash of a file in the root directory */
+		if (sep == dir) sep++;
+		*sep = '\0';
+	}
+
+	rl->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (rl->ifd < 0)
+	{
+		mem_free(heap_mem, dir);
+		return (SCONF_FALSE);
+	}
+
+	if (inotify_add_watch(rl->ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0
+		|| pipe(rl->wake) != 0)
+	{
+		mem_free(heap_mem, dir);
+		close(rl->ifd);
+		return (SCONF_FALSE);
+	}
+	mem_free(heap_mem, dir);
+
+	fcntl(rl->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(rl->wake[1], F_SETFD, FD_CLOEXEC);
+	if (pthread_create(&rl->watcher, NULL, reload_watch, rl) != 0)
+	{
+		close(rl->wake[0]);
+		close(rl->wake[1]);
+		close(rl->ifd);
+		return (SCONF_FALSE);
+	}
+	rl->watching = 1;
+
+	return (SCONF_TRUE);
+}
+
+static void
+reload_watch_stop(struct sconf_reload *rl)
+{
+	if (!rl->watching) return;
+
+	while (write(rl->wake[1], "", 1) < 0 && errno == EINTR)
+		;
+	pthread_join(rl->watcher, NULL);
+	close(rl->wake[0]);
+	close(rl->wake[1]);
+	close(rl->ifd);
+	rl->watching = 0;
+}
+#endif /* USE_INOTIFY */
+
+struct sconf_reload *
+sconf_reload_new(const char *path, const struct sconf_reload_opts *opts)
+{
+	struct sconf_reload *rl;
+
+	if (path == NULL)
+	{
+		sconf_last_error = SCONF_ERR_IO;
+		return (NULL);
+	}
+
+	rl = (struct sconf_reload *)mem_alloc(heap_mem,
+										  sizeof(struct sconf_reload));
+	if (rl == NULL)
+	{
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+	memset(rl, 0, sizeof(struct sconf_reload));
+
+	if (opts != NULL) rl->opts = *opts;
+	if (rl->opts.parse != NULL)
+	{
+		rl->parse = *rl->opts.parse;
+		rl->opts.parse = &rl->parse;
+	}
+
+	rl->path = mem_strdup(heap_mem, path);
+	rl->cur = sconf_current_new(NULL);
+	if (rl->path == NULL || rl->cur == NULL)
+	{
+		sconf_current_destroy(rl->cur);
+		mem_free(heap_mem, rl->path);
+		mem_free(heap_mem, rl);
+		sconf_last_error = SCONF_ERR_MALLOC;
+		return (NULL);
+	}
+
+#ifdef USE_PTHREAD
+	pthread_mutex_init(&rl->lock, NULL);
+#endif /* USE_PTHREAD */
+
+	if (reload_run(rl) != SCONF_TRUE)
+	{
+		sconf_reload_destroy(rl);
+		return (NULL);
+	}
+
+#ifdef USE_INOTIFY
+	if (reload_watch_start(rl) != SCONF_TRUE)
+	{
+		sconf_reload_destroy(rl);
+		sconf_last_error = SCONF_ERR_IO;
+		return (NULL);
+	}
+#endif /* USE_INOTIFY */
+
+	return (rl);
+}
+
+struct sconf_snapshot *
+sconf_reload_get(struct sconf_reload *rl)
+{
+	return (sconf_current_get(rl->cur));
+}
+
+unsigned long
+sconf_reload_generation(const struct sconf_reload *rl)
+{
+	return (SHARED_LOAD(rl->generation));
+}
+
+int
+sconf_reload_now(struct sconf_reload *rl)
+{
+	return (reload_run(rl));
+}
+
+void
+sconf_reload_destroy(struct sconf_reload *rl)
+{
+	enum sconf_error err;
+
+	if (rl == NULL) return;
+
+	/* keep the error of a failed sconf_reload_new() */
+	err = sconf_last_error;
+#ifdef USE_INOTIFY
+	reload_watch_stop(rl);
+#endif /* USE_INOTIFY */
+#ifdef USE_PTHREAD
+	pthread_mutex_destroy(&rl->lock);
+#endif /* USE_PTHREAD */
+	sconf_current_destroy(rl->cur);
+	mem_free(heap_mem, rl->path);
+	mem_free(heap_mem, rl);
+	sconf_last_error = err;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ * diff
+ * ---------------------------------------------------------------------------
+ *
+ * Both trees are first flattened in preorder along with the hash and size
+ * of every subtree, so comparing two subtrees is one comparison and
+ * identical regions are skipped without being walked. Two subtrees are
+ * only taken as equal once their preorder runs match node for node, which
+ * is checked once per pair kept, so a hash collision costs time but never
+ * a wrong script.
+ *
+ * The elements of two lists are matched with Myers' algorithm on their
+ * hashes once the common ends are stripped. Deletions and insertions at
+ * the same place are then paired into replacements, or into a diff of
+ * two lists with the same key. Edits come out last position first, so
+ * every path is one of the old tree and stays valid while the script is
+ * applied in order.
+ */
+
+#define DIFF_DESCEND (-1)
+
+/*
+ * Past this many insertions and deletions in a list, stop looking for the
+ * shortest script and replace the rest of the list in bulk.
+ */
+#define DIFF_MAX_COST 512
+
+struct diff_node {
+	const struct sconf *sexp;
+	uint64_t hash;
+	size_t size; /* nodes in the subtree */
+};
+
+struct diff_tree {
+	struct diff_node *nodes;
+	size_t count;
+	size_t cap;
+};
+
+/* a list being flattened */
+struct diff_open {
+	const struct sconf *cur;
+	size_t id;
+	uint64_t hash;
+};
+
+struct diff_act {
+	int op;     /* enum sconf_edit_op or DIFF_DESCEND */
+	size_t pos; /* index in the list of the old tree */
+	size_t a;   /* old node, unused by inserts */
+	size_t b;   /* new node, unused by deletes */
+};
+
+/* the edits of a list, in the order they apply */
+struct diff_frame {
+	struct diff_act *acts;
+	size_t count;
+	size_t cap;
+	size_t next;
+	size_t pos; /* of the list in its parent */
+};
+
+struct diff_build {
+	struct diff_tree a;
+	struct diff_tree b;
+	struct cstr sa;
+	struct cstr sb;
+	struct diff_open *open;
+	size_t open_cap;
+	struct diff_frame *frames;
+	size_t frames_cap;
+	size_t *ca; /* elements of the lists being matched */
+	size_t ca_cap;
+	size_t *cb;
+	size_t cb_cap;
+	size_t *v;  /* furthest x reached on each diagonal, per cost */
+	size_t v_cap;
+	struct sconf_edit *edits;
+	size_t edits_cap;
+	size_t *offs; /* where the path of each edit starts in paths */
+	size_t offs_cap;
+	size_t nedits;
+	size_t *paths;
+	size_t paths_cap;
+	size_t npaths;
+};
+
+struct sconf_diff {
+	size_t count;
+	struct sconf_edit edits[];
+};
+
+static inline uint64_t
+diff_mix(uint64_t h, uint64_t v)
+{
+	h = (h ^ v) * UINT64_C(0x9e3779b97f4a7c15);
+	return (h ^ (h >> 29));
+}
+
+/* the text of a string or symbol, escaped views decoded into scratch */
+static int
+diff_bytes(const struct sconf *sexp, struct cstr *scratch, const char **ptr,
+		   size_t *len)
+{
+	symbol_bytes(sexp, ptr, len);
+	if ((sexp->flags & (SCONF_F_VIEW | SCONF_F_ESCAPED))
+		!= (SCONF_F_VIEW | SCONF_F_ESCAPED))
+	{
+		return (SCONF_TRUE);
+	}
+
+	cstr_reset(scratch);
+	if (cstr_reserve(scratch, *len) != SCONF_TRUE) return (SCONF_FALSE);
+
+	*len = string_unescape(scratch->s, *ptr, *len);
+	*ptr = scratch->s;
+	return (SCONF_TRUE);
+}
+
+static int
+diff_atom_hash(struct diff_build *b, const struct sconf *sexp, uint64_t *hash)
+{
+	const char *ptr;
+	uint64_t v;
+	size_t len;
+
+	switch (sexp->type)
+	{
+	case SCONF_T_STRING:
+	case SCONF_T_SYMBOL:
+		if (diff_bytes(sexp, &b->sa, &ptr, &len) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
+		v = str_hash(ptr, len);
+		break;
+	case SCONF_T_INT:
+	case SCONF_T_BOOL:
+	case SCONF_T_CHAR:
+		v = (uint64_t)sexp->value.as_int;
+		break;
+	case SCONF_T_DOUBLE:
+		memcpy(&v, &sexp->value.as_double, sizeof(v));
+		break;
+	default:
+		v = 0;
+		break;
+	}
+
+	*hash = diff_mix((uint64_t)sexp->type, v);
+	return (SCONF_TRUE);
+}
+
+static int
+diff_atom_equal(struct diff_build *b, const struct sconf *x,
+				const struct sconf *y)
+{
+	const char *px;
+	const char *py;
+	size_t lx;
+	size_t ly;
+
+	if (x->type != y->type) return (SCONF_FALSE);
+
+	switch (x->type)
+	{
+	case SCONF_T_STRING:
+	case SCONF_T_SYMBOL:
+		if (diff_bytes(x, &b->sa, &px, &lx) != SCONF_TRUE
+			|| diff_bytes(y, &b->sb, &py, &ly) != SCONF_TRUE)
+		{
+			return (PARSE_ABORTED);
+		}
+		return ((lx == ly && memcmp(px, py, lx) == 0)
+				? SCONF_TRUE : SCONF_FALSE);
+	case SCONF_T_INT:
+	case SCONF_T_BOOL:
+	case SCONF_T_CHAR:
+		return ((x->value.as_int == y->value.as_int)
+				? SCONF_TRUE : SCONF_FALSE);
+	case SCONF_T_DOUBLE:
+		return ((memcmp(&x->value.as_double, &y->value.as_double,
+						sizeof(double)) == 0) ? SCONF_TRUE : SCONF_FALSE);
+	default:
+		return (SCONF_TRUE);
+	}
+}
+
+static int
+diff_flatten(struct diff_build *b, struct diff_tree *t,
+			 const struct sconf *sexp)
+{
+	struct diff_open *top;
+	uint64_t hash;
+	size_t depth;
+	size_t id;
+
+	depth = 0;
+	for (;;)
+	{
+		if (pool_reserve(heap_mem, (void **)&t->nodes, &t->cap, t->count, 1,
+						 sizeof(struct diff_node)) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
+		id = t->count++;
+		t->nodes[id].sexp = sexp;
+
+		if (sexp->type == SCONF_T_LIST && sexp->value.as_child != NULL)
+		{
+			if (pool_reserve(heap_mem, (void **)&b->open, &b->open_cap, depth,
+							 1, sizeof(struct diff_open)) != SCONF_TRUE)
+			{
+				return (SCONF_FALSE);
+			}
+			top = b->open + depth++;
+			top->cur = sexp->value.as_child;
+			top->id = id;
+			top->hash = diff_mix(SCONF_T_LIST, 0);
+			sexp = top->cur;
+			continue;
+		}
+
+		if (diff_atom_hash(b, sexp, &hash) != SCONF_TRUE) return (SCONF_FALSE);
+		t->nodes[id].hash = hash;
+		t->nodes[id].size = 1;
+
+		/* fold the subtree into the lists it closes */
+		top = NULL;
+		while (depth > 0)
+		{
+			top = b->open + depth - 1;
+			top->hash = diff_mix(top->hash, hash);
+			if (top->cur->next != NULL) break;
+
+			hash = top->hash;
+			t->nodes[top->id].hash = hash;
+			t->nodes[top->id].size = t->count - top->id;
+			depth--;
+		}
+		if (depth == 0) break;
+
+		top->cur = top->cur->next;
+		sexp = top->cur;
+	}
+
+	return (SCONF_TRUE);
+}
+
+static inline int
+diff_same(const struct diff_build *b, size_t ia, size_t ib)
+{
+	return (b->a.nodes[ia].hash == b->b.nodes[ib].hash
+			&& b->a.nodes[ia].size == b->b.nodes[ib].size);
+}
+
+/* equal preorder runs, sizes included, make equal trees */
+static int
+diff_equal(struct diff_build *b, size_t ia, size_t ib)
+{
+	const struct diff_node *na;
+	const struct diff_node *nb;
+	size_t i;
+	int ret;
+
+	na = b->a.nodes + ia;
+	nb = b->b.nodes + ib;
+	if (na->size != nb->size) return (SCONF_FALSE);
+
+	for (i = 0; i < na->size; i++)
+	{
+		if (na[i].size != nb[i].size) return (SCONF_FALSE);
+
+		ret = diff_atom_equal(b, na[i].sexp, nb[i].sexp);
+		if (ret != SCONF_TRUE) return (ret);
+	}
+
+	return (SCONF_TRUE);
+}
+
+static int
+diff_act(struct diff_frame *f, int op, size_t pos, size_t a, size_t b)
+{
+	struct diff_act *act;
+
+	if (pool_reserve(heap_mem, (void **)&f->acts, &f->cap, f->count, 1,
+					 sizeof(struct diff_act)) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+
+	act = f->acts + f->count++;
+	act->op = op;
+	act->pos = pos;
+	act->a = a;
+	act->b = b;
+
+	return (SCONF_TRUE);
+}
+
+/* lists are diffed when both have the same key or neither has one */
+static int
+diff_pair(struct diff_build *b, struct diff_frame *f, size_t pos, size_t ia,
+		  size_t ib)
+{
+	const struct sconf *x;
+	const struct sconf *y;
+	const char *px;
+	const char *py;
+	size_t lx;
+	size_t ly;
+	int kx;
+	int ky;
+
+	x = b->a.nodes[ia].sexp;
+	y = b->b.nodes[ib].sexp;
+	if (x->type == SCONF_T_LIST && y->type == SCONF_T_LIST)
+	{
+		kx = assoc_key(x, &px, &lx);
+		ky = assoc_key(y, &py, &ly);
+		if (kx == ky && (kx != SCONF_TRUE
+						 || (lx == ly && memcmp(px, py, lx) == 0)))
+		{
+			return (diff_act(f, DIFF_DESCEND, pos, ia, ib));
+		}
+	}
+
+	return (diff_act(f, SCONF_EDIT_REPLACE, pos, ia, ib));
+}
+
+static int
+diff_keep(struct diff_build *b, struct diff_frame *f, size_t pos, size_t ia,
+		  size_t ib)
+{
+	int ret;
+
+	if (!diff_same(b, ia, ib)) return (diff_pair(b, f, pos, ia, ib));
+
+	ret = diff_equal(b, ia, ib);
+	if (ret == PARSE_ABORTED) return (SCONF_FALSE);
+	if (ret == SCONF_TRUE) return (SCONF_TRUE);
+
+	return (diff_pair(b, f, pos, ia, ib));
+}
+
+/* replace old elements da by new ones db, starting at pos */
+static int
+diff_block(struct diff_build *b, struct diff_frame *f, size_t pos,
+		   const size_t *da, size_t nd, const size_t *db, size_t ni)
+{
+	size_t c;
+	size_t i;
+
+	c = (nd < ni) ? nd : ni;
+	for (i = nd; i-- > c;)
+	{
+		if (diff_act(f, SCONF_EDIT_DELETE, pos + i, da[i], 0) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
+	}
+	for (i = ni; i-- > c;)
+	{
+		if (diff_act(f, SCONF_EDIT_INSERT, pos + nd, 0, db[i]) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
+	}
+	for (i = c; i-- > 0;)
+	{
+		if (diff_pair(b, f, pos + i, da[i], db[i]) != SCONF_TRUE)
 		{
-			sconf_last_error = SCONF_ERR_EOF;
 			return (SCONF_FALSE);
 		}
+	}
+
+	return (SCONF_TRUE);
+}
+
+static int
+diff_children(const struct diff_tree *t, size_t id, size_t **tab,
+			  size_t *cap, size_t *count)
+{
+	size_t end;
+	size_t n;
 
-		tmp = sconf_new();
-		if (parse_value(tmp, p) != SCONF_TRUE)
+	n = 0;
+	end = id + t->nodes[id].size;
+	for (id++; id < end; id += t->nodes[id].size)
+	{
+		if (pool_reserve(heap_mem, (void **)tab, cap, n, 1,
+						 sizeof(size_t)) != SCONF_TRUE)
 		{
-			sconf_destroy(tmp);
 			return (SCONF_FALSE);
 		}
-
-		sconf_list_append(itm, tmp);
+		(*tab)[n++] = id;
 	}
-	while (parse_get(p) != EOF);
 
-	return (SCONF_FALSE);
+	*count = n;
+	return (SCONF_TRUE);
 }
 
+/*
+ * Myers' greedy algorithm over elements off to off + n of the old list
+ * and off to off + m of the new one. Row d of v holds the furthest x
+ * reached on each diagonal k = x - y with d edits, row -1 the start.
+ */
 static int
-parse_number(struct sconf *itm, struct parser *p)
+diff_middle(struct diff_build *b, struct diff_frame *f, size_t off, size_t n,
+			size_t m)
 {
-	int floating;
-	int c;
-	double val;
+	const size_t *ca;
+	const size_t *cb;
+	size_t *prev;
+	size_t *cur;
+	size_t dmax;
+	size_t cx;
+	size_t cy;
+	size_t mx;
+	size_t w;
+	size_t x;
+	size_t y;
+	ptrdiff_t d;
+	ptrdiff_t k;
+	ptrdiff_t pk;
+
+	if (n == 0 && m == 0) return (SCONF_TRUE);
+
+	ca = b->ca + off;
+	cb = b->cb + off;
+	dmax = (n + m < DIFF_MAX_COST) ? n + m : DIFF_MAX_COST;
+	w = 2 * dmax + 3;
+
+#define DIFF_ROW(d) (b->v + ((size_t)(d) + 1) * w + dmax + 1)
+
+	if (pool_reserve(heap_mem, (void **)&b->v, &b->v_cap, 0, w,
+					 sizeof(size_t)) != SCONF_TRUE)
+	{
+		return (SCONF_FALSE);
+	}
+	memset(b->v, 0, w * sizeof(size_t));
 
-	cstr_reset(&p->buff);
-	floating = 0;
-	do
+	for (d = 0; (size_t)d <= dmax; d++)
 	{
-		c = parse_next(p);
-		cstr_append(&p->buff, c);
-		if (c == '.')
+		if (pool_reserve(heap_mem, (void **)&b->v, &b->v_cap,
+						 ((size_t)d + 1) * w, w, sizeof(size_t)) != SCONF_TRUE)
 		{
-			floating = 1;
+			return (SCONF_FALSE);
 		}
-		c = parse_get(p);
-	}
-	while (isalnum(c) || c == '-' || c == '.');
-	cstr_append(&p->buff, '\0');
+		prev = DIFF_ROW(d - 1);
+		cur = DIFF_ROW(d);
+		memcpy(cur - dmax - 1, prev - dmax - 1, w * sizeof(size_t));
 
-	val = strtod(p->buff.s, NULL);
-	if (floating)
-	{
-		itm->type = SCONF_T_DOUBLE;
-		itm->value.as_double = val;
+		for (k = -d; k <= d; k += 2)
+		{
+			if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+			{
+				x = prev[k + 1];
+			}
+			else
+			{
+				x = prev[k - 1] + 1;
+			}
+			y = (size_t)((ptrdiff_t)x - k);
+
+			while (x < n && y < m && diff_same(b, ca[x], cb[y]))
+			{
+				x++;
+				y++;
+			}
+			cur[k] = x;
+
+			if (x >= n && y >= m) goto found;
+		}
 	}
-	else
+
+	/* too many changes for a shortest script to be worth it */
+	return (diff_block(b, f, off, ca, n, cb, m));
+
+found:
+	/* walk back from the end, flushing the edits between common runs */
+	x = n;
+	y = m;
+	cx = n;
+	cy = m;
+	for (; d >= 0; d--)
 	{
-		itm->type = SCONF_T_INT;
-		itm->value.as_int = (int)val;
+		if (d > 0)
+		{
+			prev = DIFF_ROW(d - 1);
+			k = (ptrdiff_t)x - (ptrdiff_t)y;
+			if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+			{
+				pk = k + 1;
+				mx = prev[pk];
+			}
+			else
+			{
+				pk = k - 1;
+				mx = prev[pk] + 1;
+			}
+		}
+		else
+		{
+			pk = 0;
+			mx = 0;
+		}
+
+		if (x > mx)
+		{
+			if (diff_block(b, f, off + x, ca + x, cx - x, cb + y,
+						   cy - y) != SCONF_TRUE)
+			{
+				return (SCONF_FALSE);
+			}
+			while (x > mx)
+			{
+				x--;
+				y--;
+				if (diff_keep(b, f, off + x, ca[x], cb[y]) != SCONF_TRUE)
+				{
+					return (SCONF_FALSE);
+				}
+			}
+			cx = x;
+			cy = y;
+		}
+
+		if (d > 0)
+		{
+			x = prev[pk];
+			y = (size_t)((ptrdiff_t)x - pk);
+		}
 	}
 
-	return (SCONF_TRUE);
+#undef DIFF_ROW
+
+	return (diff_block(b, f, off, ca, cx, cb, cy));
 }
 
 static int
-parse_symbol(struct sconf *itm, struct parser *p)
+diff_list(struct diff_build *b, struct diff_frame *f, size_t ia, size_t ib)
 {
-	int c;
-	int i;
-
-	cstr_reset(&p->buff);
-
-	i = 0;
-	do
+	size_t pre;
+	size_t suf;
+	size_t n;
+	size_t m;
+	size_t i;
+
+	if (diff_children(&b->a, ia, &b->ca, &b->ca_cap, &n) != SCONF_TRUE
+		|| diff_children(&b->b, ib, &b->cb, &b->cb_cap, &m) != SCONF_TRUE)
 	{
-		c = parse_next(p);
-		cstr_append(&p->buff, c);
-		c = parse_get(p);
+		return (SCONF_FALSE);
 	}
-	while (!isspace(c) && c != EOF && c != ')' && c != '(' && i < 127);
 
-	cstr_append(&p->buff, '\0');
-
-	if (strcmp(p->buff.s, "yes") == 0 || strcmp(p->buff.s, "true") == 0)
+	pre = 0;
+	while (pre < n && pre < m && diff_same(b, b->ca[pre], b->cb[pre])) pre++;
+	suf = 0;
+	while (suf < n - pre && suf < m - pre
+		   && diff_same(b, b->ca[n - 1 - suf], b->cb[m - 1 - suf]))
 	{
-		itm->type = SCONF_T_BOOL;
-		itm->value.as_int = SCONF_TRUE;
+		suf++;
 	}
-	else if (strcmp(p->buff.s, "no") == 0 || strcmp(p->buff.s, "false") == 0)
+
+	for (i = 0; i < suf; i++)
 	{
-		itm->type = SCONF_T_BOOL;
-		itm->value.as_int = SCONF_FALSE;
+		if (diff_keep(b, f, n - 1 - i, b->ca[n - 1 - i],
+					  b->cb[m - 1 - i]) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
 	}
-	else if (strcmp(p->buff.s, "nil") == 0)
+
+	if (diff_middle(b, f, pre, n - pre - suf, m - pre - suf) != SCONF_TRUE)
 	{
-		itm->type = SCONF_T_NIL;
+		return (SCONF_FALSE);
 	}
-	else
+
+	for (i = pre; i-- > 0;)
 	{
-		itm->type = SCONF_T_SYMBOL;
-		itm->value.as_string = strdup(p->buff.s);
+		if (diff_keep(b, f, i, b->ca[i], b->cb[i]) != SCONF_TRUE)
+		{
+			return (SCONF_FALSE);
+		}
 	}
 
 	return (SCONF_TRUE);
 }
 
+/* the path of an edit is the position of each open list, then its own */
 static int
-parse_char(struct sconf *itm, struct parser *p)
+diff_emit(struct diff_build *b, size_t depth, const struct diff_act *act)
 {
-	int c;
-
-	cstr_reset(&p->buff);
-
-	do
+	struct sconf_edit *e;
+	size_t len;
+	size_t i;
+
+	len = (depth > 1) ? depth - 1 : 0;
+	if (pool_reserve(heap_mem, (void **)&b->edits, &b->edits_cap, b->nedits,
+					 1, sizeof(struct sconf_edit)) != SCONF_TRUE
+		|| pool_reserve(heap_mem, (void **)&b->offs, &b->offs_cap, b->nedits,
+						1, sizeof(size_t)) != SCONF_TRUE
+		|| pool_reserve(heap_mem, (void **)&b->paths, &b->paths_cap,
+						b->npaths, len, sizeof(size_t)) != SCONF_TRUE)
 	{
-		c = parse_next(p);
-		cstr_append(&p->buff, c);
-		c = parse_get(p);
+		return (SCONF_FALSE);
 	}
-	while (isalpha(c));
 
-	cstr_append(&p->buff, '\0');
+	for (i = 2; i < depth; i++) b->paths[b->npaths++] = b->frames[i].pos;
+	if (depth > 1) b->paths[b->npaths++] = act->pos;
 
-	itm->type = SCONF_T_CHAR;
+	e = b->edits + b->nedits;
+	b->offs[b->nedits++] = b->npaths - len;
+	e->op = (enum sconf_edit_op)act->op;
+	e->path = NULL;
+	e->depth = len;
+	e->old = NULL;
+	e->value = NULL;
+	if (act->op != SCONF_EDIT_INSERT) e->old = b->a.nodes[act->a].sexp;
+	if (act->op != SCONF_EDIT_DELETE) e->value = b->b.nodes[act->b].sexp;
 
-	if (strcmp(p->buff.s, "newline") == 0)
-	{
-		itm->value.as_int = 0xA;
-	}
-	else if (strcmp(p->buff.s, "alarm") == 0)
-	{
-		itm->value.as_int = 0x7;
-	}
-	else if (strcmp(p->buff.s, "backspace") == 0)
-	{
-		itm->value.as_int = 0x8;
-	}
-	else if (strcmp(p->buff.s, "delete") == 0)
-	{
-		itm->value.as_int = 0x7F;
-	}
-	else if (strcmp(p->buff.s, "escape") == 0)
-	{
-		itm->value.as_int = 0x1B;
-	}
-	else if (strcmp(p->buff.s, "space") == 0)
-	{
-		itm->value.as_int = ' ';
-	}
-	else if (strcmp(p->buff.s, "null") == 0)
-	{
-		itm->value.as_int = 0x0;
-	}
-	else if (strcmp(p->buff.s, "return") == 0)
-	{
-		itm->value.as_int = 0xD;
-	}
-	else if (strcmp(p->buff.s, "tab") == 0)
-	{
-		itm->value.as_int = 0x9;
-	}
-	else
-	{
-		itm->value.as_int = p->buff.s[0];
-	}
 	return (SCONF_TRUE);
 }
 
 static int
-parse_string(struct sconf *itm, struct parser *p)
+diff_run(struct diff_build *b)
 {
-	int c;
+	struct diff_frame *f;
+	struct diff_act act;
+	size_t depth;
 
-	cstr_reset(&p->buff);
-	do
+	/* frame 0 holds the edit of the root, frame 1 those of its list */
+	if (pool_reserve(heap_mem, (void **)&b->frames, &b->frames_cap, 0, 1,
+					 sizeof(struct diff_frame)) != SCONF_TRUE)
 	{
-		c = parse_next(p);
-		if (c == '"')
+		return (SCONF_FALSE);
+	}
+	memset(b->frames, 0, b->frames_cap * sizeof(struct diff_frame));
+	if (diff_keep(b, b->frames, 0, 0, 0) != SCONF_TRUE) return (SCONF_FALSE);
+
+	depth = 1;
+	while (depth > 0)
+	{
+		f = b->frames + depth - 1;
+		if (f->next == f->count)
 		{
-			cstr_append(&p->buff, '\0');
+			depth--;
+			continue;
+		}
 
-			itm->type = SCONF_T_STRING;
-			itm->value.as_string = strdup(p->buff.s);
-			return (SCONF_TRUE);
+		act = f->acts[f->next++];
+		if (act.op != DIFF_DESCEND)
+		{
+			if (diff_emit(b, depth, &act) != SCONF_TRUE) return (SCONF_FALSE);
+			continue;
 		}
-		else if (c == '\\')
+
+		if (depth == b->frames_cap)
 		{
-			c = parse_next(p);
-			switch (c)
+			if (pool_reserve(heap_mem, (void **)&b->frames, &b->frames_cap,
+							 depth, 1, sizeof(struct diff_frame)) != SCONF_TRUE)
 			{
-			case 'n':
-				cstr_append(&p->buff, '\n');
-				break;
-			case 'r':
-				cstr_append(&p->buff, '\r');
-				break;
-			case '"':
-				cstr_append(&p->buff, '"');
-				break;
-			default:
-				cstr_append(&p->buff, '\\');
-				cstr_append(&p->buff, c);
-				break;
+				return (SCONF_FALSE);
 			}
+			memset(b->frames + depth, 0,
+				   (b->frames_cap - depth) * sizeof(struct diff_frame));
 		}
-		else
-		{
-			cstr_append(&p->buff, c);
-		}
-
-		c = parse_get(p);
+		f = b->frames + depth++;
+		f->count = 0;
+		f->next = 0;
+		f->pos = act.pos;
+		if (diff_list(b, f, act.a, act.b) != SCONF_TRUE) return (SCONF_FALSE);
 	}
-	while (c != EOF);
 
-	/* unexpected eof */
-	sconf_last_error = SCONF_ERR_EOF;
-	return (SCONF_FALSE);
+	return (SCONF_TRUE);
 }
 
-static int
-parse_value(struct sconf *itm, struct parser *p)
+static void
+diff_build_fini(struct diff_build *b)
 {
-	int c;
+	size_t i;
+
+	for (i = 0; i < b->frames_cap; i++) mem_free(heap_mem, b->frames[i].acts);
+	mem_free(heap_mem, b->frames);
+	mem_free(heap_mem, b->a.nodes);
+	mem_free(heap_mem, b->b.nodes);
+	mem_free(heap_mem, b->open);
+	mem_free(heap_mem, b->ca);
+	mem_free(heap_mem, b->cb);
+	mem_free(heap_mem, b->v);
+	mem_free(heap_mem, b->edits);
+	mem_free(heap_mem, b->offs);
+	mem_free(heap_mem, b->paths);
+	cstr_destroy(&b->sa);
+	cstr_destroy(&b->sb);
+}
 
-	parse_skip(p);
+struct sconf_diff *
+sconf_diff(const struct sconf *a, const struct sconf *b)
+{
+	struct diff_build bd;
+	struct sconf_diff *d;
+	size_t *paths;
+	size_t i;
 
-	c = parse_get(p);
-	switch (c)
+	if (a == NULL || b == NULL) return (NULL);
+
+	memset(&bd, 0, sizeof(bd));
+	cstr_init(&bd.sa, heap_mem);
+	cstr_init(&bd.sb, heap_mem);
+
+	d = NULL;
+	if (diff_flatten(&bd, &bd.a, a) != SCONF_TRUE
+		|| diff_flatten(&bd, &bd.b, b) != SCONF_TRUE
+		|| diff_run(&bd) != SCONF_TRUE)
 	{
-	case EOF:
-		return (SCONF_FALSE);
-		break;
-	case '(':
-		p->off++;
-		return (parse_list(itm, p));
-		break;
-	case '\\':
-		p->off++;
-		return (parse_char(itm, p));
-		break; /* char */
-	case '"':
-		p->off++;
-		return (parse_string(itm, p));
-		break; /* string */
-	default:
-		if (isdigit(c) || c == '-')
-		{
-			return (parse_number(itm, p));
-		}
-		else
-		{
-			return (parse_symbol(itm, p));
-		}
-		break;
+		goto end;
 	}
 
-	return (SCONF_FALSE);
+	/* one block for the script and its paths */
+	d = (struct sconf_diff *)mem_alloc(heap_mem, sizeof(struct sconf_diff)
+									   + bd.nedits * sizeof(struct sconf_edit)
+									   + bd.npaths * sizeof(size_t));
+	if (d == NULL) goto end;
+
+	d->count = bd.nedits;
+	paths = (size_t *)(d->edits + bd.nedits);
+	if (bd.npaths > 0) memcpy(paths, bd.paths, bd.npaths * sizeof(size_t));
+	for (i = 0; i < bd.nedits; i++)
+	{
+		d->edits[i] = bd.edits[i];
+		d->edits[i].path = paths + bd.offs[i];
+	}
+
+end:
+	if (d == NULL) sconf_last_error = SCONF_ERR_MALLOC;
+	diff_build_fini(&bd);
+	return (d);
 }
 
-struct sconf *
-sconf_parse_with_len(const char *str, size_t len)
+size_t
+sconf_diff_count(const struct sconf_diff *d)
 {
-	struct parser p;
-	struct sconf *sexp;
+	if (d == NULL) return (0);
 
-	if (str == NULL || len == 0)
+	return (d->count);
+}
+
+const struct sconf_edit *
+sconf_diff_edit(const struct sconf_diff *d, size_t i)
+{
+	if (d == NULL || i >= d->count)
 	{
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
 		return (NULL);
 	}
 
-	p.data = str;
-	p.len = len;
-	p.off = 0;
-	cstr_init(&p.buff);
+	return (d->edits + i);
+}
 
-	sexp = sconf_new();
-	if (sexp == NULL) return (NULL);
+void
+sconf_diff_destroy(struct sconf_diff *d)
+{
+	mem_free(heap_mem, d);
+}
 
-	if (parse_value(sexp, &p) == SCONF_FALSE)
-	{
-		cstr_destroy(&p.buff);
-		sconf_destroy(sexp);
-		return (NULL);
-	}
+static struct sconf *
+tree_copy(const struct sconf *sexp)
+{
+	struct tree_sink t;
 
-	cstr_destroy(&p.buff);
-	return (sexp);
+	tree_sink_init(&t);
+	return (tree_sink_fini(&t, tree_emit(sexp, &build_handler, &t.b)
+						   == SCONF_TRUE));
 }
 
-struct sconf *
-sconf_parse(const char *str)
+/* insert itm in lst before pos, or at the end if pos is NULL */
+static void
+list_insert(struct sconf *lst, struct sconf *pos, struct sconf *itm)
 {
-	if (str == NULL || *str == '\0')
+	if (pos == NULL)
 	{
-		return (NULL);
+		sconf_list_append(lst, itm);
+		return;
 	}
 
-	return (sconf_parse_with_len(str, strlen(str)));
+	list_index_drop(lst);
+	itm->next = pos;
+	itm->prev = pos->prev;
+	if (pos == lst->value.as_child)
+	{
+		lst->value.as_child = itm;
+	}
+	else
+	{
+		pos->prev->next = itm;
+	}
+	pos->prev = itm;
 }
 
-struct sconf *
-sconf_load(FILE *fp)
+static int
+patch_apply(struct sconf *root, const struct sconf_edit *e)
 {
-	long fsz;
-	char *content;
+	struct sconf *parent;
+	struct sconf *cur;
+	struct sconf *tmp;
+	struct sconf swap;
+	size_t i;
+	size_t j;
 
-	if (fseek(fp, 0, SEEK_END) != 0)
+	parent = NULL;
+	cur = root;
+	for (i = 0; i < e->depth; i++)
 	{
-		return (NULL);
+		if (cur->type != SCONF_T_LIST)
+		{
+			sconf_last_error = SCONF_ERR_NOTALIST;
+			return (SCONF_FALSE);
+		}
+
+		parent = cur;
+		j = 0;
+		for (cur = cur->value.as_child; cur != NULL && j < e->path[i];
+			 cur = cur->next)
+		{
+			j++;
+		}
+
+		/* inserts may point one past the end */
+		if (cur == NULL
+			&& !(e->op == SCONF_EDIT_INSERT && i + 1 == e->depth
+				 && j == e->path[i]))
+		{
+			sconf_last_error = SCONF_ERR_OUTOFBOUND;
+			return (SCONF_FALSE);
+		}
 	}
 
-	fsz = ftell(fp);
-	if (fsz <= 0)
+	if (parent == NULL && e->op != SCONF_EDIT_REPLACE)
 	{
-		return (NULL);
+		sconf_last_error = SCONF_ERR_OUTOFBOUND;
+		return (SCONF_FALSE);
 	}
 
-	rewind(fp);
+	if (e->op == SCONF_EDIT_DELETE)
+	{
+		sconf_list_remove(parent, cur);
+		sconf_destroy(cur);
+		return (SCONF_TRUE);
+	}
+
+	tmp = tree_copy(e->value);
+	if (tmp == NULL) return (SCONF_FALSE);
 
-	content = (char *)malloc(fsz + sizeof(char));
-	if (content == NULL)
+	if (e->op == SCONF_EDIT_INSERT)
 	{
-		return (NULL);
+		list_insert(parent, cur, tmp);
+		return (SCONF_TRUE);
 	}
 
-	if (fread(content, fsz, 1, fp) != 1)
+	if (parent != NULL)
 	{
-		free(content);
-		return (NULL);
+		list_insert(parent, cur, tmp);
+		sconf_list_remove(parent, cur);
+		sconf_destroy(cur);
+		return (SCONF_TRUE);
 	}
 
-	content[fsz] = '\0';
+	/* the caller holds the root, so it is replaced in place; room for an
+	 * index stays with each node, their indexes do not */
+	list_index_drop(cur);
+	list_index_drop(tmp);
+	swap = *cur;
+	cur->type = tmp->type;
+	cur->flags = (tmp->flags & ~SCONF_F_INDEXABLE)
+		| (swap.flags & SCONF_F_INDEXABLE);
+	cur->view_len = tmp->view_len;
+	cur->value = tmp->value;
+	tmp->type = swap.type;
+	tmp->flags = (swap.flags & ~SCONF_F_INDEXABLE)
+		| (tmp->flags & SCONF_F_INDEXABLE);
+	tmp->view_len = swap.view_len;
+	tmp->value = swap.value;
+	sconf_destroy(tmp);
 
-	return (sconf_parse_with_len(content, fsz + 1));
+	return (SCONF_TRUE);
+}
+
+int
+sconf_patch(struct sconf *sexp, const struct sconf_diff *d)
+{
+	size_t i;
+
+	if (sexp == NULL || d == NULL) return (SCONF_FALSE);
+
+	/* objects of a document belong to its arena and are never freed */
+	if (sexp->flags & SCONF_F_ARENA)
+	{
+		sconf_last_error = SCONF_ERR_NOTALIST;
+		return (SCONF_FALSE);
+	}
+
+	for (i = 0; i < d->count; i++)
+	{
+		if (patch_apply(sexp, d->edits + i) != SCONF_TRUE) return (SCONF_FALSE);
+	}
+
+	return (SCONF_TRUE);
 }
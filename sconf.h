@@ -39,6 +39,13 @@ enum sconf_error {
 	SCONF_ERR_OUTOFBOUND,  /**< Index out of range */
 	SCONF_ERR_NOTALIST,    /**< Value is not a list */
 	SCONF_ERR_EOF,         /**< Unexpected EOF during parsing */
+	SCONF_ERR_IO,          /**< Failed to open or read the input */
+	SCONF_ERR_ABORTED,     /**< A handler stopped the parsing */
+	SCONF_ERR_DEPTH,       /**< Lists nested deeper than allowed */
+	SCONF_ERR_NUMBER,      /**< Malformed or out of range number */
+	SCONF_ERR_FORMAT,      /**< Malformed or unsupported binary input */
+	SCONF_ERR_QUERY,       /**< Malformed query path */
+	SCONF_ERR_SYMBOL,      /**< Symbol that would not read back as one */
 };
 
 /**
@@ -65,24 +72,115 @@ enum sconf_type {
 	SCONF_T_BOOL    /**< Boolean */
 };
 
+/**
+ * \brief Object is a view on the parsed input, see sconf_doc_string().
+ */
+# define SCONF_F_VIEW     0x1
+
+/**
+ * \brief Viewed string still holds its escape sequences.
+ */
+# define SCONF_F_ESCAPED  0x2
+
+/**
+ * \brief Object is owned by a document arena, see sconf_doc_destroy().
+ */
+# define SCONF_F_ARENA    0x4
+
+/**
+ * \brief Symbol is shared through the document symbol table, see
+ *        sconf_symbol_eq() and sconf_doc_symbol().
+ */
+# define SCONF_F_INTERNED 0x8
+
+/**
+ * \brief Object has room for a list index, see sconf_list_index().
+ */
+# define SCONF_F_INDEXABLE 0x10
+
 /**
  * \struct sconf
  * \brief Represents a single S-expression object.
  */
 struct sconf {
-	enum sconf_type type; /**< object type */
+	uint16_t type;        /**< object type (enum sconf_type) */
+	uint16_t flags;       /**< storage flags (SCONF_F_*) */
+	uint32_t view_len;    /**< length in bytes of SCONF_F_VIEW objects */
 
 	struct sconf *next;   /**< next element in list */
 	struct sconf *prev;   /**< previous element in list */
 
 	union {
 		char *as_string;        /**< For strings and symbols */
-		int as_int;             /**< For integers and booleans */
+		int64_t as_int;         /**< For integers and booleans */
 		double as_double;       /**< For floating-point numbers */
 		struct sconf *as_child; /**< For list first elements */
+		const char *as_view;    /**< For SCONF_F_VIEW objects, see view_len */
 	} value;
 };
 
+/**
+ * \enum sconf_opt_flags
+ * \brief Parsing options.
+ */
+enum sconf_opt_flags {
+	/**
+	 * Keep strings and symbols as views on the input buffer instead of
+	 * copying them, the input must outlive the document. Strings holding
+	 * escape sequences are decoded on first access.
+	 */
+	SCONF_OPT_ZEROCOPY = 1 << 0,
+};
+
+/**
+ * \struct sconf_allocator
+ * \brief Memory functions used instead of malloc(), realloc() and free().
+ *
+ * alloc and realloc return NULL on failure, which the library reports as
+ * SCONF_ERR_MALLOC, so a limit can be enforced by refusing requests. free
+ * is never called with NULL. The structure must outlive every object
+ * allocated through it.
+ */
+struct sconf_allocator {
+	void *(*alloc)(void *ud, size_t size);              /**< malloc() */
+	void *(*realloc)(void *ud, void *ptr, size_t size); /**< realloc() */
+	void (*free)(void *ud, void *ptr);                  /**< free() */
+	void *ud;                                           /**< user data */
+};
+
+/**
+ * \struct sconf_opts
+ * \brief Parsing options, a zeroed structure gives the defaults.
+ */
+struct sconf_opts {
+	unsigned int flags; /**< SCONF_OPT_* */
+	size_t max_depth;   /**< maximum list nesting, 0 for no limit */
+	/**
+	 * Allocator of the document, pool or tape being parsed and of the
+	 * parser itself, NULL for the default one. Trees outside documents
+	 * always use the default allocator.
+	 */
+	const struct sconf_allocator *allocator;
+};
+
+/**
+ * \brief Set the default allocator.
+ *
+ * The default allocator serves every allocation not tied to a
+ * sconf_opts::allocator, including objects made by the sconf_new_*()
+ * functions and indexes of lists. It must be set before any object
+ * is created and is not meant to change while objects exist.
+ *
+ * \param mem allocator, NULL to go back to malloc(), realloc() and free()
+ */
+void sconf_set_allocator(const struct sconf_allocator *mem);
+
+/**
+ * \brief Release memory returned by the library, e.g. by sconf_write_str().
+ * \param ptr memory from the default allocator, may be NULL
+ */
+void sconf_free(void *ptr);
+
 /**
  * \brief Get library version as a constant string (eg: 1.0.0).
  * \return Null-terminated version string
@@ -91,11 +189,35 @@ const char *sconf_version(void);
 
 /**
  * \brief Parse S-expression from an open FILE stream.
+ *
+ * Seekable streams are read from the start, other streams (pipes,
+ * sockets) are read until EOF.
+ *
  * \param fp input file pointer
  * \return Parsed object or NULL on error.
  */
 struct sconf *sconf_load(FILE *fp);
 
+/**
+ * \brief Parse S-expression from a file descriptor.
+ *
+ * Regular files are memory-mapped and parsed in place, other descriptors
+ * are read until EOF. The mapping is gone when the call returns, but a
+ * file truncated while it is being parsed raises SIGBUS.
+ *
+ * \param fd input file descriptor
+ * \return Parsed object or NULL on error.
+ */
+struct sconf *sconf_load_fd(int fd);
+
+/**
+ * \brief Parse S-expression from a file.
+ * \param path file path
+ * \return Parsed object or NULL on error.
+ * \see sconf_load_fd()
+ */
+struct sconf *sconf_load_path(const char *path);
+
 /**
  * \brief Parse S-expression from a null-terminated string.
  * \param str input null-terminated string
@@ -111,8 +233,532 @@ struct sconf *sconf_parse(const char *str);
  */
 struct sconf *sconf_parse_with_len(const char *str, size_t len);
 
+/**
+ * \brief Parse S-expression from buffer with length and options.
+ *
+ * SCONF_OPT_ZEROCOPY is only honoured by documents and ignored here.
+ *
+ * \param str input buffer
+ * \param len buffer length
+ * \param opts parsing options, may be NULL
+ * \return Parsed object or NULL on error.
+ */
+struct sconf *sconf_parse_opts(const char *str, size_t len,
+							   const struct sconf_opts *opts);
+
+/**
+ * \struct sconf_handler
+ * \brief Callbacks driven by sconf_sax_parse().
+ *
+ * Every callback may be NULL and returns SCONF_TRUE to go on or
+ * SCONF_FALSE to stop parsing. Strings and symbols are not null-terminated
+ * and only valid during the call.
+ */
+struct sconf_handler {
+	int (*begin_list)(void *ud);                           /**< '(' */
+	int (*end_list)(void *ud);                             /**< ')' */
+	int (*symbol)(void *ud, const char *sym, size_t len);  /**< symbol */
+	int (*string)(void *ud, const char *str, size_t len);  /**< decoded string */
+	int (*integer)(void *ud, int64_t i);                   /**< integer */
+	int (*real)(void *ud, double d);                       /**< floating-point */
+	int (*boolean)(void *ud, enum sconf_bool b);           /**< boolean */
+	int (*character)(void *ud, char c);                    /**< character */
+	int (*nil)(void *ud);                                  /**< nil */
+};
+
+/**
+ * \brief Parse S-expression from buffer with length without building a
+ *        tree.
+ *
+ * Events are emitted straight from the lexer, the only memory used is for
+ * decoding escaped strings.
+ *
+ * \param str input buffer
+ * \param len buffer length
+ * \param h callbacks
+ * \param ud user data passed to callbacks
+ * \return SCONF_TRUE on success, SCONF_FALSE on error (SCONF_ERR_ABORTED
+ *         if a callback stopped the parsing).
+ */
+int sconf_sax_parse(const char *str, size_t len, const struct sconf_handler *h,
+					void *ud);
+
+/**
+ * \struct sconf_doc
+ * \brief Parsed document owning all of its objects.
+ *
+ * Every object and string of a document is carved out of a single arena,
+ * releasing the document frees the whole tree at once. Objects of a
+ * document must never be passed to sconf_destroy(), and objects created
+ * with sconf_new_*() then appended to it are not released with it.
+ */
+struct sconf_doc;
+
+/**
+ * \brief Parse S-expression from buffer with length into a document.
+ * \param str input buffer
+ * \param len buffer length
+ * \return Parsed document or NULL on error.
+ */
+struct sconf_doc *sconf_doc_parse(const char *str, size_t len);
+
+/**
+ * \brief Parse S-expression from buffer with length into a document.
+ * \param str input buffer
+ * \param len buffer length
+ * \param opts parsing options, may be NULL
+ * \return Parsed document or NULL on error.
+ */
+struct sconf_doc *sconf_doc_parse_opts(const char *str, size_t len,
+									   const struct sconf_opts *opts);
+
+/**
+ * \brief Parse S-expression from a file descriptor into a document.
+ *
+ * With SCONF_OPT_ZEROCOPY the file is read into a buffer owned by the
+ * document and views point into it, so later writes to the file do not
+ * show through. Otherwise regular files are mapped for the time of the
+ * parse only, and a file truncated while it is being parsed raises
+ * SIGBUS.
+ *
+ * \param fd input file descriptor
+ * \param opts parsing options, may be NULL
+ * \return Parsed document or NULL on error.
+ */
+struct sconf_doc *sconf_doc_load_fd(int fd, const struct sconf_opts *opts);
+
+/**
+ * \brief Parse S-expression from a file into a document.
+ * \param path file path
+ * \param opts parsing options, may be NULL
+ * \return Parsed document or NULL on error.
+ * \see sconf_doc_load_fd()
+ */
+struct sconf_doc *sconf_doc_load_path(const char *path,
+									  const struct sconf_opts *opts);
+
+/**
+ * \brief Parse a sequence of top-level forms on several threads.
+ *
+ * The input is cut into chunks at lines starting with '(' and each
+ * chunk is parsed by a worker into its own arena. A cut that falls inside
+ * a form or a string is detected and parsing goes on over the following
+ * chunks, so the result does not depend on the layout of the input, only
+ * the speed does. The root of the document is a list of the forms, in
+ * input order. Symbols are not interned, sconf_doc_symbol() finds nothing.
+ *
+ * \param str input
+ * \param len input length
+ * \param nthreads number of workers, 0 for one per online CPU
+ * \param opts parsing options, may be NULL
+ * \return Parsed document or NULL on error.
+ */
+struct sconf_doc *sconf_doc_parse_parallel(const char *str, size_t len,
+										   unsigned int nthreads,
+										   const struct sconf_opts *opts);
+
+/**
+ * \brief Parse the top-level forms of a file on several threads.
+ * \param path file path
+ * \param nthreads number of workers, 0 for one per online CPU
+ * \param opts parsing options, may be NULL
+ * \return Parsed document or NULL on error.
+ * \see sconf_doc_parse_parallel()
+ */
+struct sconf_doc *sconf_doc_load_parallel(const char *path,
+										  unsigned int nthreads,
+										  const struct sconf_opts *opts);
+
+/**
+ * \brief Return the root object of a document.
+ * \param doc document
+ * \return Root object, owned by the document.
+ */
+struct sconf *sconf_doc_root(const struct sconf_doc *doc);
+
+/**
+ * \brief Free a document and every object it owns.
+ * \param doc document
+ */
+void sconf_doc_destroy(struct sconf_doc *doc);
+
+/**
+ * \brief Access the bytes of a string or symbol of a document.
+ *
+ * Unlike sconf_get_string_value() this also works on views
+ * (SCONF_F_VIEW), whose bytes are not null-terminated. Escaped views are
+ * decoded into the document on first access.
+ *
+ * \param doc document owning the object
+ * \param sexp string or symbol
+ * \param len if not NULL, receive the length in bytes
+ * \return Bytes of the object or NULL on error.
+ */
+const char *sconf_doc_string(struct sconf_doc *doc, struct sconf *sexp,
+							 size_t *len);
+
+/**
+ * \brief Look up a symbol in the document symbol table.
+ *
+ * Symbols of a document parsed without SCONF_OPT_ZEROCOPY are stored
+ * once (SCONF_F_INTERNED), so the returned pointer can be compared
+ * directly with sconf_get_symbol_value() of its objects.
+ *
+ * \param doc document
+ * \param sym symbol name
+ * \return Shared copy of \p sym or NULL if the document never uses it.
+ */
+const char *sconf_doc_symbol(const struct sconf_doc *doc, const char *sym);
+
+/**
+ * \brief Index a list of a document, see sconf_list_index().
+ *
+ * The index is allocated from the document arena and released with it.
+ * Indexes dropped by editing the list stay in the arena until then.
+ *
+ * \param doc document owning \p lst
+ * \param lst list root
+ * \return SCONF_TRUE on success, SCONF_FALSE on error (SCONF_ERR_NOTALIST
+ *         if \p lst is not a document list).
+ */
+int sconf_doc_index(struct sconf_doc *doc, struct sconf *lst);
+
+/**
+ * \brief Compare two symbols.
+ *
+ * Interned symbols of the same document compare by pointer, others by
+ * content.
+ *
+ * \param a symbol
+ * \param b symbol
+ * \return SCONF_TRUE if both are symbols with the same name.
+ */
+int sconf_symbol_eq(const struct sconf *a, const struct sconf *b);
+
+struct sconf_snapshot;
+struct sconf_current;
+
+/**
+ * \brief Turn a document into a snapshot shared between threads.
+ *
+ * The lazy parts of the document are filled in first: escaped strings
+ * are decoded and long lists indexed, so that reading the snapshot never
+ * writes to it. Any number of threads may then read the tree at the same
+ * time without locking, as long as none of them modifies it.
+ * sconf_doc_string() works on its objects with a NULL document.
+ *
+ * \param doc document, owned by the snapshot on success
+ * \return Snapshot holding one reference, or NULL on error, in which case
+ *         the caller still owns \p doc.
+ */
+struct sconf_snapshot *sconf_snapshot_new(struct sconf_doc *doc);
+
+/**
+ * \brief Take a reference to a snapshot.
+ * \param snap snapshot
+ * \return \p snap
+ */
+struct sconf_snapshot *sconf_snapshot_acquire(struct sconf_snapshot *snap);
+
+/**
+ * \brief Drop a reference to a snapshot, freeing it with the last one.
+ * \param snap snapshot, may be NULL
+ */
+void sconf_snapshot_release(struct sconf_snapshot *snap);
+
+/**
+ * \brief Return the root object of a snapshot.
+ * \param snap snapshot
+ * \return Root object, owned by the snapshot and not to be modified.
+ */
+struct sconf *sconf_snapshot_root(const struct sconf_snapshot *snap);
+
+/**
+ * \brief Create a slot publishing the current snapshot to readers.
+ * \param snap initial snapshot whose reference moves to the slot, may be
+ *        NULL
+ * \return Slot or NULL on error.
+ */
+struct sconf_current *sconf_current_new(struct sconf_snapshot *snap);
+
+/**
+ * \brief Take a reference to the snapshot currently published.
+ *
+ * Safe to call from any thread while another publishes, it never blocks.
+ * The reference keeps the snapshot alive after it is replaced and must be
+ * dropped with sconf_snapshot_release().
+ *
+ * \param cur slot
+ * \return Current snapshot or NULL if none was published.
+ */
+struct sconf_snapshot *sconf_current_get(struct sconf_current *cur);
+
+/**
+ * \brief Publish a new snapshot.
+ *
+ * Readers calling sconf_current_get() from now on get \p snap. The slot's
+ * reference to the previous snapshot is dropped once the readers that may
+ * have seen it hold their own, which takes no more than the few
+ * instructions they spend inside sconf_current_get(); the snapshot is
+ * freed when the last of them releases it. Concurrent publishers are
+ * serialized.
+ *
+ * \param cur slot
+ * \param snap snapshot whose reference moves to the slot, may be NULL
+ */
+void sconf_current_publish(struct sconf_current *cur,
+						   struct sconf_snapshot *snap);
+
+/**
+ * \brief Free a slot and drop its reference to the current snapshot.
+ *
+ * No thread may use the slot anymore, references taken from it stay
+ * valid.
+ *
+ * \param cur slot, may be NULL
+ */
+void sconf_current_destroy(struct sconf_current *cur);
+
+struct sconf_reload;
+
+/**
+ * \brief Check a freshly parsed version before it is published.
+ * \param ud sconf_reload_opts::ud
+ * \param root root of the new version
+ * \return SCONF_TRUE to publish it, SCONF_FALSE to keep the current one.
+ */
+typedef int (*sconf_validate_fn)(void *ud, const struct sconf *root);
+
+/**
+ * \brief Called after each attempt to reload a file.
+ * \param ud sconf_reload_opts::ud
+ * \param snap published version, valid until the callback returns, or
+ *        NULL if the file was not reloaded
+ * \param generation generation of the version now published
+ * \param err SCONF_OK, or why the file was not reloaded (SCONF_ERR_ABORTED
+ *        if the validator rejected it)
+ */
+typedef void (*sconf_reload_fn)(void *ud, struct sconf_snapshot *snap,
+								unsigned long generation,
+								enum sconf_error err);
+
+/**
+ * \struct sconf_reload_opts
+ * \brief Reload options, see sconf_reload_new().
+ */
+struct sconf_reload_opts {
+	const struct sconf_opts *parse; /**< parsing options, may be NULL */
+	sconf_validate_fn validate;      /**< may be NULL */
+	sconf_reload_fn changed;         /**< may be NULL */
+	void *ud;                        /**< passed to the callbacks */
+};
+
+/**
+ * \brief Load a file and keep it up to date.
+ *
+ * The file is loaded and published as generation 1, then a background
+ * thread watches its directory with inotify. Whenever the file is
+ * closed after writing or renamed over, the thread loads it into a new
+ * document, validates it and publishes it, so that readers only ever see
+ * complete versions and never wait. A version that fails to parse or to
+ * validate is dropped and the previous one stays current. On systems
+ * without inotify the file is only reloaded by sconf_reload_now().
+ *
+ * The file is read into memory of each version, never mapped, so
+ * rewriting or truncating it leaves published versions untouched.
+ *
+ * Callbacks run on the thread doing the reload, one at a time.
+ *
+ * \param path file path
+ * \param opts options, may be NULL
+ * \return Reloader or NULL if the initial version could not be loaded or
+ *         the watch could not be set up.
+ */
+struct sconf_reload *sconf_reload_new(const char *path,
+									  const struct sconf_reload_opts *opts);
+
+/**
+ * \brief Take a reference to the current version.
+ * \param rl reloader
+ * \return Snapshot to release with sconf_snapshot_release().
+ * \see sconf_current_get()
+ */
+struct sconf_snapshot *sconf_reload_get(struct sconf_reload *rl);
+
+/**
+ * \brief Return the generation of the current version.
+ *
+ * The generation starts at 1 and grows by one with each version
+ * published.
+ *
+ * \param rl reloader
+ * \return Generation.
+ */
+unsigned long sconf_reload_generation(const struct sconf_reload *rl);
+
+/**
+ * \brief Reload the file now, on the calling thread.
+ * \param rl reloader
+ * \return SCONF_TRUE if a new version was published.
+ */
+int sconf_reload_now(struct sconf_reload *rl);
+
+/**
+ * \brief Stop watching and free a reloader.
+ *
+ * References taken with sconf_reload_get() stay valid.
+ *
+ * \param rl reloader, may be NULL
+ */
+void sconf_reload_destroy(struct sconf_reload *rl);
+
+/**
+ * \struct sconf_reader
+ * \brief Cursor over the top-level forms of a buffer.
+ */
+struct sconf_reader;
+
+/**
+ * \brief Create a cursor over the top-level forms of a buffer.
+ * \param str input buffer, must outlive the reader
+ * \param len buffer length
+ * \return Reader or NULL on error.
+ */
+struct sconf_reader *sconf_reader_new(const char *str, size_t len);
+
+/**
+ * \brief Parse the next top-level form.
+ * \param rd reader
+ * \return Parsed object, or NULL at end of input (sconf_get_last_error()
+ *         then returns SCONF_OK) or on error.
+ */
+struct sconf *sconf_reader_next(struct sconf_reader *rd);
+
+/**
+ * \brief Get the offset just past the last form returned.
+ * \param rd reader
+ * \return Offset in bytes from the start of the buffer.
+ */
+size_t sconf_reader_offset(const struct sconf_reader *rd);
+
+/**
+ * \brief Free a reader.
+ * \param rd reader
+ */
+void sconf_reader_destroy(struct sconf_reader *rd);
+
+/**
+ * \struct sconf_stream
+ * \brief Push parser for unbounded sequences of top-level forms.
+ */
+struct sconf_stream;
+
+/**
+ * \brief Called for every complete top-level form of a stream.
+ * \param sexp parsed form, owned by the callee
+ * \param ud user data given to sconf_stream_new()
+ * \return SCONF_TRUE to go on, SCONF_FALSE to stop feeding.
+ */
+typedef int (*sconf_stream_cb)(struct sconf *sexp, void *ud);
+
+/**
+ * \brief Create a push parser.
+ * \param cb callback receiving each top-level form
+ * \param ud user data passed to cb
+ * \return Parser or NULL on error.
+ */
+struct sconf_stream *sconf_stream_new(sconf_stream_cb cb, void *ud);
+
+/**
+ * \brief Feed the next chunk of input.
+ *
+ * Chunks may be split anywhere, even inside tokens. Each top-level form
+ * is handed to the callback as soon as it is complete, only the form still
+ * open at the end of the chunk is buffered.
+ *
+ * \param st push parser
+ * \param buf chunk
+ * \param len chunk length
+ * \return SCONF_TRUE on success, SCONF_FALSE on parse error or when the
+ *         callback asked to stop.
+ */
+int sconf_stream_feed(struct sconf_stream *st, const char *buf, size_t len);
+
+/**
+ * \brief Signal the end of input.
+ *
+ * Flushes a trailing top-level atom and resets the parser.
+ *
+ * \param st push parser
+ * \return SCONF_TRUE on success, SCONF_FALSE if a form is left open.
+ */
+int sconf_stream_finish(struct sconf_stream *st);
+
+/**
+ * \brief Free a push parser.
+ * \param st push parser
+ */
+void sconf_stream_destroy(struct sconf_stream *st);
+
+/**
+ * \brief Output callback of sconf_write().
+ * \param ud user data given to sconf_write()
+ * \param buf bytes to write
+ * \param len number of bytes
+ * \return SCONF_TRUE to go on, SCONF_FALSE to stop writing.
+ */
+typedef int (*sconf_write_fn)(void *ud, const char *buf, size_t len);
+
+/**
+ * \enum sconf_write_flags
+ * \brief Output options of sconf_write().
+ */
+enum sconf_write_flags {
+	/** Start nested lists on their own indented line */
+	SCONF_WRITE_PRETTY = 1 << 0,
+};
+
+/**
+ * \brief Serialize an S-expression.
+ *
+ * Output is buffered and handed to fn in large chunks. Strings are
+ * escaped and floating-point numbers written with the fewest digits that
+ * read back to the same value, so parsing the output gives back an equal
+ * tree.
+ *
+ * Symbols are written as they are, and there is no syntax to escape them.
+ * A symbol that would not read back as the same symbol (empty, spelled
+ * like a number or keyword such as "12" or "true", holding a blank or a
+ * parenthesis, or starting with '"', '\\' or ';') fails the writing; what
+ * was written before it may already have been handed to fn.
+ *
+ * \param sexp S-expression
+ * \param flags SCONF_WRITE_* flags
+ * \param fn output callback
+ * \param ud user data passed to fn
+ * \return SCONF_TRUE on success, SCONF_FALSE on error (SCONF_ERR_ABORTED
+ *         if fn stopped the writing, SCONF_ERR_SYMBOL for a symbol that
+ *         cannot be written).
+ */
+int sconf_write(const struct sconf *sexp, unsigned int flags,
+				sconf_write_fn fn, void *ud);
+
+/**
+ * \brief Serialize an S-expression to a string.
+ * \param sexp S-expression
+ * \param flags SCONF_WRITE_* flags
+ * \param len if not NULL, receive the length in bytes
+ * \return Null-terminated string to sconf_free(), or NULL on error.
+ * \see sconf_write()
+ */
+char *sconf_write_str(const struct sconf *sexp, unsigned int flags,
+					  size_t *len);
+
 /**
  * \brief Pretty-print an S-expression to a stream.
+ *
+ * Same as sconf_write() with SCONF_WRITE_PRETTY.
+ *
  * \param fp output stream
  * \param sexp S-expression.
  */
@@ -122,7 +768,7 @@ struct sconf *sconf_new_list(void);
 struct sconf *sconf_new_symbol(const char *sym);
 struct sconf *sconf_new_string(const char *str);
 struct sconf *sconf_new_char(char c);
-struct sconf *sconf_new_int(int i);
+struct sconf *sconf_new_int(int64_t i);
 struct sconf *sconf_new_double(double d);
 struct sconf *sconf_new_bool(enum sconf_bool b);
 struct sconf *sconf_new_true(void);
@@ -153,8 +799,35 @@ int sconf_list_appends(struct sconf *lst, ...);
  */
 int sconf_list_remove(struct sconf *lst, struct sconf *itm);
 
+/**
+ * \brief Index a list for O(1) access.
+ *
+ * Lists of 16 or more elements get an array of their elements and a hash
+ * table of their keys, which sconf_list_size(), sconf_list_at() and
+ * sconf_assoc_get() use from then on. Shorter lists, and lists that were
+ * not allocated by the library (see SCONF_F_INDEXABLE), are left alone.
+ *
+ * Every parsed or loaded list is indexed as soon as it is complete, so
+ * this is only needed for lists built or modified through the API: the
+ * index is dropped by sconf_list_append() and sconf_list_remove(). A list
+ * edited by hand, or whose keys are renamed in place, must not be
+ * indexed.
+ *
+ * Readers never build the index, so an indexed list may be read by any
+ * number of threads at once. Lists of a document are indexed with
+ * sconf_doc_index() instead.
+ *
+ * \param lst list root, not owned by a document
+ * \return SCONF_TRUE on success, SCONF_FALSE on error (SCONF_ERR_NOTALIST
+ *         for document lists).
+ */
+int sconf_list_index(struct sconf *lst);
+
 /**
  * \brief Count list elements.
+ *
+ * O(1) on an indexed list, see sconf_list_index().
+ *
  * \param lst list root
  * \return number of elements.
  */
@@ -162,6 +835,9 @@ int sconf_list_size(const struct sconf *lst);
 
 /**
  * \brief Retrive element at index.
+ *
+ * O(1) on an indexed list, see sconf_list_index().
+ *
  * \param lst list root
  * \param idx index
  * \return Object or NULL if out of range.
@@ -182,6 +858,175 @@ struct sconf *sconf_list_first(const struct sconf *lst);
  */
 struct sconf *sconf_list_last(const struct sconf *lst);
 
+/**
+ * \brief Find an entry of an association list.
+ *
+ * Return the first element of \p lst that is a list headed by the symbol
+ * \p key, e.g. `(port 8080)` for "port". Indexed lists, which include
+ * every parsed list of 16 or more elements, are searched through their
+ * hash table in O(1), see sconf_list_index().
+ *
+ * \param lst list root
+ * \param key symbol to look for
+ * \return Entry or NULL if not found.
+ */
+struct sconf *sconf_assoc_get(const struct sconf *lst, const char *key);
+
+/**
+ * \brief Maximum number of steps in a query path.
+ */
+# define SCONF_QUERY_MAX_STEPS 16
+
+struct sconf_query;
+
+/**
+ * \struct sconf_query_iter
+ * \brief Position of a running query, see sconf_query_exec().
+ */
+struct sconf_query_iter {
+	const struct sconf_query *query;           /**< NULL once done */
+	struct sconf *pos[SCONF_QUERY_MAX_STEPS]; /**< next candidate per step */
+	size_t depth;                              /**< step to resume at */
+};
+
+/**
+ * \brief Compile a query path.
+ *
+ * A path is a list of steps separated by '/', each stepping into the
+ * entries of the current list as sconf_assoc_get() sees them: a symbol
+ * matches every entry headed by it, '*' matches every list. The first
+ * step looks at the elements of the list the query runs on, the next
+ * ones at the elements of the entries matched so far, past the symbol
+ * heading them if any. A leading '/' is ignored.
+ * For example "server/listen/port" finds `(port 80)` in
+ * `((server (listen (port 80))))`, and a '*' in the middle step would
+ * find the port of every entry of server.
+ *
+ * \param path query path
+ * \return Query to release with sconf_query_destroy(), or NULL on error
+ *         (SCONF_ERR_QUERY if the path is empty, has an empty step or
+ *         more than SCONF_QUERY_MAX_STEPS steps).
+ */
+struct sconf_query *sconf_query_compile(const char *path);
+
+/**
+ * \brief Start running a query on a list.
+ *
+ * The iterator holds no memory, it may live on the stack and be dropped
+ * at any time. The tree must not change while it is used.
+ *
+ * \param q compiled query
+ * \param lst list to search
+ * \param it iterator to set up
+ */
+void sconf_query_exec(const struct sconf_query *q, const struct sconf *lst,
+					  struct sconf_query_iter *it);
+
+/**
+ * \brief Return the next entry matched by a query.
+ * \param it iterator set up by sconf_query_exec()
+ * \return Entry, in document order, or NULL when there are no more.
+ */
+struct sconf *sconf_query_next(struct sconf_query_iter *it);
+
+/**
+ * \brief Return the first entry matched by a query.
+ * \param q compiled query
+ * \param lst list to search
+ * \return Entry or NULL if nothing matches.
+ */
+struct sconf *sconf_query_get(const struct sconf_query *q,
+							  const struct sconf *lst);
+
+/**
+ * \brief Free a compiled query.
+ * \param q query, may be NULL
+ */
+void sconf_query_destroy(struct sconf_query *q);
+
+/**
+ * \enum sconf_edit_op
+ * \brief Kinds of edits in a diff.
+ */
+enum sconf_edit_op {
+	SCONF_EDIT_INSERT,  /**< insert value before path, or at the end */
+	SCONF_EDIT_DELETE,  /**< remove the object at path */
+	SCONF_EDIT_REPLACE  /**< replace the object at path by value */
+};
+
+/**
+ * \struct sconf_edit
+ * \brief One edit of a diff.
+ *
+ * The path gives the index of the object at each level from the root of
+ * the old tree, the last one being its index in its list.
+ */
+struct sconf_edit {
+	enum sconf_edit_op op;      /**< kind of edit */
+	const size_t *path;         /**< indexes from the root */
+	size_t depth;               /**< length of path, 0 for the root */
+	const struct sconf *old;    /**< object of the old tree, or NULL */
+	const struct sconf *value;  /**< object of the new tree, or NULL */
+};
+
+struct sconf_diff;
+
+/**
+ * \brief Compute the edits turning one tree into another.
+ *
+ * Subtrees are compared by hash, so identical regions cost one
+ * comparison each and a small change to a large tree is found in linear
+ * time. The elements of each list are matched so that the insertions and
+ * deletions are as few as possible; an insertion and a deletion at the
+ * same place become a replacement, or the edits between two lists with
+ * the same key (see sconf_assoc_get()), or between two lists without
+ * one. Edits are ordered last position first: every path is one of \p a
+ * and stays valid while the script is applied in order.
+ *
+ * \param a old tree
+ * \param b new tree, must outlive the diff
+ * \return Edit script, empty if the trees are equal, or NULL on error.
+ */
+struct sconf_diff *sconf_diff(const struct sconf *a, const struct sconf *b);
+
+/**
+ * \brief Return the number of edits in a diff.
+ * \param d diff
+ * \return Number of edits.
+ */
+size_t sconf_diff_count(const struct sconf_diff *d);
+
+/**
+ * \brief Return an edit of a diff.
+ * \param d diff
+ * \param i index of the edit
+ * \return Edit or NULL if \p i is out of bound.
+ */
+const struct sconf_edit *sconf_diff_edit(const struct sconf_diff *d,
+										 size_t i);
+
+/**
+ * \brief Apply a diff to a tree.
+ *
+ * The tree must have the shape of the old tree of the diff and must not
+ * belong to a document. Inserted and replacing objects are copied from
+ * the new tree and replaced objects are freed, except the root, which is
+ * changed in place so that it stays the same pointer.
+ *
+ * \param sexp tree to modify
+ * \param d diff
+ * \return SCONF_TRUE on success, SCONF_FALSE on error, in which case the
+ *         tree may be partly patched (SCONF_ERR_NOTALIST, and the tree left
+ *         untouched, if it belongs to a document).
+ */
+int sconf_patch(struct sconf *sexp, const struct sconf_diff *d);
+
+/**
+ * \brief Free a diff.
+ * \param d diff, may be NULL
+ */
+void sconf_diff_destroy(struct sconf_diff *d);
+
 /**
  * \brief Check if list is empty.
  * \param lst list root
@@ -189,6 +1034,296 @@ struct sconf *sconf_list_last(const struct sconf *lst);
  */
 int sconf_list_empty(const struct sconf *lst);
 
+/**
+ * \brief Version of the format written by sconf_save_binary().
+ */
+# define SCONF_BINARY_VERSION 1
+
+/**
+ * \brief Write an S-expression in binary form.
+ *
+ * The output starts with a magic number and SCONF_BINARY_VERSION,
+ * followed by the object counts, a table of the distinct strings and
+ * symbols and the objects in document order. It loads without any
+ * tokenizing, see sconf_load_binary().
+ *
+ * \param fp output stream
+ * \param sexp object to write
+ * \return SCONF_TRUE on success, SCONF_FALSE on error.
+ */
+int sconf_save_binary(FILE *fp, const struct sconf *sexp);
+
+/**
+ * \brief Load a document written by sconf_save_binary().
+ *
+ * The whole tree and its strings are allocated at once. Symbols are not
+ * interned, see sconf_doc_symbol().
+ *
+ * \param buf input buffer
+ * \param len buffer length
+ * \return Document or NULL on error (SCONF_ERR_FORMAT if the input is
+ *         malformed or from another version).
+ */
+struct sconf_doc *sconf_load_binary(const void *buf, size_t len);
+
+/**
+ * \brief Load a binary file written by sconf_save_binary().
+ *
+ * The file is read into a buffer owned by the document and strings are
+ * read in place.
+ *
+ * \param path file path
+ * \return Document or NULL on error.
+ * \see sconf_load_binary()
+ */
+struct sconf_doc *sconf_load_binary_path(const char *path);
+
+/**
+ * \struct sconf_pool
+ * \brief Compact read-only copy of a tree.
+ *
+ * Objects take 8 bytes and are referred to by 32-bit index: small
+ * integers, characters, booleans and nil are stored inline, strings and
+ * symbols once in a shared table. References are only checked by
+ * sconf_pool_to_tree(), other accessors expect a valid one.
+ */
+struct sconf_pool;
+
+/**
+ * \brief Reference to an object of a pool.
+ */
+typedef uint32_t sconf_ref;
+
+/**
+ * \brief No object, e.g. the first child of an empty list.
+ */
+# define SCONF_REF_NONE ((sconf_ref)0)
+
+/**
+ * \brief Parse S-expression straight into a pool.
+ * \param str input buffer
+ * \param len buffer length
+ * \param opts parsing options, may be NULL
+ * \return Pool or NULL on error, SCONF_ERR_OUTOFBOUND past 2^29 objects.
+ */
+struct sconf_pool *sconf_pool_parse(const char *str, size_t len,
+									const struct sconf_opts *opts);
+
+/**
+ * \brief Copy a tree into a pool.
+ * \param sexp tree root
+ * \return Pool or NULL on error.
+ */
+struct sconf_pool *sconf_pool_from_tree(const struct sconf *sexp);
+
+/**
+ * \brief Copy an object of a pool back into a tree.
+ * \param pool pool
+ * \param ref object
+ * \return Tree to free with sconf_destroy() or NULL on error.
+ */
+struct sconf *sconf_pool_to_tree(const struct sconf_pool *pool,
+								 sconf_ref ref);
+
+/**
+ * \brief Root object of a pool.
+ * \param pool pool
+ * \return Root reference.
+ */
+sconf_ref sconf_pool_root(const struct sconf_pool *pool);
+
+/**
+ * \brief Type of a pool object.
+ * \param pool pool
+ * \param ref object
+ * \return Object type.
+ */
+enum sconf_type sconf_pool_type(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief First element of a pool list.
+ * \param pool pool
+ * \param ref list
+ * \return First element or SCONF_REF_NONE if empty or not a list.
+ */
+sconf_ref sconf_pool_first(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief Next element in the list holding a pool object.
+ * \param pool pool
+ * \param ref object
+ * \return Next element or SCONF_REF_NONE.
+ */
+sconf_ref sconf_pool_next(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief Value of a pool integer, character or boolean.
+ * \param pool pool
+ * \param ref object
+ * \return Value or 0 for other types.
+ */
+int64_t sconf_pool_int(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief Value of a pool floating-point number.
+ * \param pool pool
+ * \param ref object
+ * \return Value or 0.0 for other types.
+ */
+double sconf_pool_double(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief Text of a pool string or symbol.
+ * \param pool pool
+ * \param ref object
+ * \return Null-terminated text or NULL for other types.
+ */
+const char *sconf_pool_string(const struct sconf_pool *pool, sconf_ref ref);
+
+/**
+ * \brief Memory held by a pool.
+ * \param pool pool
+ * \return Size in bytes, excluding unused capacity.
+ */
+size_t sconf_pool_memory(const struct sconf_pool *pool);
+
+/**
+ * \brief Free a pool.
+ * \param pool pool
+ */
+void sconf_pool_destroy(struct sconf_pool *pool);
+
+/**
+ * \struct sconf_tape
+ * \brief Flat read-only copy of a tree.
+ *
+ * Objects are laid out in document order in one array of 16-byte
+ * entries. Each list records its element count and where its subtree
+ * ends, so siblings are reached without walking their children. A tape
+ * is read through cursors.
+ */
+struct sconf_tape;
+
+/**
+ * \struct sconf_cursor
+ * \brief Position of an object in a tape.
+ *
+ * Cursors are plain values, copy one to remember a position. Accessors
+ * expect a cursor set by sconf_tape_cursor() or sconf_cursor_first().
+ */
+struct sconf_cursor {
+	const struct sconf_tape *tape; /**< tape read */
+	size_t pos;                    /**< entry of the object */
+	size_t end;                    /**< end of the enclosing list */
+};
+
+/**
+ * \brief Parse S-expression straight into a tape.
+ * \param str input buffer
+ * \param len buffer length
+ * \param opts parsing options, may be NULL
+ * \return Tape or NULL on error.
+ */
+struct sconf_tape *sconf_tape_parse(const char *str, size_t len,
+									const struct sconf_opts *opts);
+
+/**
+ * \brief Copy a tree into a tape.
+ * \param sexp object to copy
+ * \return Tape or NULL on error.
+ */
+struct sconf_tape *sconf_tape_from_tree(const struct sconf *sexp);
+
+/**
+ * \brief Set a cursor on the root object of a tape.
+ * \param tape tape
+ * \param cur cursor to set
+ * \return SCONF_TRUE on success, SCONF_FALSE on error.
+ */
+int sconf_tape_cursor(const struct sconf_tape *tape, struct sconf_cursor *cur);
+
+/**
+ * \brief Memory held by a tape.
+ * \param tape tape
+ * \return Size in bytes, excluding unused capacity.
+ */
+size_t sconf_tape_memory(const struct sconf_tape *tape);
+
+/**
+ * \brief Free a tape.
+ * \param tape tape
+ */
+void sconf_tape_destroy(struct sconf_tape *tape);
+
+/**
+ * \brief Type of the object under a cursor.
+ * \param cur cursor
+ * \return Object type.
+ */
+enum sconf_type sconf_cursor_type(const struct sconf_cursor *cur);
+
+/**
+ * \brief Move to the first element of a list.
+ * \param cur cursor on a list
+ * \param child cursor to set, may be cur
+ * \return SCONF_TRUE on success, SCONF_FALSE if not a list or empty.
+ */
+int sconf_cursor_first(const struct sconf_cursor *cur,
+					   struct sconf_cursor *child);
+
+/**
+ * \brief Move to the next element of the enclosing list.
+ *
+ * The subtree under the cursor is skipped in constant time.
+ *
+ * \param cur cursor
+ * \return SCONF_TRUE on success, SCONF_FALSE on the last element.
+ */
+int sconf_cursor_next(struct sconf_cursor *cur);
+
+/**
+ * \brief Entry following the subtree under a cursor.
+ * \param cur cursor
+ * \return Tape position past the object and all of its children.
+ */
+size_t sconf_cursor_skip(const struct sconf_cursor *cur);
+
+/**
+ * \brief Number of elements of a list.
+ * \param cur cursor on a list
+ * \return Element count, 0 if not a list.
+ */
+size_t sconf_cursor_count(const struct sconf_cursor *cur);
+
+/**
+ * \brief Value of an integer, character or boolean.
+ * \param cur cursor
+ * \return Value, 0 for other types.
+ */
+int64_t sconf_cursor_int(const struct sconf_cursor *cur);
+
+/**
+ * \brief Value of a floating-point number.
+ * \param cur cursor
+ * \return Value, 0.0 for other types.
+ */
+double sconf_cursor_double(const struct sconf_cursor *cur);
+
+/**
+ * \brief Text of a string or symbol.
+ * \param cur cursor
+ * \param len if not NULL, receive the length in bytes
+ * \return Null-terminated text owned by the tape, NULL for other types.
+ */
+const char *sconf_cursor_string(const struct sconf_cursor *cur, size_t *len);
+
+/**
+ * \brief Copy the object under a cursor into a tree.
+ * \param cur cursor
+ * \return New object, to be freed with sconf_destroy(), or NULL on error.
+ */
+struct sconf *sconf_cursor_to_tree(const struct sconf_cursor *cur);
+
 /**
  * \brief Free an S-expression object.
  */
@@ -196,9 +1331,35 @@ void sconf_destroy(struct sconf *sexp);
 
 /**
  * \brief Get the last error code.
+ *
+ * Errors are recorded per thread, so documents can be parsed on several
+ * threads at once.
  */
 enum sconf_error sconf_get_last_error(void);
 
+/**
+ * \struct sconf_location
+ * \brief Position of a parse error in the input.
+ */
+struct sconf_location {
+	size_t offset; /**< byte offset from the start of the input */
+	size_t line;   /**< line number, from 1 */
+	size_t column; /**< byte offset in the line, from 1 */
+};
+
+/**
+ * \brief Get where the last error happened.
+ *
+ * Only errors raised while parsing a buffer, a file or a reader have a
+ * location, errors of the push parser (sconf_stream_feed()) do not. The
+ * location is that of the first byte of the offending token.
+ *
+ * \param loc receive the location, may be NULL
+ * \return SCONF_TRUE if the last error has a location, SCONF_FALSE
+ *         otherwise.
+ */
+int sconf_get_error_location(struct sconf_location *loc);
+
 /**
  * \brief Convert an error code to a readable string.
  */
@@ -256,7 +1417,7 @@ sconf_is_list(const struct sconf *sexp)
 static inline char *
 sconf_get_string_value(const struct sconf *sexp)
 {
-	if (!sconf_is_string(sexp)) return (NULL);
+	if (!sconf_is_string(sexp) || (sexp->flags & SCONF_F_VIEW)) return (NULL);
 
 	return (sexp->value.as_string);
 }
@@ -265,7 +1426,7 @@ sconf_get_string_value(const struct sconf *sexp)
 static inline char *
 sconf_get_symbol_value(const struct sconf *sexp)
 {
-	if (!sconf_is_symbol(sexp)) return (NULL);
+	if (!sconf_is_symbol(sexp) || (sexp->flags & SCONF_F_VIEW)) return (NULL);
 
 	return (sexp->value.as_string);
 }
@@ -1,6 +1,9 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
 #include <cmocka.h>
 #include "sconf.h"
@@ -65,12 +68,457 @@ test_list(void **state)
 	sconf_destroy(lst);
 }
 
+static void
+test_list_index(void **state)
+{
+	struct sconf *items[100];
+	struct sconf *lst;
+	struct sconf *itm;
+	struct sconf nil;
+	char str[512];
+	size_t n;
+	int i;
+
+	/* the index is kept beside the list, not in every object */
+	if (sizeof(void *) == 8) assert_int_equal(sizeof(struct sconf), 32);
+
+	lst = sconf_new_list();
+	for (i = 0; i < 100; i++)
+	{
+		items[i] = sconf_new_int(i);
+		sconf_list_append(lst, items[i]);
+	}
+
+	assert_int_equal(sconf_list_index(lst), SCONF_TRUE);
+	assert_int_equal(sconf_list_size(lst), 100);
+	for (i = 0; i < 100; i++)
+	{
+		assert_ptr_equal(sconf_list_at(lst, i), items[i]);
+	}
+	assert_null(sconf_list_at(lst, 100));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_OUTOFBOUND);
+
+	/* modifications drop the index */
+	sconf_list_remove(lst, items[50]);
+	assert_int_equal(sconf_list_size(lst), 99);
+	assert_ptr_equal(sconf_list_at(lst, 50), items[51]);
+	assert_ptr_equal(sconf_list_at(lst, 98), items[99]);
+
+	itm = sconf_new_nil();
+	sconf_list_append(lst, itm);
+	assert_int_equal(sconf_list_index(lst), SCONF_TRUE);
+	assert_int_equal(sconf_list_size(lst), 100);
+	assert_ptr_equal(sconf_list_at(lst, 50), items[51]);
+	assert_ptr_equal(sconf_list_at(lst, 99), itm);
+
+	sconf_destroy(items[50]);
+	sconf_destroy(lst);
+
+	/* parsed lists come indexed: a node linked in by hand is not counted */
+	n = 0;
+	str[n++] = '(';
+	for (i = 0; i < 64; i++)
+	{
+		n += (size_t)snprintf(str + n, sizeof(str) - n, "%d ", i);
+	}
+	str[n++] = ')';
+	str[n] = '\0';
+	lst = sconf_parse(str);
+	assert_non_null(lst);
+	itm = sconf_list_last(lst);
+	memset(&nil, 0, sizeof(nil));
+	itm->next = &nil;
+	assert_int_equal(sconf_list_size(lst), 64);
+	assert_int_equal(sconf_list_at(lst, 63)->value.as_int, 63);
+	itm->next = NULL;
+	sconf_destroy(lst);
+
+	assert_int_equal(sconf_list_index(NULL), SCONF_FALSE);
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NOTALIST);
+	itm = sconf_new_int(1);
+	assert_int_equal(sconf_list_index(itm), SCONF_FALSE);
+	sconf_destroy(itm);
+}
+
+static void
+test_assoc_get(void **state)
+{
+	char key[16];
+	struct sconf *lst;
+	struct sconf *ent;
+	struct sconf *dup;
+	int n;
+	int i;
+
+	/* walk short lists, hash long ones */
+	for (n = 4; n <= 64; n *= 4)
+	{
+		lst = sconf_new_list();
+		for (i = 0; i < n; i++)
+		{
+			snprintf(key, sizeof(key), "key%d", i);
+			sconf_list_append(lst, sconf_new_list());
+			sconf_list_appends(sconf_list_last(lst), sconf_new_symbol(key),
+							   sconf_new_int(i), SCONF_END);
+		}
+		sconf_list_append(lst, sconf_new_int(42));
+		dup = sconf_new_list();
+		sconf_list_appends(dup, sconf_new_symbol("key1"), SCONF_END);
+		sconf_list_append(lst, dup);
+		assert_int_equal(sconf_list_index(lst), SCONF_TRUE);
+
+		for (i = 0; i < n; i++)
+		{
+			snprintf(key, sizeof(key), "key%d", i);
+			ent = sconf_assoc_get(lst, key);
+			assert_non_null(ent);
+			assert_int_equal(sconf_list_at(ent, 1)->value.as_int, i);
+		}
+		assert_null(sconf_assoc_get(lst, "key"));
+		assert_null(sconf_assoc_get(lst, "nope"));
+
+		/* removing an entry uncovers the duplicate */
+		ent = sconf_assoc_get(lst, "key1");
+		sconf_list_remove(lst, ent);
+		sconf_destroy(ent);
+		assert_ptr_equal(sconf_assoc_get(lst, "key1"), dup);
+		assert_int_equal(sconf_list_index(lst), SCONF_TRUE);
+		assert_ptr_equal(sconf_assoc_get(lst, "key1"), dup);
+
+		sconf_destroy(lst);
+	}
+
+	assert_null(sconf_assoc_get(NULL, "key"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NOTALIST);
+}
+
+static void
+test_assoc_get_parsed(void **state)
+{
+	char str[1024];
+	char key[16];
+	struct sconf_opts opts;
+	struct sconf_doc *doc;
+	struct sconf *roots[2];
+	struct sconf *ent;
+	struct sconf *last;
+	struct sconf *extra;
+	size_t n;
+	int i;
+
+	n = 0;
+	str[n++] = '(';
+	for (i = 0; i < 64; i++)
+	{
+		n += (size_t)snprintf(str + n, sizeof(str) - n, "(key%d %d) ", i, i);
+	}
+	n += (size_t)snprintf(str + n, sizeof(str) - n, "(key1 dup))");
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = SCONF_OPT_ZEROCOPY;
+	doc = sconf_doc_parse_opts(str, n, &opts);
+	assert_non_null(doc);
+	roots[0] = sconf_doc_root(doc);
+	roots[1] = sconf_parse(str);
+	assert_non_null(roots[1]);
+
+	/* both are hashed as they are parsed: an entry linked in by hand is
+	 * not found, and the first of two duplicates wins */
+	extra = sconf_new_list();
+	sconf_list_appends(extra, sconf_new_symbol("extra"), SCONF_END);
+	for (i = 0; i < 2; i++)
+	{
+		last = sconf_list_last(roots[i]);
+		last->next = extra;
+		assert_null(sconf_assoc_get(roots[i], "extra"));
+		last->next = NULL;
+
+		for (n = 0; n < 64; n++)
+		{
+			snprintf(key, sizeof(key), "key%zu", n);
+			ent = sconf_assoc_get(roots[i], key);
+			assert_non_null(ent);
+			assert_int_equal(sconf_list_at(ent, 1)->value.as_int, n);
+		}
+		assert_null(sconf_assoc_get(roots[i], "key"));
+	}
+
+	sconf_destroy(extra);
+	sconf_destroy(roots[1]);
+	sconf_doc_destroy(doc);
+}
+
+static void
+test_query(void **state)
+{
+	static const char src[] =
+		"((server (listen (port 80)) (listen (port 443)))"
+		"(upstreams (a (host \"h1\")) 7 (b (port 1) (host \"h2\"))"
+		" ((host \"h3\")))"
+		"(server (listen (port 8080))))";
+	static const int ports[] = { 80, 443, 8080 };
+	static const char *hosts[] = { "h1", "h2", "h3" };
+	struct sconf_query_iter it;
+	struct sconf_query *q;
+	struct sconf_doc *doc;
+	struct sconf *root;
+	struct sconf *ent;
+	int i;
+
+	root = sconf_parse(src);
+	doc = sconf_doc_parse(src, sizeof(src) - 1);
+	assert_non_null(root);
+	assert_non_null(doc);
+
+	q = sconf_query_compile("/server/listen/port");
+	assert_non_null(q);
+	sconf_query_exec(q, root, &it);
+	for (i = 0; (ent = sconf_query_next(&it)) != NULL; i++)
+	{
+		assert_true(i < 3);
+		assert_int_equal(sconf_list_at(ent, 1)->value.as_int, ports[i]);
+	}
+	assert_int_equal(i, 3);
+	assert_null(sconf_query_next(&it));
+
+	/* same query on symbols stored as views */
+	ent = sconf_query_get(q, sconf_doc_root(doc));
+	assert_non_null(ent);
+	assert_int_equal(sconf_list_at(ent, 1)->value.as_int, 80);
+	sconf_query_destroy(q);
+
+	q = sconf_query_compile("upstreams/*/host");
+	assert_non_null(q);
+	sconf_query_exec(q, root, &it);
+	for (i = 0; (ent = sconf_query_next(&it)) != NULL; i++)
+	{
+		assert_true(i < 3);
+		assert_string_equal(sconf_list_at(ent, 1)->value.as_string,
+							hosts[i]);
+	}
+	assert_int_equal(i, 3);
+	sconf_query_destroy(q);
+
+	q = sconf_query_compile("server/nope");
+	assert_null(sconf_query_get(q, root));
+	sconf_query_destroy(q);
+
+	assert_null(sconf_query_compile(""));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_QUERY);
+	assert_null(sconf_query_compile("a//b"));
+	assert_null(sconf_query_compile("a/"));
+	assert_null(sconf_query_compile("a/a/a/a/a/a/a/a/a/a/a/a/a/a/a/a/a"));
+	assert_non_null(q = sconf_query_compile("a/a/a/a/a/a/a/a/a/a/a/a/a/a/a/a"));
+	sconf_query_destroy(q);
+
+	sconf_doc_destroy(doc);
+	sconf_destroy(root);
+}
+
+static struct sconf *
+diff_random(int depth)
+{
+	struct sconf *lst;
+	char sym[8];
+	int n;
+
+	switch (rand() % ((depth > 0) ? 6 : 4))
+	{
+	case 0:
+		return (sconf_new_int(rand() % 8));
+	case 1:
+		snprintf(sym, sizeof(sym), "k%d", rand() % 4);
+		return (sconf_new_symbol(sym));
+	case 2:
+		return (sconf_new_string((rand() & 1) ? "a b" : "c\"d"));
+	case 3:
+		return (sconf_new_double((rand() & 1) ? 0.5 : 1.5));
+	default:
+		lst = sconf_new_list();
+		for (n = rand() % 6; n > 0; n--)
+		{
+			sconf_list_append(lst, diff_random(depth - 1));
+		}
+		return (lst);
+	}
+}
+
+/* make a few random changes anywhere in a list */
+static void
+diff_mutate(struct sconf *lst, int depth)
+{
+	struct sconf *itm;
+	struct sconf *next;
+
+	for (itm = sconf_list_first(lst); itm != NULL; itm = next)
+	{
+		next = itm->next;
+		switch (rand() % 8)
+		{
+		case 0:
+			sconf_list_remove(lst, itm);
+			sconf_destroy(itm);
+			break;
+		case 1:
+			if (itm->type == SCONF_T_INT) itm->value.as_int += 1;
+			break;
+		case 2:
+			if (itm->type == SCONF_T_LIST && depth > 0)
+			{
+				diff_mutate(itm, depth - 1);
+			}
+			break;
+		}
+	}
+	if (rand() % 3 == 0) sconf_list_append(lst, diff_random(depth));
+}
+
+static char *
+diff_text(const struct sconf *sexp)
+{
+	char *str;
+
+	str = sconf_write_str(sexp, 0, NULL);
+	assert_non_null(str);
+	return (str);
+}
+
+static void
+diff_check(struct sconf *a, const struct sconf *b)
+{
+	struct sconf_diff *d;
+	char *want;
+	char *got;
+
+	d = sconf_diff(a, b);
+	assert_non_null(d);
+	assert_int_equal(sconf_patch(a, d), SCONF_TRUE);
+	sconf_diff_destroy(d);
+
+	want = diff_text(b);
+	got = diff_text(a);
+	assert_string_equal(got, want);
+	sconf_free(want);
+	sconf_free(got);
+}
+
+static void
+test_diff(void **state)
+{
+	static const char *old =
+		"((server (listen (port 80)) (name \"x\")) (log 1) (user \"a\"))";
+	struct sconf_diff *d;
+	const struct sconf_edit *e;
+	struct sconf_doc *doc;
+	struct sconf *a;
+	struct sconf *b;
+	char *str;
+	int i;
+
+	a = sconf_parse(old);
+	b = sconf_parse(old);
+	d = sconf_diff(a, b);
+	assert_non_null(d);
+	assert_int_equal(sconf_diff_count(d), 0);
+	sconf_diff_destroy(d);
+	sconf_destroy(b);
+
+	/* a change deep down is one replacement, keyed by its path */
+	b = sconf_parse("((server (listen (port 81)) (name \"x\")) (log 1)"
+					" (user \"a\"))");
+	d = sconf_diff(a, b);
+	assert_int_equal(sconf_diff_count(d), 1);
+	e = sconf_diff_edit(d, 0);
+	assert_int_equal(e->op, SCONF_EDIT_REPLACE);
+	assert_int_equal(e->depth, 4);
+	assert_int_equal(e->path[0], 0);
+	assert_int_equal(e->path[1], 1);
+	assert_int_equal(e->path[2], 1);
+	assert_int_equal(e->path[3], 1);
+	assert_int_equal(e->old->value.as_int, 80);
+	assert_int_equal(e->value->value.as_int, 81);
+	assert_null(sconf_diff_edit(d, 1));
+	sconf_diff_destroy(d);
+	diff_check(a, b);
+	sconf_destroy(b);
+
+	/* entries added and removed, last position first */
+	b = sconf_parse("((server (listen (port 81)) (name \"x\")) (level 2)"
+					" (log 1))");
+	d = sconf_diff(a, b);
+	assert_int_equal(sconf_diff_count(d), 2);
+	e = sconf_diff_edit(d, 0);
+	assert_int_equal(e->op, SCONF_EDIT_DELETE);
+	assert_int_equal(e->path[0], 2);
+	e = sconf_diff_edit(d, 1);
+	assert_int_equal(e->op, SCONF_EDIT_INSERT);
+	assert_int_equal(e->path[0], 1);
+	str = diff_text(e->value);
+	assert_string_equal(str, "(level 2)");
+	sconf_free(str);
+	sconf_diff_destroy(d);
+	diff_check(a, b);
+	sconf_destroy(b);
+
+	/* the root itself */
+	b = sconf_new_int(7);
+	diff_check(a, b);
+	assert_int_equal(a->type, SCONF_T_INT);
+	sconf_destroy(b);
+	sconf_destroy(a);
+
+	/* too different for a shortest script */
+	a = sconf_new_list();
+	b = sconf_new_list();
+	for (i = 0; i < 2000; i++)
+	{
+		sconf_list_append(a, sconf_new_int(i));
+		sconf_list_append(b, sconf_new_int(i + (i % 2) * 5000));
+	}
+	diff_check(a, b);
+	sconf_destroy(a);
+	sconf_destroy(b);
+
+	srand(1);
+	for (i = 0; i < 500; i++)
+	{
+		a = sconf_new_list();
+		sconf_list_append(a, diff_random(4));
+		sconf_list_append(a, diff_random(4));
+		str = diff_text(a);
+		b = sconf_parse(str);
+		sconf_free(str);
+		diff_mutate(b, 4);
+		diff_check(a, b);
+		sconf_destroy(a);
+		sconf_destroy(b);
+	}
+
+	/* document trees live in an arena and cannot be patched */
+	doc = sconf_doc_parse(old, strlen(old));
+	assert_non_null(doc);
+	b = sconf_parse("((log 2))");
+	d = sconf_diff(sconf_doc_root(doc), b);
+	assert_non_null(d);
+	assert_int_equal(sconf_patch(sconf_doc_root(doc), d), SCONF_FALSE);
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NOTALIST);
+	assert_int_equal(sconf_list_size(sconf_doc_root(doc)), 3);
+	sconf_diff_destroy(d);
+	sconf_destroy(b);
+	sconf_doc_destroy(doc);
+}
+
 int
 main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_bool),
 		cmocka_unit_test(test_list),
+		cmocka_unit_test(test_list_index),
+		cmocka_unit_test(test_assoc_get),
+		cmocka_unit_test(test_assoc_get_parsed),
+		cmocka_unit_test(test_query),
+		cmocka_unit_test(test_diff),
 	};
 
 	cmocka_set_message_output(CM_OUTPUT_TAP);
@@ -1,10 +1,23 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <cmocka.h>
 #include "sconf.h"
 
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+# define HAVE_WATCHER 1
+#endif /* HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1 */
+
 static void
 test_parse_empty_list(void **state)
 {
@@ -217,6 +230,1400 @@ test_parse_char(void **state)
 	sconf_destroy(s);
 }
 
+static void
+test_doc_parse(void **state)
+{
+	const char *str = "(name \"libsconf\" (version 1) (tags a b c))";
+	struct sconf_doc *doc;
+	struct sconf *s;
+
+	doc = sconf_doc_parse(str, strlen(str));
+	assert_non_null(doc);
+
+	s = sconf_doc_root(doc);
+	assert_non_null(s);
+	assert_int_equal(s->type, SCONF_T_LIST);
+	assert_int_equal(sconf_list_size(s), 4);
+	assert_string_equal(sconf_get_symbol_value(sconf_list_at(s, 0)), "name");
+	assert_string_equal(sconf_get_string_value(sconf_list_at(s, 1)),
+						"libsconf");
+	assert_int_equal(sconf_list_size(sconf_list_last(s)), 4);
+
+	sconf_doc_destroy(doc);
+}
+
+static void
+test_doc_parse_unexpected_eof(void **state)
+{
+	const char *str = "(a (b \"c\" (d";
+
+	assert_null(sconf_doc_parse(str, strlen(str)));
+}
+
+static void
+test_doc_parse_zerocopy(void **state)
+{
+	const char *str = "(name \"libsconf\" \"a\\\"b\")";
+	struct sconf_opts opts;
+	struct sconf_doc *doc;
+	struct sconf *s;
+	const char *val;
+	size_t len;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = SCONF_OPT_ZEROCOPY;
+	doc = sconf_doc_parse_opts(str, strlen(str), &opts);
+	assert_non_null(doc);
+
+	s = sconf_list_at(sconf_doc_root(doc), 0);
+	assert_true(s->flags & SCONF_F_VIEW);
+	assert_null(sconf_get_symbol_value(s));
+	val = sconf_doc_string(doc, s, &len);
+	assert_ptr_equal(val, str + 1);
+	assert_int_equal(len, 4);
+
+	s = sconf_list_at(sconf_doc_root(doc), 1);
+	val = sconf_doc_string(doc, s, &len);
+	assert_ptr_equal(val, str + 7);
+	assert_int_equal(len, 8);
+
+	s = sconf_list_at(sconf_doc_root(doc), 2);
+	assert_true(s->flags & SCONF_F_ESCAPED);
+	val = sconf_doc_string(doc, s, &len);
+	assert_int_equal(len, 3);
+	assert_string_equal(val, "a\"b");
+	assert_false(s->flags & SCONF_F_VIEW);
+	assert_string_equal(sconf_get_string_value(s), "a\"b");
+
+	sconf_doc_destroy(doc);
+}
+
+static void
+test_load_fd_pipe(void **state)
+{
+	const char *str = "(a \"b\" c)";
+	struct sconf *s;
+	int fds[2];
+
+	assert_int_equal(pipe(fds), 0);
+	assert_int_equal(write(fds[1], str, strlen(str)), strlen(str));
+	close(fds[1]);
+
+	s = sconf_load_fd(fds[0]);
+	close(fds[0]);
+	assert_non_null(s);
+	assert_int_equal(sconf_list_size(s), 3);
+
+	sconf_destroy(s);
+}
+
+static void
+test_load_path(void **state)
+{
+	const char *str = "(name \"libsconf\")";
+	char path[] = "/tmp/sconf_testXXXXXX";
+	struct sconf_opts opts;
+	struct sconf_doc *doc;
+	struct sconf *s;
+	size_t len;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, str, strlen(str)), strlen(str));
+	close(fd);
+
+	s = sconf_load_path(path);
+	assert_non_null(s);
+	assert_string_equal(sconf_get_string_value(sconf_list_last(s)),
+						"libsconf");
+	sconf_destroy(s);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = SCONF_OPT_ZEROCOPY;
+	doc = sconf_doc_load_path(path, &opts);
+	assert_non_null(doc);
+	s = sconf_list_last(sconf_doc_root(doc));
+	assert_memory_equal(sconf_doc_string(doc, s, &len), "libsconf", 8);
+	assert_int_equal(len, 8);
+
+	/* views point into a copy, not into the file */
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fputs("(name \"xxxxxxxx\")", fp);
+	fclose(fp);
+	assert_memory_equal(sconf_doc_string(doc, s, &len), "libsconf", 8);
+	assert_int_equal(truncate(path, 0), 0);
+	assert_memory_equal(sconf_doc_string(doc, s, &len), "libsconf", 8);
+	sconf_doc_destroy(doc);
+
+	unlink(path);
+	assert_null(sconf_load_path(path));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_IO);
+}
+
+static int
+collect_form(struct sconf *sexp, void *ud)
+{
+	struct sconf *forms = (struct sconf *)ud;
+
+	return (sconf_list_append(forms, sexp));
+}
+
+static void
+test_stream_bytewise(void **state)
+{
+	const char *str = "; header (\n" \
+		"(rule \"a)\\\"b\" \\( ; ) comment\n 12) " \
+		"-12345 sym \"top\" (x (y (z)))\n 3.5";
+	struct sconf_stream *st;
+	struct sconf *forms;
+	struct sconf *s;
+	size_t i;
+
+	forms = sconf_new_list();
+	st = sconf_stream_new(collect_form, forms);
+	assert_non_null(st);
+
+	for (i = 0; i < strlen(str); i++)
+	{
+		assert_true(sconf_stream_feed(st, str + i, 1));
+	}
+	assert_int_equal(sconf_list_size(forms), 5);
+	assert_true(sconf_stream_finish(st));
+	assert_int_equal(sconf_list_size(forms), 6);
+
+	s = sconf_list_at(forms, 0);
+	assert_int_equal(sconf_list_size(s), 4);
+	assert_string_equal(sconf_get_string_value(sconf_list_at(s, 1)),
+						"a)\"b");
+	assert_int_equal(sconf_list_at(s, 2)->value.as_int, '(');
+	assert_int_equal(sconf_list_at(forms, 1)->value.as_int, -12345);
+	assert_string_equal(sconf_get_symbol_value(sconf_list_at(forms, 2)),
+						"sym");
+	assert_int_equal(sconf_list_at(forms, 5)->type, SCONF_T_DOUBLE);
+
+	/* whole input in one chunk gives the same forms */
+	assert_true(sconf_stream_feed(st, str, strlen(str)));
+	assert_true(sconf_stream_finish(st));
+	assert_int_equal(sconf_list_size(forms), 12);
+
+	assert_true(sconf_stream_feed(st, "(open", 5));
+	assert_false(sconf_stream_finish(st));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+
+	sconf_stream_destroy(st);
+	sconf_destroy(forms);
+}
+
+static void
+test_reader(void **state)
+{
+	const char *str = "(rule a) ; first\n(rule b)\n42 \"str\" (rule";
+	struct sconf_reader *rd;
+	struct sconf *s;
+
+	rd = sconf_reader_new(str, strlen(str));
+	assert_non_null(rd);
+
+	s = sconf_reader_next(rd);
+	assert_non_null(s);
+	assert_int_equal(sconf_list_size(s), 2);
+	assert_int_equal(sconf_reader_offset(rd), 8);
+	sconf_destroy(s);
+
+	s = sconf_reader_next(rd);
+	assert_non_null(s);
+	assert_int_equal(sconf_reader_offset(rd), 25);
+	sconf_destroy(s);
+
+	s = sconf_reader_next(rd);
+	assert_non_null(s);
+	assert_int_equal(s->value.as_int, 42);
+	sconf_destroy(s);
+
+	s = sconf_reader_next(rd);
+	assert_non_null(s);
+	assert_string_equal(sconf_get_string_value(s), "str");
+	sconf_destroy(s);
+
+	assert_null(sconf_reader_next(rd));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+	assert_null(sconf_reader_next(rd));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+
+	sconf_reader_destroy(rd);
+
+	rd = sconf_reader_new(str, 25);
+	sconf_destroy(sconf_reader_next(rd));
+	sconf_destroy(sconf_reader_next(rd));
+	assert_null(sconf_reader_next(rd));
+	assert_int_equal(sconf_get_last_error(), SCONF_OK);
+	sconf_reader_destroy(rd);
+}
+
+struct sax_count {
+	int depth;
+	int max_depth;
+	int atoms;
+	int port;
+	int want_port;
+	char last[16];
+};
+
+static int
+count_begin(void *ud)
+{
+	struct sax_count *cnt = (struct sax_count *)ud;
+
+	if (++cnt->depth > cnt->max_depth) cnt->max_depth = cnt->depth;
+	return (SCONF_TRUE);
+}
+
+static int
+count_end(void *ud)
+{
+	((struct sax_count *)ud)->depth--;
+	return (SCONF_TRUE);
+}
+
+static int
+count_symbol(void *ud, const char *sym, size_t len)
+{
+	struct sax_count *cnt = (struct sax_count *)ud;
+
+	cnt->atoms++;
+	cnt->want_port = (len == 4 && memcmp(sym, "port", 4) == 0);
+	return (SCONF_TRUE);
+}
+
+static int
+count_string(void *ud, const char *str, size_t len)
+{
+	struct sax_count *cnt = (struct sax_count *)ud;
+
+	cnt->atoms++;
+	memcpy(cnt->last, str, len);
+	cnt->last[len] = '\0';
+	return (SCONF_TRUE);
+}
+
+static int
+count_integer(void *ud, int64_t i)
+{
+	struct sax_count *cnt = (struct sax_count *)ud;
+
+	cnt->atoms++;
+	if (cnt->want_port)
+	{
+		cnt->port = i;
+		return (SCONF_FALSE); /* got what we wanted */
+	}
+	return (SCONF_TRUE);
+}
+
+static void
+test_sax_parse(void **state)
+{
+	const char *str = "(server (name \"w\\\"3\") (root true) (port 8080) nil)";
+	const struct sconf_handler h = {
+		count_begin, count_end, count_symbol, count_string, count_integer,
+		NULL, NULL, NULL, NULL
+	};
+	struct sax_count cnt;
+
+	memset(&cnt, 0, sizeof(cnt));
+	assert_false(sconf_sax_parse(str, strlen(str), &h, &cnt));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_ABORTED);
+	assert_int_equal(cnt.port, 8080);
+	assert_string_equal(cnt.last, "w\"3");
+	assert_int_equal(cnt.max_depth, 2);
+
+	memset(&cnt, 0, sizeof(cnt));
+	assert_true(sconf_sax_parse("(a (b \"c\") 1.5)", 16, &h, &cnt));
+	assert_int_equal(cnt.depth, 0);
+	assert_int_equal(cnt.atoms, 3);
+
+	memset(&cnt, 0, sizeof(cnt));
+	assert_false(sconf_sax_parse(str, 30, &h, &cnt));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+}
+
+static void
+test_parse_deep_nesting(void **state)
+{
+	const size_t depth = 100000;
+	struct sconf_opts opts;
+	struct sconf *s;
+	char *str;
+	FILE *fp;
+	size_t i;
+
+	str = (char *)malloc(depth * 2 + 1);
+	assert_non_null(str);
+	for (i = 0; i < depth; i++)
+	{
+		str[i] = '(';
+		str[depth * 2 - 1 - i] = ')';
+	}
+	str[depth * 2] = '\0';
+
+	s = sconf_parse(str);
+	assert_non_null(s);
+	sconf_destroy(s);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.max_depth = 64;
+	assert_null(sconf_parse_opts(str, depth * 2, &opts));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_DEPTH);
+
+	/* dump indents every level, keep the output reasonable */
+	s = sconf_parse(str + depth - 1000);
+	assert_non_null(s);
+	fp = fopen("/dev/null", "w");
+	assert_non_null(fp);
+	sconf_dump(fp, s);
+	fclose(fp);
+	sconf_destroy(s);
+
+	free(str);
+}
+
+static void
+test_parse_long_tokens(void **state)
+{
+	char str[512];
+	struct sconf *s;
+	struct sconf *t;
+	size_t pad;
+	size_t n;
+	size_t i;
+
+	/* run each token across every offset of a vector register */
+	for (pad = 0; pad < 40; pad++)
+	{
+		n = 0;
+		for (i = 0; i < pad; i++) str[n++] = ' ';
+		str[n++] = ';';
+		for (i = 0; i < 70; i++) str[n++] = 'c';
+		str[n++] = '\n';
+		str[n++] = '(';
+		for (i = 0; i < pad + 33; i++) str[n++] = 's';
+		str[n++] = '\t';
+		str[n++] = '"';
+		for (i = 0; i < pad + 20; i++) str[n++] = 'x';
+		memcpy(str + n, "\\n\\\"", 4);
+		n += 4;
+		for (i = 0; i < 40; i++) str[n++] = 'y';
+		str[n++] = '"';
+		str[n++] = ')';
+		str[n] = '\0';
+
+		s = sconf_parse_with_len(str, n);
+		assert_non_null(s);
+		assert_true(sconf_is_list(s));
+
+		t = sconf_list_at(s, 0);
+		assert_true(sconf_is_symbol(t));
+		assert_int_equal(strlen(sconf_get_symbol_value(t)), pad + 33);
+
+		t = sconf_list_at(s, 1);
+		assert_true(sconf_is_string(t));
+		assert_int_equal(strlen(sconf_get_string_value(t)), pad + 62);
+		assert_memory_equal(sconf_get_string_value(t) + pad + 20, "\n\"", 2);
+		sconf_destroy(s);
+
+		/* an unterminated string must not read past len */
+		assert_null(sconf_parse_with_len(str + pad + 72, n - pad - 74));
+		assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+	}
+}
+
+static void
+test_parse_char_classes(void **state)
+{
+	const char *str = "(\vcaf\xe9\xa0x\f-12\r\xb2)";
+	struct sconf *s;
+	struct sconf *t;
+
+	/* bytes above 0x7f are never blanks or digits, whatever the locale */
+	s = sconf_parse(str);
+	assert_non_null(s);
+	assert_null(sconf_list_at(s, 3));
+
+	t = sconf_list_at(s, 0);
+	assert_true(sconf_is_symbol(t));
+	assert_string_equal(sconf_get_symbol_value(t), "caf\xe9\xa0x");
+
+	t = sconf_list_at(s, 1);
+	assert_true(sconf_is_int(t));
+	assert_int_equal(t->value.as_int, -12);
+
+	t = sconf_list_at(s, 2);
+	assert_true(sconf_is_symbol(t));
+	assert_string_equal(sconf_get_symbol_value(t), "\xb2");
+	sconf_destroy(s);
+}
+
+static void
+test_parse_int64(void **state)
+{
+	struct sconf *s;
+
+	s = sconf_parse("(9223372036854775807 -9223372036854775808 0x7fffffffffffffff)");
+	assert_non_null(s);
+	assert_true(sconf_list_at(s, 0)->value.as_int == INT64_MAX);
+	assert_true(sconf_list_at(s, 1)->value.as_int == INT64_MIN);
+	assert_true(sconf_list_at(s, 2)->value.as_int == INT64_MAX);
+	sconf_destroy(s);
+
+	assert_null(sconf_parse("9223372036854775808"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_null(sconf_parse("(-9223372036854775809)"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_null(sconf_parse("0x10000000000000000"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_null(sconf_parse("(12abc)"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_null(sconf_parse("1e999"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+
+	/* a dash not followed by a digit is a symbol */
+	s = sconf_parse("(- -> -x)");
+	assert_non_null(s);
+	assert_string_equal(sconf_get_symbol_value(sconf_list_at(s, 0)), "-");
+	assert_string_equal(sconf_get_symbol_value(sconf_list_at(s, 1)), "->");
+	assert_string_equal(sconf_get_symbol_value(sconf_list_at(s, 2)), "-x");
+	sconf_destroy(s);
+}
+
+static void
+test_parse_double_exact(void **state)
+{
+	const char *nums[] = {
+		"0.1", "-0.0", "1e23", "8.98846567431158e307", "1.7976931348623157e308",
+		"2.2250738585072014e-308", "4.9e-324", "1e-400", "3.14159265358979323846",
+		"9007199254740993.0", "0.000001", "123456.789e-2",
+		"1.00000000000000011102230246251565404236316680908203125",
+		"7.038531e-26", "-.5", "1.", "1E+2", "12345678901234567890.5"
+	};
+	struct sconf *s;
+	size_t i;
+
+	for (i = 0; i < sizeof(nums) / sizeof(nums[0]); i++)
+	{
+		s = sconf_parse(nums[i]);
+		assert_non_null(s);
+		assert_int_equal(s->type, SCONF_T_DOUBLE);
+		assert_true(s->value.as_double == strtod(nums[i], NULL));
+		sconf_destroy(s);
+	}
+}
+
+static void
+test_doc_list_index(void **state)
+{
+	char str[512];
+	struct sconf_doc *doc;
+	struct sconf *root;
+	struct sconf *last;
+	struct sconf nil;
+	size_t n;
+	int i;
+
+	memset(&nil, 0, sizeof(nil));
+	n = 0;
+	str[n++] = '(';
+	for (i = 0; i < 64; i++)
+	{
+		n += (size_t)snprintf(str + n, sizeof(str) - n, "%d ", i);
+	}
+	str[n++] = ')';
+
+	doc = sconf_doc_parse(str, n);
+	assert_non_null(doc);
+	root = sconf_doc_root(doc);
+	assert_true(root->flags & SCONF_F_ARENA);
+
+	/* the parser indexed the list as it closed: a node linked in by hand
+	 * is not counted */
+	last = sconf_list_last(root);
+	last->next = &nil;
+	assert_int_equal(sconf_list_size(root), 64);
+	last->next = NULL;
+
+	/* document lists take their index from the arena */
+	assert_int_equal(sconf_list_index(root), SCONF_FALSE);
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NOTALIST);
+	assert_int_equal(sconf_doc_index(doc, root), SCONF_TRUE);
+	assert_int_equal(sconf_list_size(root), 64);
+	for (i = 63; i >= 0; i--)
+	{
+		assert_int_equal(sconf_list_at(root, i)->value.as_int, i);
+	}
+	assert_int_equal(sconf_doc_index(doc, sconf_list_at(root, 0)),
+					 SCONF_FALSE);
+
+	sconf_doc_destroy(doc);
+}
+
+static void
+test_doc_intern(void **state)
+{
+	const char *str = "((port 80) (port 81) (host \"port\") portx)";
+	struct sconf_opts opts;
+	struct sconf_doc *doc;
+	struct sconf_doc *view;
+	struct sconf *root;
+	struct sconf *a;
+	struct sconf *b;
+	const char *port;
+
+	doc = sconf_doc_parse(str, strlen(str));
+	assert_non_null(doc);
+	root = sconf_doc_root(doc);
+
+	a = sconf_list_at(sconf_list_at(root, 0), 0);
+	b = sconf_list_at(sconf_list_at(root, 1), 0);
+	assert_true(a->flags & SCONF_F_INTERNED);
+	assert_ptr_equal(sconf_get_symbol_value(a), sconf_get_symbol_value(b));
+	assert_true(sconf_symbol_eq(a, b));
+	assert_false(sconf_symbol_eq(a, sconf_list_at(root, 3)));
+
+	/* strings are not symbols, even with the same text */
+	assert_false(sconf_symbol_eq(a, sconf_list_at(sconf_list_at(root, 2), 1)));
+
+	port = sconf_doc_symbol(doc, "port");
+	assert_ptr_equal(port, sconf_get_symbol_value(a));
+	assert_null(sconf_doc_symbol(doc, "missing"));
+
+	/* views and plain objects compare by content */
+	memset(&opts, 0, sizeof(opts));
+	opts.flags = SCONF_OPT_ZEROCOPY;
+	view = sconf_doc_parse_opts(str, strlen(str), &opts);
+	assert_non_null(view);
+	b = sconf_list_at(sconf_list_at(sconf_doc_root(view), 0), 0);
+	assert_true(sconf_symbol_eq(a, b));
+	assert_null(sconf_doc_symbol(view, "port"));
+	sconf_doc_destroy(view);
+
+	b = sconf_new_symbol("port");
+	assert_true(sconf_symbol_eq(b, a));
+	sconf_destroy(b);
+
+	sconf_doc_destroy(doc);
+}
+
+static char *
+dump_str(const struct sconf *sexp)
+{
+	char *buf;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	assert_non_null(fp);
+	sconf_dump(fp, sexp);
+	fclose(fp);
+
+	return (buf);
+}
+
+static void
+test_pool(void **state)
+{
+	const char *str = "(name \"a\\\"b\" (42 -134217728 134217728 -9000000000)"
+		" 2.5 \\x yes () nil name)";
+	struct sconf_pool *pool;
+	struct sconf *tree;
+	struct sconf *back;
+	sconf_ref ref;
+	sconf_ref sub;
+	char *a;
+	char *b;
+
+	pool = sconf_pool_parse(str, strlen(str), NULL);
+	assert_non_null(pool);
+
+	ref = sconf_pool_first(pool, sconf_pool_root(pool));
+	assert_int_equal(sconf_pool_type(pool, ref), SCONF_T_SYMBOL);
+	assert_string_equal(sconf_pool_string(pool, ref), "name");
+
+	ref = sconf_pool_next(pool, ref);
+	assert_string_equal(sconf_pool_string(pool, ref), "a\"b");
+
+	ref = sconf_pool_next(pool, ref);
+	sub = sconf_pool_first(pool, ref);
+	assert_true(sconf_pool_int(pool, sub) == 42);
+	sub = sconf_pool_next(pool, sub);
+	assert_true(sconf_pool_int(pool, sub) == -134217728);
+	sub = sconf_pool_next(pool, sub);
+	assert_true(sconf_pool_int(pool, sub) == 134217728);
+	sub = sconf_pool_next(pool, sub);
+	assert_true(sconf_pool_int(pool, sub) == -9000000000);
+	assert_int_equal(sconf_pool_next(pool, sub), SCONF_REF_NONE);
+
+	ref = sconf_pool_next(pool, ref);
+	assert_true(sconf_pool_double(pool, ref) == 2.5);
+	ref = sconf_pool_next(pool, ref);
+	assert_int_equal(sconf_pool_type(pool, ref), SCONF_T_CHAR);
+	assert_int_equal(sconf_pool_int(pool, ref), 'x');
+	ref = sconf_pool_next(pool, ref);
+	assert_int_equal(sconf_pool_int(pool, ref), SCONF_TRUE);
+	ref = sconf_pool_next(pool, ref);
+	assert_int_equal(sconf_pool_first(pool, ref), SCONF_REF_NONE);
+
+	/* both copies of "name" share their bytes */
+	sub = sconf_pool_next(pool, sconf_pool_next(pool, ref));
+	assert_ptr_equal(sconf_pool_string(pool, sub),
+					 sconf_pool_string(pool, sconf_pool_first(pool,
+											  sconf_pool_root(pool))));
+
+	/* tree -> pool -> tree keeps everything */
+	tree = sconf_parse(str);
+	assert_non_null(tree);
+	sconf_pool_destroy(pool);
+	pool = sconf_pool_from_tree(tree);
+	assert_non_null(pool);
+	back = sconf_pool_to_tree(pool, sconf_pool_root(pool));
+	assert_non_null(back);
+
+	a = dump_str(tree);
+	b = dump_str(back);
+	assert_string_equal(a, b);
+	assert_true(sconf_pool_memory(pool) < 20 * sizeof(struct sconf));
+
+	free(a);
+	free(b);
+	sconf_destroy(back);
+	sconf_destroy(tree);
+	sconf_pool_destroy(pool);
+}
+
+static void
+test_tape(void **state)
+{
+	const char *str = "(conf (a 1 (2 3)) () (b \"x\\\"y\" 2.5) \\c yes)";
+	struct sconf_tape *tape;
+	struct sconf_cursor root;
+	struct sconf_cursor cur;
+	struct sconf_cursor sub;
+	struct sconf *tree;
+	struct sconf *back;
+	size_t len;
+	char *a;
+	char *b;
+
+	tape = sconf_tape_parse(str, strlen(str), NULL);
+	assert_non_null(tape);
+	assert_true(sconf_tape_cursor(tape, &root));
+	assert_int_equal(sconf_cursor_type(&root), SCONF_T_LIST);
+	assert_int_equal(sconf_cursor_count(&root), 6);
+	assert_int_equal(sconf_cursor_skip(&root), 15);
+
+	assert_true(sconf_cursor_first(&root, &cur));
+	assert_string_equal(sconf_cursor_string(&cur, &len), "conf");
+	assert_int_equal(len, 4);
+
+	/* (a 1 (2 3)) is stepped over at once */
+	assert_true(sconf_cursor_next(&cur));
+	assert_int_equal(sconf_cursor_count(&cur), 3);
+	assert_int_equal(sconf_cursor_skip(&cur), cur.pos + 6);
+	sub = cur;
+	assert_true(sconf_cursor_first(&sub, &sub));
+	assert_true(sconf_cursor_next(&sub));
+	assert_true(sconf_cursor_int(&sub) == 1);
+	assert_true(sconf_cursor_next(&sub));
+	assert_false(sconf_cursor_next(&sub));
+
+	assert_true(sconf_cursor_next(&cur));
+	assert_int_equal(sconf_cursor_count(&cur), 0);
+	assert_false(sconf_cursor_first(&cur, &sub));
+
+	assert_true(sconf_cursor_next(&cur));
+	assert_true(sconf_cursor_first(&cur, &sub));
+	assert_true(sconf_cursor_next(&sub));
+	assert_string_equal(sconf_cursor_string(&sub, NULL), "x\"y");
+	assert_true(sconf_cursor_next(&sub));
+	assert_true(sconf_cursor_double(&sub) == 2.5);
+
+	assert_true(sconf_cursor_next(&cur));
+	assert_int_equal(sconf_cursor_type(&cur), SCONF_T_CHAR);
+	assert_int_equal(sconf_cursor_int(&cur), 'c');
+	assert_true(sconf_cursor_next(&cur));
+	assert_int_equal(sconf_cursor_int(&cur), SCONF_TRUE);
+	assert_false(sconf_cursor_next(&cur));
+
+	/* tree -> tape -> tree keeps everything */
+	tree = sconf_parse(str);
+	assert_non_null(tree);
+	sconf_tape_destroy(tape);
+	tape = sconf_tape_from_tree(tree);
+	assert_non_null(tape);
+	assert_true(sconf_tape_cursor(tape, &root));
+	back = sconf_cursor_to_tree(&root);
+	assert_non_null(back);
+
+	a = dump_str(tree);
+	b = dump_str(back);
+	assert_string_equal(a, b);
+
+	free(a);
+	free(b);
+	sconf_destroy(back);
+	sconf_destroy(tree);
+	sconf_tape_destroy(tape);
+}
+
+static void
+test_binary(void **state)
+{
+	const char *str = "(conf (name \"a\\\"b\") (ports 80 -443 9000000000)"
+		" (ratio 0.1) () \\x yes nil name)";
+	char path[] = "/tmp/sconf_testXXXXXX";
+	struct sconf_doc *doc;
+	struct sconf *tree;
+	char *buf;
+	size_t len;
+	char *a;
+	char *b;
+	FILE *fp;
+	int fd;
+
+	tree = sconf_parse(str);
+	assert_non_null(tree);
+	fp = open_memstream(&buf, &len);
+	assert_non_null(fp);
+	assert_true(sconf_save_binary(fp, tree));
+	fclose(fp);
+	a = dump_str(tree);
+
+	doc = sconf_load_binary(buf, len);
+	assert_non_null(doc);
+	b = dump_str(sconf_doc_root(doc));
+	assert_string_equal(a, b);
+	free(b);
+	sconf_doc_destroy(doc);
+
+	/* strings are read straight from the file */
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, buf, len), len);
+	close(fd);
+	doc = sconf_load_binary_path(path);
+	unlink(path);
+	assert_non_null(doc);
+	b = dump_str(sconf_doc_root(doc));
+	assert_string_equal(a, b);
+	free(b);
+	sconf_doc_destroy(doc);
+
+	assert_null(sconf_load_binary(buf, len - 1));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_FORMAT);
+	assert_null(sconf_load_binary(str, strlen(str)));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_FORMAT);
+	buf[4]++;
+	assert_null(sconf_load_binary(buf, len));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_FORMAT);
+
+	free(a);
+	free(buf);
+	sconf_destroy(tree);
+}
+
+static int
+count_chunks(void *ud, const char *buf, size_t len)
+{
+	(void)buf;
+	(*(size_t *)ud) += len;
+	return (SCONF_TRUE);
+}
+
+static void
+test_write(void **state)
+{
+	const char *str = "(conf (a \"q\\\"b\\\\s\\n\\tx\" 0.1 -2.5e-300 1e21 +inf.0)"
+		" (b \\space \\x -9223372036854775808) () nil yes)";
+	static const char *badsyms[] = {
+		"true", "no", "nil", "+nan.0", "12", "-3", "-.5", "a b", "", "x)y",
+		"(", "\"s", "\\c", ";c", "a\nb"
+	};
+	struct sconf *tree;
+	struct sconf *back;
+	size_t total;
+	size_t len;
+	size_t i;
+	char *a;
+	char *b;
+
+	tree = sconf_parse(str);
+	assert_non_null(tree);
+	assert_string_equal(sconf_get_string_value(sconf_list_at(
+						sconf_list_at(tree, 1), 1)), "q\"b\\s\n\tx");
+
+	a = sconf_write_str(tree, 0, &len);
+	assert_non_null(a);
+	assert_string_equal(a, "(conf (a \"q\\\"b\\\\s\\n\\tx\" 0.1 -2.5e-300 1e21"
+						" +inf.0) (b \\space \\x -9223372036854775808) () nil"
+						" true)");
+	assert_int_equal(len, strlen(a));
+
+	/* parse(write(x)) == x */
+	back = sconf_parse(a);
+	assert_non_null(back);
+	b = sconf_write_str(back, 0, NULL);
+	assert_string_equal(a, b);
+	free(b);
+	sconf_destroy(back);
+
+	b = sconf_write_str(tree, SCONF_WRITE_PRETTY, NULL);
+	assert_string_equal(b, "(conf\n  (a \"q\\\"b\\\\s\\n\\tx\" 0.1 -2.5e-300 1e21"
+						" +inf.0)\n  (b \\space \\x -9223372036854775808)\n"
+						"  () nil true)");
+	free(b);
+
+	total = 0;
+	assert_true(sconf_write(tree, 0, count_chunks, &total));
+	assert_int_equal(total, len);
+
+	free(a);
+	sconf_destroy(tree);
+
+	/* symbols that would read back as something else are refused */
+	for (i = 0; i < sizeof(badsyms) / sizeof(badsyms[0]); i++)
+	{
+		tree = sconf_new_list();
+		sconf_list_appends(tree, sconf_new_symbol("key"),
+						   sconf_new_symbol(badsyms[i]), SCONF_END);
+		assert_null(sconf_write_str(tree, 0, NULL));
+		assert_int_equal(sconf_get_last_error(), SCONF_ERR_SYMBOL);
+		sconf_destroy(tree);
+	}
+
+	tree = sconf_new_symbol("-x.y;z\\\"");
+	a = sconf_write_str(tree, 0, NULL);
+	assert_string_equal(a, "-x.y;z\\\"");
+	back = sconf_parse(a);
+	assert_int_equal(back->type, SCONF_T_SYMBOL);
+	assert_string_equal(sconf_get_symbol_value(back), "-x.y;z\\\"");
+	sconf_destroy(back);
+	free(a);
+	sconf_destroy(tree);
+}
+
+static void *
+parse_bad_number(void *arg)
+{
+	(void)arg;
+	return (sconf_parse("(a 12x)"));
+}
+
+static void
+test_error_location(void **state)
+{
+	const char *bad = "(a\n  (b 12x)\n  c)";
+	struct sconf_location loc;
+	pthread_t th;
+	void *ret;
+
+	assert_null(sconf_parse(bad));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_true(sconf_get_error_location(&loc));
+	assert_int_equal(loc.offset, 8);
+	assert_int_equal(loc.line, 2);
+	assert_int_equal(loc.column, 6);
+
+	assert_null(sconf_parse("(a\n (b \"c)\n"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+	assert_true(sconf_get_error_location(&loc));
+	assert_int_equal(loc.line, 2);
+	assert_int_equal(loc.column, 5);
+
+	assert_null(sconf_parse("(a \\"));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+
+	/* errors of other threads are not seen here */
+	assert_int_equal(pthread_create(&th, NULL, parse_bad_number, NULL), 0);
+	assert_int_equal(pthread_join(th, &ret), 0);
+	assert_null(ret);
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+	assert_true(sconf_get_error_location(&loc));
+	assert_int_equal(loc.offset, 3);
+}
+
+static void
+test_doc_parse_parallel(void **state)
+{
+	struct sconf_location loc;
+	struct sconf_doc *doc;
+	struct sconf *form;
+	size_t cap = 4 * 1024 * 1024;
+	size_t len;
+	size_t line;
+	size_t off;
+	char *buf;
+	char *tok;
+	int i;
+
+	/* lines starting with '(' inside strings and lists are not cuts */
+	buf = malloc(cap);
+	assert_non_null(buf);
+	len = 0;
+	for (i = 0; len < cap - 256; i++)
+	{
+		switch (i % 3)
+		{
+		case 0:
+			len += sprintf(buf + len, "(entry %d \"text\n(not a form)\n\")\n", i);
+			break;
+		case 1:
+			len += sprintf(buf + len, "(group %d\n(a 1)\n(b 2))\n", i);
+			break;
+		default:
+			len += sprintf(buf + len, "; (comment)\n(item %d)\n", i);
+			break;
+		}
+	}
+
+	doc = sconf_doc_parse_parallel(buf, len, 4, NULL);
+	assert_non_null(doc);
+	assert_int_equal(sconf_list_size(sconf_doc_root(doc)), i);
+	i = 0;
+	for (form = sconf_list_first(sconf_doc_root(doc)); form != NULL;
+		 form = form->next)
+	{
+		assert_int_equal(sconf_list_at(form, 1)->value.as_int, i++);
+	}
+	assert_int_equal(sconf_list_size(sconf_list_at(sconf_doc_root(doc), 1)), 4);
+	sconf_doc_destroy(doc);
+
+	/* errors are located in the whole input */
+	tok = strstr(buf + len / 2, "(item ") + 6;
+	tok[strcspn(tok, ")") - 1] = 'x';
+	assert_null(sconf_doc_parse_parallel(buf, len, 4, NULL));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_NUMBER);
+	assert_true(sconf_get_error_location(&loc));
+	assert_int_equal(loc.offset, tok - buf);
+	for (line = 1, off = 0; off < loc.offset; off++)
+	{
+		line += (buf[off] == '\n');
+	}
+	assert_int_equal(loc.line, line);
+
+	/* only the end of the input is an unexpected end */
+	tok[strcspn(tok, ")") - 1] = '0';
+	assert_null(sconf_doc_parse_parallel(buf, len - 2, 4, NULL));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+
+	free(buf);
+}
+
+/* counts live bytes and refuses to go over its limit */
+struct budget {
+	size_t used;
+	size_t limit;
+};
+
+#define BUDGET_HDR 16
+
+static void *
+budget_alloc(void *ud, size_t size)
+{
+	struct budget *b = (struct budget *)ud;
+	char *p;
+
+	if (b->used + size > b->limit) return (NULL);
+
+	p = malloc(size + BUDGET_HDR);
+	if (p == NULL) return (NULL);
+
+	memcpy(p, &size, sizeof(size));
+	b->used += size;
+	return (p + BUDGET_HDR);
+}
+
+static void *
+budget_realloc(void *ud, void *ptr, size_t size)
+{
+	struct budget *b = (struct budget *)ud;
+	char *p = (char *)ptr - BUDGET_HDR;
+	size_t old;
+
+	memcpy(&old, p, sizeof(old));
+	if (b->used - old + size > b->limit) return (NULL);
+
+	p = realloc(p, size + BUDGET_HDR);
+	if (p == NULL) return (NULL);
+
+	memcpy(p, &size, sizeof(size));
+	b->used = b->used - old + size;
+	return (p + BUDGET_HDR);
+}
+
+static void
+budget_free(void *ud, void *ptr)
+{
+	struct budget *b = (struct budget *)ud;
+	char *p = (char *)ptr - BUDGET_HDR;
+	size_t old;
+
+	memcpy(&old, p, sizeof(old));
+	b->used -= old;
+	free(p);
+}
+
+static void
+test_allocator(void **state)
+{
+	const char *str = "((name \"libsconf\") (ports 80 443) (tags a b c d e f g h i"
+		" j k l m n o p q r s t u v w x y z))";
+	struct budget b = { 0, (size_t)-1 };
+	struct sconf_allocator mem = {
+		budget_alloc, budget_realloc, budget_free, &b
+	};
+	struct sconf_opts opts = { 0, 0, &mem };
+	struct sconf_doc *doc;
+	struct sconf *s;
+	size_t peak;
+	char *out;
+
+	/* documents take everything from their allocator */
+	doc = sconf_doc_parse_opts(str, strlen(str), &opts);
+	assert_non_null(doc);
+	assert_true(b.used > 0);
+	peak = b.used;
+	sconf_doc_destroy(doc);
+	assert_int_equal(b.used, 0);
+
+	/* a hard cap fails the parse cleanly */
+	b.limit = peak / 2;
+	assert_null(sconf_doc_parse_opts(str, strlen(str), &opts));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_MALLOC);
+	assert_int_equal(b.used, 0);
+
+	/* trees and the writer use the default allocator */
+	b.limit = (size_t)-1;
+	sconf_set_allocator(&mem);
+	s = sconf_parse(str);
+	assert_non_null(s);
+	assert_non_null(sconf_assoc_get(s, "tags"));
+	out = sconf_write_str(s, 0, NULL);
+	assert_non_null(out);
+	assert_true(b.used > 0);
+	sconf_free(out);
+	sconf_destroy(s);
+	assert_int_equal(b.used, 0);
+	sconf_set_allocator(NULL);
+}
+
+static void
+test_snapshot(void **state)
+{
+	char str[1024];
+	struct sconf_snapshot *snap;
+	struct sconf_snapshot *old;
+	struct sconf_current *cur;
+	struct sconf_doc *doc;
+	struct sconf *name;
+	const char *ptr;
+	size_t len;
+	size_t n;
+	int i;
+
+	n = (size_t)snprintf(str, sizeof(str), "((name \"a\\tb\")");
+	for (i = 0; i < 40; i++)
+	{
+		n += (size_t)snprintf(str + n, sizeof(str) - n, " (k%d %d)", i, i);
+	}
+	str[n++] = ')';
+
+	doc = sconf_doc_parse(str, n);
+	assert_non_null(doc);
+	snap = sconf_snapshot_new(doc);
+	assert_non_null(snap);
+
+	/* nothing is left to fill in lazily */
+	name = sconf_list_at(sconf_snapshot_root(snap), 0);
+	assert_false(sconf_list_at(name, 1)->flags & SCONF_F_VIEW);
+	ptr = sconf_doc_string(NULL, sconf_list_at(name, 1), &len);
+	assert_int_equal(len, 3);
+	assert_memory_equal(ptr, "a\tb", 3);
+
+	cur = sconf_current_new(snap);
+	assert_non_null(cur);
+	old = sconf_current_get(cur);
+	assert_ptr_equal(old, snap);
+
+	doc = sconf_doc_parse("((name \"c\"))", 13);
+	assert_non_null(doc);
+	sconf_current_publish(cur, sconf_snapshot_new(doc));
+
+	/* the old version lives on until its last reader lets go */
+	assert_ptr_equal(sconf_assoc_get(sconf_snapshot_root(old), "k39"),
+					 sconf_list_at(sconf_snapshot_root(old), 40));
+	sconf_snapshot_release(old);
+
+	snap = sconf_current_get(cur);
+	assert_non_null(snap);
+	assert_ptr_not_equal(snap, old);
+	name = sconf_assoc_get(sconf_snapshot_root(snap), "name");
+	assert_string_equal(sconf_list_at(name, 1)->value.as_string, "c");
+	sconf_current_destroy(cur);
+	sconf_snapshot_release(snap);
+
+	cur = sconf_current_new(NULL);
+	assert_null(sconf_current_get(cur));
+	sconf_current_destroy(cur);
+}
+
+static void *
+snapshot_reader(void *arg)
+{
+	struct sconf_current *cur;
+	struct sconf_snapshot *snap;
+	struct sconf *gen;
+	int bad;
+	int i;
+
+	cur = (struct sconf_current *)arg;
+	bad = 0;
+	for (i = 0; i < 20000; i++)
+	{
+		snap = sconf_current_get(cur);
+		gen = sconf_assoc_get(sconf_snapshot_root(snap), "gen");
+		if (gen == NULL || sconf_list_at(gen, 1)->value.as_int < 0) bad++;
+		sconf_snapshot_release(snap);
+	}
+
+	return (bad ? arg : NULL);
+}
+
+static void *
+snapshot_publisher(void *arg)
+{
+	struct sconf_current *cur;
+	struct sconf_doc *doc;
+	char str[32];
+	int n;
+	int i;
+
+	cur = (struct sconf_current *)arg;
+	for (i = 0; i < 500; i++)
+	{
+		n = snprintf(str, sizeof(str), "((gen %d))", i);
+		doc = sconf_doc_parse(str, (size_t)n);
+		if (doc == NULL) return (arg);
+		sconf_current_publish(cur, sconf_snapshot_new(doc));
+	}
+
+	return (NULL);
+}
+
+static void
+test_snapshot_threads(void **state)
+{
+	struct sconf_current *cur;
+	pthread_t th[6];
+	void *ret;
+	int i;
+
+	/* readers must never see a snapshot freed under them */
+	cur = sconf_current_new(sconf_snapshot_new(sconf_doc_parse("((gen 0))",
+																9)));
+	assert_non_null(cur);
+	for (i = 0; i < 4; i++)
+	{
+		assert_int_equal(pthread_create(&th[i], NULL, snapshot_reader, cur),
+						 0);
+	}
+	for (; i < 6; i++)
+	{
+		assert_int_equal(pthread_create(&th[i], NULL, snapshot_publisher,
+										cur), 0);
+	}
+	for (i = 0; i < 6; i++)
+	{
+		assert_int_equal(pthread_join(th[i], &ret), 0);
+		assert_null(ret);
+	}
+
+	sconf_current_destroy(cur);
+}
+
+struct reload_event {
+	unsigned int calls;
+	unsigned long generation;
+	enum sconf_error err;
+	int64_t port;
+};
+
+struct reload_log {
+	pthread_mutex_t lock;
+	struct reload_event last;
+};
+
+static int64_t
+reload_port(const struct sconf *root)
+{
+	struct sconf *port;
+
+	port = sconf_assoc_get(root, "port");
+	return ((port != NULL) ? sconf_list_at(port, 1)->value.as_int : -1);
+}
+
+static int
+reload_validate(void *ud, const struct sconf *root)
+{
+	(void)ud;
+	return ((reload_port(root) > 0) ? SCONF_TRUE : SCONF_FALSE);
+}
+
+static void
+reload_changed(void *ud, struct sconf_snapshot *snap,
+			   unsigned long generation, enum sconf_error err)
+{
+	struct reload_log *log;
+
+	log = (struct reload_log *)ud;
+	pthread_mutex_lock(&log->lock);
+	log->last.calls++;
+	log->last.generation = generation;
+	log->last.err = err;
+	log->last.port = -1;
+	if (snap != NULL) log->last.port = reload_port(sconf_snapshot_root(snap));
+	pthread_mutex_unlock(&log->lock);
+}
+
+static void
+reload_write(const char *path, const char *str)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	assert_int_equal(fwrite(str, 1, strlen(str), fp), strlen(str));
+	assert_int_equal(fclose(fp), 0);
+}
+
+/*
+ * Wait for the watcher to report the nth reload, and copy out the last.
+ * Without inotify nothing watches the file, reload it here instead.
+ */
+static void
+reload_wait(struct sconf_reload *rl, struct reload_log *log,
+			unsigned int calls, struct reload_event *ev)
+{
+	int i;
+
+#ifdef HAVE_WATCHER
+	(void)rl;
+#else
+	pthread_mutex_lock(&log->lock);
+	i = (log->last.calls < calls);
+	pthread_mutex_unlock(&log->lock);
+	if (i) sconf_reload_now(rl);
+#endif /* HAVE_WATCHER */
+
+	for (i = 0; i < 500; i++)
+	{
+		pthread_mutex_lock(&log->lock);
+		*ev = log->last;
+		pthread_mutex_unlock(&log->lock);
+		if (ev->calls >= calls) break;
+		usleep(10000);
+	}
+	assert_true(ev->calls >= calls);
+}
+
+static void
+test_reload(void **state)
+{
+	char path[] = "/tmp/sconf_testXXXXXX";
+	char next[sizeof(path) + 4];
+	struct sconf_reload_opts opts;
+	struct sconf_opts parse;
+	struct sconf_snapshot *snap;
+	struct sconf_reload *rl;
+	struct reload_event ev;
+	struct reload_log log;
+	int fd;
+
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	close(fd);
+	reload_write(path, "((port 80))");
+
+	memset(&log, 0, sizeof(log));
+	pthread_mutex_init(&log.lock, NULL);
+	memset(&opts, 0, sizeof(opts));
+	opts.validate = reload_validate;
+	opts.changed = reload_changed;
+	opts.ud = &log;
+
+	rl = sconf_reload_new(path, &opts);
+	assert_non_null(rl);
+	assert_int_equal(sconf_reload_generation(rl), 1);
+	reload_wait(rl, &log, 1, &ev);
+	assert_int_equal(ev.calls, 1);
+	snap = sconf_reload_get(rl);
+	assert_int_equal(reload_port(sconf_snapshot_root(snap)), 80);
+
+	/* rewritten in place */
+	reload_write(path, "((port 81))");
+	reload_wait(rl, &log, 2, &ev);
+	assert_int_equal(ev.err, SCONF_OK);
+	assert_int_equal(ev.port, 81);
+	assert_int_equal(sconf_reload_generation(rl), 2);
+
+	/* the old version is still there for its reader */
+	assert_int_equal(reload_port(sconf_snapshot_root(snap)), 80);
+	sconf_snapshot_release(snap);
+
+	/* replaced by a rename */
+	snprintf(next, sizeof(next), "%s.new", path);
+	reload_write(next, "((port 82))");
+	assert_int_equal(rename(next, path), 0);
+	reload_wait(rl, &log, 3, &ev);
+	assert_int_equal(ev.generation, 3);
+
+	/* rejected versions are not published */
+	reload_write(path, "((port 0))");
+	reload_wait(rl, &log, 4, &ev);
+	assert_int_equal(ev.err, SCONF_ERR_ABORTED);
+	reload_write(path, "((port 83)");
+	reload_wait(rl, &log, 5, &ev);
+	assert_int_equal(ev.err, SCONF_ERR_EOF);
+	assert_int_equal(sconf_reload_generation(rl), 3);
+	snap = sconf_reload_get(rl);
+	assert_int_equal(reload_port(sconf_snapshot_root(snap)), 82);
+	sconf_snapshot_release(snap);
+
+	assert_int_equal(sconf_reload_now(rl), SCONF_FALSE);
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_EOF);
+
+	sconf_reload_destroy(rl);
+	pthread_mutex_destroy(&log.lock);
+
+	/* versions own their bytes: truncating the file leaves them intact */
+	memset(&parse, 0, sizeof(parse));
+	parse.flags = SCONF_OPT_ZEROCOPY;
+	memset(&opts, 0, sizeof(opts));
+	opts.parse = &parse;
+	reload_write(path, "((port 84))");
+	rl = sconf_reload_new(path, &opts);
+	assert_non_null(rl);
+	snap = sconf_reload_get(rl);
+	sconf_reload_destroy(rl);
+	assert_int_equal(truncate(path, 0), 0);
+	assert_int_equal(reload_port(sconf_snapshot_root(snap)), 84);
+	sconf_snapshot_release(snap);
+	unlink(path);
+
+	assert_null(sconf_reload_new(path, NULL));
+	assert_int_equal(sconf_get_last_error(), SCONF_ERR_IO);
+}
+
 int
 main(void)
 {
@@ -236,6 +1643,31 @@ main(void)
 		cmocka_unit_test(test_parse_list_of_string),
 		cmocka_unit_test(test_parse_string_unexpected_eof),
 		cmocka_unit_test(test_parse_char),
+		cmocka_unit_test(test_doc_parse),
+		cmocka_unit_test(test_doc_parse_unexpected_eof),
+		cmocka_unit_test(test_doc_parse_zerocopy),
+		cmocka_unit_test(test_load_fd_pipe),
+		cmocka_unit_test(test_load_path),
+		cmocka_unit_test(test_stream_bytewise),
+		cmocka_unit_test(test_reader),
+		cmocka_unit_test(test_sax_parse),
+		cmocka_unit_test(test_parse_deep_nesting),
+		cmocka_unit_test(test_parse_long_tokens),
+		cmocka_unit_test(test_parse_char_classes),
+		cmocka_unit_test(test_parse_int64),
+		cmocka_unit_test(test_parse_double_exact),
+		cmocka_unit_test(test_doc_list_index),
+		cmocka_unit_test(test_doc_intern),
+		cmocka_unit_test(test_pool),
+		cmocka_unit_test(test_tape),
+		cmocka_unit_test(test_binary),
+		cmocka_unit_test(test_write),
+		cmocka_unit_test(test_error_location),
+		cmocka_unit_test(test_doc_parse_parallel),
+		cmocka_unit_test(test_allocator),
+		cmocka_unit_test(test_snapshot),
+		cmocka_unit_test(test_snapshot_threads),
+		cmocka_unit_test(test_reload),
 	};
 
 	cmocka_set_message_output(CM_OUTPUT_TAP);
@@ -0,0 +1,102 @@
+/*
+ * sconfc - convert S-expression files to the libsconf binary format
+ *
+ * usage: sconfc [-d] input [output]
+ *
+ * Writes to stdout when no output is given. With -d the input is a
+ * binary file and is printed back as text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sconf.h"
+
+static void
+usage(const char *prg)
+{
+	fprintf(stderr, "usage: %s [-d] input [output]\n", prg);
+	exit(EXIT_FAILURE);
+}
+
+static int
+fail(const char *what)
+{
+	fprintf(stderr, "sconfc: %s: %s\n", what,
+			sconf_error_str(sconf_get_last_error()));
+	return (EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sconf_doc *doc;
+	struct sconf *root;
+	const char *input;
+	const char *output;
+	int decode;
+	int ret;
+	FILE *fp;
+
+	decode = 0;
+	if (argc > 1 && strcmp(argv[1], "-d") == 0)
+	{
+		decode = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 2 || argc > 3) usage(argv[0]);
+
+	input = argv[1];
+	output = (argc == 3) ? argv[2] : NULL;
+
+	fp = stdout;
+	if (output != NULL)
+	{
+		fp = fopen(output, decode ? "w" : "wb");
+		if (fp == NULL)
+		{
+			perror(output);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	ret = EXIT_SUCCESS;
+	if (decode)
+	{
+		doc = sconf_load_binary_path(input);
+		if (doc == NULL)
+		{
+			ret = fail(input);
+		}
+		else
+		{
+			sconf_dump(fp, sconf_doc_root(doc));
+			fputc('\n', fp);
+			sconf_doc_destroy(doc);
+		}
+	}
+	else
+	{
+		root = sconf_load_path(input);
+		if (root == NULL)
+		{
+			ret = fail(input);
+		}
+		else
+		{
+			if (sconf_save_binary(fp, root) != SCONF_TRUE)
+			{
+				ret = fail(output != NULL ? output : "stdout");
+			}
+			sconf_destroy(root);
+		}
+	}
+
+	if (output != NULL && fclose(fp) != 0)
+	{
+		perror(output);
+		ret = EXIT_FAILURE;
+	}
+
+	return (ret);
+}